@@ -0,0 +1,424 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cuckoohashmap.h"
+#include "flathashmap.h"
+#include "hashmap.h"
+#include "inlinehashmap.h"
+#include "lockfreehashmap.h"
+
+//
+// YCSB-style benchmark. Every combination of the map, key type, key
+// distribution, workload, record count and thread count given on the command
+// line is run, and a CSV line with the throughput and latency percentiles is
+// printed for it. Options take comma separated lists:
+//
+//   --maps=hashmap,lockfree,flat,cuckoo,inline,std
+//                                      maps to run, std is the
+//                                      std::unordered_map+mutex baseline;
+//                                      inline runs with int keys only
+//   --keys=int,string                  key types
+//   --dists=uniform,zipf               key distributions
+//   --workloads=A,B,C,W                mixes of operations, see WORKLOADS
+//   --records=1000,1000000             number of keys loaded before the run
+//   --threads=1,2,4                    number of threads
+//   --ops=N                            operations per thread
+//
+// Reads and updates draw their keys from the loaded records, so they always
+// find them. Inserts draw theirs from as many other keys, which aren't loaded,
+// and removes take the oldest key inserted by the same thread, so the number
+// of keys stays about the same during a run. Latency is sampled for one of
+// every LATENCY_SAMPLE operations.
+//
+
+constexpr unsigned LATENCY_SAMPLE = 8;
+constexpr double ZIPF_THETA = 0.99;
+
+struct Workload
+{
+    const char *name;
+    unsigned read, update, insert, remove;      // Percentages
+};
+
+const Workload WORKLOADS[] = {
+    {"A", 50, 50, 0, 0},        // Update heavy
+    {"B", 95, 5, 0, 0},         // Read mostly
+    {"C", 100, 0, 0, 0},        // Read only
+    {"W", 50, 10, 20, 20},      // Write heavy, with inserts and removes
+};
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key) const
+    {
+        return key * 2654435761u;
+    }
+};
+
+class StringHash
+{
+public:
+    unsigned operator()(const std::string &key) const
+    {
+        // FNV-1a
+        unsigned h = 2166136261u;
+
+        for (char c : key)
+            h = (h ^ (unsigned char)c) * 16777619u;
+        return h;
+    }
+};
+
+//
+// The baseline, std::unordered_map behind a single mutex.
+//
+template <class K, class V, class F>
+class StdHashMap
+{
+    std::unordered_map<K, V, F> _map;
+    std::mutex _mutex;
+
+public:
+    StdHashMap(size_t size)
+    {
+        _map.reserve(size);
+    }
+
+    bool exists(const K &key)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _map.find(key) != _map.end();
+    }
+
+    void insert(const K &key, const V &value)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _map[key] = value;
+    }
+
+    void remove(const K &key)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_map.erase(key) == 0)
+            throw std::out_of_range("StdHashMap: key doesn't exists");
+    }
+};
+
+//
+// Zipfian distribution over [0, n), as in YCSB (Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases"). Ranks are scattered over
+// the key range, so the popular keys aren't neighbours.
+//
+class Zipfian
+{
+    uint64_t _n;
+    double _alpha, _zetan, _eta, _half;
+
+public:
+    Zipfian(uint64_t n, double theta) : _n(n)
+    {
+        _zetan = 0;
+        for (uint64_t i = 1; i <= n; ++i)
+            _zetan += 1 / std::pow((double)i, theta);
+        _half = 1 + std::pow(0.5, theta);      // zeta(2)
+        _alpha = 1 / (1 - theta);
+        _eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - _half / _zetan);
+    }
+
+    uint64_t operator()(double u) const
+    {
+        double uz = u * _zetan;
+        uint64_t rank;
+
+        if (uz < 1)
+            rank = 0;
+        else if (uz < _half)
+            rank = 1;
+        else
+            rank = (uint64_t)(_n * std::pow(_eta * u - _eta + 1, _alpha));
+        rank = std::min(rank, _n - 1);
+
+        // Scatter the rank with a 64-bit mix
+        rank ^= rank >> 33;
+        rank *= 0xff51afd7ed558ccdull;
+        rank ^= rank >> 33;
+        return rank % _n;
+    }
+};
+
+struct Result
+{
+    double mops;
+    double p50, p99, p999;      // Nanoseconds
+};
+
+template <class Map, class K>
+void worker(Map *map, const std::vector<K> *keys, const Workload *w,
+            const Zipfian *zipf, unsigned ops, unsigned id,
+            std::vector<uint32_t> *latencies)
+{
+    std::mt19937_64 rng(id * 7919 + 1);
+    std::uniform_real_distribution<double> unit(0, 1);
+    size_t records = keys->size() / 2;
+    std::deque<size_t> inserted;        // Oldest first
+
+    latencies->reserve(ops / LATENCY_SAMPLE + 1);
+
+    for (unsigned i = 0; i < ops; ++i)
+    {
+        uint64_t r = rng();
+        size_t index = zipf ? (*zipf)(unit(rng)) : r % records;
+        unsigned op = (r >> 40) % 100;
+
+        // Removes take the oldest key this thread inserted, inserts take one
+        // past the loaded ones.
+        if (op >= w->read + w->update + w->insert && !inserted.empty())
+        {
+            index = inserted.front();
+            inserted.pop_front();
+        }
+        else if (op >= w->read + w->update)
+        {
+            index += records;
+            if (op < w->read + w->update + w->insert)
+                inserted.push_back(index);
+        }
+
+        const K &key = (*keys)[index];
+        bool sample = i % LATENCY_SAMPLE == 0;
+        std::chrono::steady_clock::time_point start;
+
+        if (sample)
+            start = std::chrono::steady_clock::now();
+
+        if (op < w->read)
+        {
+            map->exists(key);
+        }
+        else if (op < w->read + w->update + w->insert)
+        {
+            map->insert(key, i);
+        }
+        else
+        {
+            try
+            {
+                map->remove(key);
+            }
+            catch (std::out_of_range &e)
+            {
+            }
+        }
+
+        if (sample)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            latencies->push_back((uint32_t)std::min<int64_t>(ns, UINT32_MAX));
+        }
+    }
+}
+
+template <class Map, class K>
+Result run(const std::vector<K> &keys, const Workload &w, const Zipfian *zipf,
+           unsigned threads, unsigned ops)
+{
+    Map map(keys.size());
+
+    for (size_t i = 0; i < keys.size() / 2; ++i)
+        map.insert(keys[i], i);
+
+    std::vector<std::vector<uint32_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back(worker<Map, K>, &map, &keys, &w, zipf, ops, t,
+                             &latencies[t]);
+    for (auto &t : workers)
+        t.join();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::vector<uint32_t> all;
+    for (auto &l : latencies)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0.0 : (double)all[(size_t)(p * (all.size() - 1))];
+    };
+
+    return {threads * double(ops) / elapsed.count() / 1e6,
+            percentile(0.5), percentile(0.99), percentile(0.999)};
+}
+
+template <class K, class F>
+Result runMap(const std::string &map, const std::vector<K> &keys,
+              const Workload &w, const Zipfian *zipf, unsigned threads,
+              unsigned ops)
+{
+    if (map == "hashmap")
+        return run<HashMap<K, unsigned, F>>(keys, w, zipf, threads, ops);
+    if (map == "lockfree")
+        return run<LockFreeHashMap<K, unsigned, F>>(keys, w, zipf, threads,
+                                                     ops);
+    if (map == "flat")
+        return run<FlatHashMap<K, unsigned, F>>(keys, w, zipf, threads, ops);
+    if (map == "cuckoo")
+        return run<CuckooHashMap<K, unsigned, F>>(keys, w, zipf, threads,
+                                                   ops);
+    if constexpr (IsInlineable<K, unsigned>::value)
+        if (map == "inline")
+            return run<InlineHashMap<K, unsigned, F>>(keys, w, zipf, threads,
+                                                      ops);
+    if (map == "std")
+        return run<StdHashMap<K, unsigned, F>>(keys, w, zipf, threads, ops);
+    throw std::invalid_argument("bench: unknown map " + map);
+}
+
+std::vector<std::string> split(const std::string &list)
+{
+    std::vector<std::string> items;
+    size_t start = 0, end;
+
+    while ((end = list.find(',', start)) != std::string::npos)
+    {
+        items.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    items.push_back(list.substr(start));
+    return items;
+}
+
+std::vector<std::string> stringKeys(size_t records)
+{
+    std::vector<std::string> keys;
+    char buf[32];
+
+    keys.reserve(records);
+    for (size_t i = 0; i < records; ++i)
+    {
+        std::snprintf(buf, sizeof buf, "user%016" PRIx64,
+                      (uint64_t)(i * 0x9e3779b97f4a7c15ull));
+        keys.push_back(buf);
+    }
+    return keys;
+}
+
+std::vector<unsigned> intKeys(size_t records)
+{
+    std::vector<unsigned> keys(records);
+
+    for (size_t i = 0; i < records; ++i)
+        keys[i] = (unsigned)i;
+    return keys;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string maps = "hashmap,lockfree,flat,cuckoo,std",
+                keyTypes = "int,string",
+                dists = "uniform,zipf", workloads = "A,B,C,W",
+                records = "1000,1000000", threads = "1,2,4,8";
+    unsigned ops = 200000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "--maps")
+            maps = value;
+        else if (name == "--keys")
+            keyTypes = value;
+        else if (name == "--dists")
+            dists = value;
+        else if (name == "--workloads")
+            workloads = value;
+        else if (name == "--records")
+            records = value;
+        else if (name == "--threads")
+            threads = value;
+        else if (name == "--ops")
+            ops = std::stoul(value);
+        else
+        {
+            std::fprintf(stderr, "bench: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::printf("map,keys,dist,workload,records,threads,mops,"
+                "p50_ns,p99_ns,p999_ns\n");
+
+    for (const std::string &recordsItem : split(records))
+    {
+        size_t n = std::stoull(recordsItem);
+        Zipfian zipf(n, ZIPF_THETA);
+
+        for (const std::string &keyType : split(keyTypes))
+        {
+            std::vector<unsigned> ints;
+            std::vector<std::string> strings;
+
+            // The records, and as many keys for inserts
+            if (keyType == "int")
+                ints = intKeys(2 * n);
+            else if (keyType == "string")
+                strings = stringKeys(2 * n);
+            else
+            {
+                std::fprintf(stderr, "bench: unknown keys %s\n",
+                             keyType.c_str());
+                return 1;
+            }
+
+            for (const std::string &dist : split(dists))
+            for (const std::string &name : split(workloads))
+            for (const std::string &threadsItem : split(threads))
+            for (const std::string &map : split(maps))
+            {
+                const Workload *w = nullptr;
+                for (const Workload &candidate : WORKLOADS)
+                    if (name == candidate.name)
+                        w = &candidate;
+                if (w == nullptr || (dist != "uniform" && dist != "zipf"))
+                {
+                    std::fprintf(stderr, "bench: unknown workload %s/%s\n",
+                                 dist.c_str(), name.c_str());
+                    return 1;
+                }
+
+                const Zipfian *z = dist == "zipf" ? &zipf : nullptr;
+                unsigned t = std::stoul(threadsItem);
+                Result r = keyType == "int"
+                    ? runMap<unsigned, UnsignedHash>(map, ints, *w, z, t, ops)
+                    : runMap<std::string, StringHash>(map, strings, *w, z, t,
+                                                      ops);
+
+                std::printf("%s,%s,%s,%s,%zu,%u,%.3f,%.0f,%.0f,%.0f\n",
+                            map.c_str(), keyType.c_str(), dist.c_str(),
+                            w->name, n, t, r.mops, r.p50, r.p99, r.p999);
+                std::fflush(stdout);
+            }
+        }
+    }
+}
@@ -0,0 +1,481 @@
+// The MIT License (MIT)
+//
+// Thread-safe generic bounded cache built on HashMap
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CACHEHASHMAP_H
+#define CACHEHASHMAP_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "hashmap.h"
+
+//
+// CacheHashMap is a HashMap with a capacity. Once the total weight of its
+// entries (by default one per entry, or as given by a weigher) would exceed
+// the capacity, inserts evict entries chosen by the CLOCK algorithm, an
+// approximation of LRU. Entries can also have a time to live, after which
+// lookups treat them as missing and remove them. An eviction callback is told
+// about entries evicted for capacity or expiry, after the locks are released.
+//
+// Expiry is lazy: an expired entry is only dropped by a lookup of it, or when
+// the clock hand passes it while making room. exists() doesn't see it, but
+// until then it still counts in getCount() and getWeight().
+//
+// Keys are split into segments, each one with its own share of the capacity,
+// its own clock and its own mutex, so there is no global lock. Lookups take
+// no lock at all: they read the entry from the HashMap, and mark it as
+// referenced by setting a flag in it, which the clock hand clears as it
+// passes. Inserts and removes lock the key's segment, and then its HashMap
+// stripe.
+//
+// An entry weighing more than the share of a segment, getSegmentCapacity(),
+// is never stored: it is evicted right away, with reason Capacity. With a
+// byte weigher and the default 64 segments, that is any entry over 1/64 of
+// the capacity.
+//
+template <class K, class V, class F = DefaultHash<K>,
+          template <class> class A = PoolAllocator>
+class CacheHashMap
+{
+public:
+    enum class EvictionReason
+    {
+        Capacity,
+        Expired
+    };
+
+    typedef std::function<void(const K &, const V &, EvictionReason)>
+        EvictionCallback;
+    typedef std::function<size_t(const K &, const V &)> Weigher;
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    //
+    // Value stored in the HashMap. Elements of HashMap are immutable, except
+    // for the referenced flag, which lookups set without locking.
+    //
+    struct Entry
+    {
+        V value;
+        int64_t expiry;             // In Clock ticks, 0 if never
+        uint64_t id;                // Unique within the segment
+        size_t slot;                // Index in the segment's clock
+        mutable std::atomic<bool> referenced;
+
+        Entry(const V &v, int64_t e, uint64_t i, size_t s, bool r)
+            : value(v), expiry(e), id(i), slot(s), referenced(r) {}
+
+        Entry(const Entry &other)
+            : value(other.value), expiry(other.expiry), id(other.id),
+              slot(other.slot), referenced(other.referenced.load()) {}
+    };
+
+    struct Slot
+    {
+        K key;
+        uint64_t id;
+        size_t weight;
+        bool used;
+    };
+
+    //
+    // Segment of the cache. The clock is a ring of slots, one for each entry
+    // of the segment, which the hand walks over. Slots of removed entries are
+    // reused.
+    //
+    struct alignas(64) Segment
+    {
+        std::mutex mutex;
+        std::vector<Slot> clock;
+        std::vector<size_t> freeSlots;
+        size_t hand = 0;
+        uint64_t nextId = 0;
+        std::atomic<size_t> weight{0};
+    };
+
+    struct Evicted
+    {
+        K key;
+        V value;
+        EvictionReason reason;
+    };
+
+    typedef HashMap<K, Entry, F, A> Map;
+    typedef typename Map::HashCode HashCode;
+
+    Map _map;
+    size_t _segmentCount;
+    Segment *_segments;
+    size_t _capacity;
+    size_t _segmentCapacity;
+    Clock::duration _defaultTtl;
+    Weigher _weigher;
+    EvictionCallback _onEvict;
+
+    // Segments are picked by the high bits of the hash code of the HashMap,
+    // which is then passed to it, so keys are hashed once.
+    Segment &segmentFor(HashCode h)
+    {
+        return _segments[(h.value >> 32) & (_segmentCount - 1)];
+    }
+
+    size_t weigh(const K &key, const V &value)
+    {
+        return _weigher ? _weigher(key, value) : 1;
+    }
+
+    static bool isExpired(const Entry &e, int64_t now)
+    {
+        return e.expiry != 0 && now >= e.expiry;
+    }
+
+    static int64_t now()
+    {
+        return Clock::now().time_since_epoch().count();
+    }
+
+    bool removeLocked(Segment &seg, const K &key, HashCode h, uint64_t id,
+                      std::vector<Evicted> *evicted, EvictionReason reason);
+    void makeRoom(Segment &seg, size_t weight, size_t keep,
+                  std::vector<Evicted> &evicted);
+    void notify(std::vector<Evicted> &evicted);
+
+public:
+    static constexpr size_t DEFAULT_SEGMENTS = 64;
+
+    //
+    // Creates a cache holding entries of total weight up to capacity. ttl is
+    // the time to live of entries inserted without one, zero meaning forever.
+    // Every entry weighs one unless a weigher is set, e.g. one returning the
+    // size of the entry in bytes for a byte capacity.
+    //
+    CacheHashMap(size_t capacity,
+                 Clock::duration ttl = Clock::duration::zero(),
+                 size_t segmentCount = DEFAULT_SEGMENTS);
+    ~CacheHashMap() { delete [] _segments; }
+
+    CacheHashMap(const CacheHashMap &) = delete;
+    CacheHashMap &operator=(const CacheHashMap &) = delete;
+
+    void setEvictionCallback(EvictionCallback fn) { _onEvict = fn; }
+    void setWeigher(Weigher fn) { _weigher = fn; }
+
+    bool exists(const K &key);
+    V lookup(const K &key);
+    V operator[](const K &key) { return lookup(key); }
+
+    void insert(const K &key, const V &value)
+    {
+        insert(key, value, _defaultTtl);
+    }
+
+    void insert(const K &key, const V &value, Clock::duration ttl);
+    void remove(const K &key);
+
+    size_t getCount() { return _map.getCount(); }
+    size_t getCapacity() const { return _capacity; }
+    size_t getSegmentCapacity() const { return _segmentCapacity; }
+    size_t getWeight();
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the CacheHashMap methods
+//====----------------------------------------------------------------------====
+
+//
+// The segment count is rounded down to a power of two, and so that every
+// segment can hold at least one entry.
+//
+template <class K, class V, class F, template <class> class A>
+CacheHashMap<K, V, F, A>::CacheHashMap(size_t capacity, Clock::duration ttl,
+                                       size_t segmentCount)
+    : _map(capacity), _capacity(capacity), _defaultTtl(ttl)
+{
+    _segmentCount = 1;
+    while (_segmentCount * 2 <= segmentCount &&
+           _segmentCount * 2 <= capacity)
+        _segmentCount *= 2;
+
+    _segments = new Segment[_segmentCount];
+    _segmentCapacity = (capacity + _segmentCount - 1) / _segmentCount;
+}
+
+//
+// Removes the entry of key with given id from the locked segment, and frees
+// its slot. If evicted isn't nullptr, the entry is added to it with reason.
+// Returns false if key isn't there, or has another id.
+//
+template <class K, class V, class F, template <class> class A>
+bool CacheHashMap<K, V, F, A>::removeLocked(Segment &seg, const K &key,
+                                            HashCode h, uint64_t id,
+                                            std::vector<Evicted> *evicted,
+                                            EvictionReason reason)
+{
+    size_t slot = 0;
+    bool removed = _map.eraseIf(key, h, [&](const Entry &e) {
+        if (e.id != id)
+            return false;
+        if (evicted != nullptr && _onEvict)
+            evicted->push_back({key, e.value, reason});
+        slot = e.slot;
+        return true;
+    });
+
+    if (removed)
+    {
+        seg.weight.fetch_sub(seg.clock[slot].weight);
+        seg.clock[slot].used = false;
+        seg.freeSlots.push_back(slot);
+    }
+    return removed;
+}
+
+//
+// Evicts entries from the locked segment, except the one in slot keep, until
+// weight more fits in. The hand skips entries referenced since it passed them
+// last, and clears their flag, so it evicts within two rounds. Expired entries
+// are evicted regardless.
+//
+template <class K, class V, class F, template <class> class A>
+void CacheHashMap<K, V, F, A>::makeRoom(Segment &seg, size_t weight,
+                                        size_t keep,
+                                        std::vector<Evicted> &evicted)
+{
+    size_t pinned = keep < seg.clock.size() ? 1 : 0;
+    int64_t time = 0;
+
+    while (seg.weight.load() + weight > _segmentCapacity &&
+           seg.clock.size() - seg.freeSlots.size() > pinned)
+    {
+        seg.hand = (seg.hand + 1) % seg.clock.size();
+
+        Slot &slot = seg.clock[seg.hand];
+        if (!slot.used || seg.hand == keep)
+            continue;
+
+        HashCode h = _map.hashOf(slot.key);
+        auto handle = _map.find(slot.key, h);
+        if (!handle || handle->id != slot.id)
+        {
+            // Can't happen while all writers lock the segment, but don't let
+            // a lost slot stop the clock.
+            slot.used = false;
+            seg.weight.fetch_sub(slot.weight);
+            seg.freeSlots.push_back(seg.hand);
+            continue;
+        }
+
+        if (handle->expiry != 0 && time == 0)
+            time = now();
+
+        EvictionReason reason = isExpired(*handle, time)
+                                    ? EvictionReason::Expired
+                                    : EvictionReason::Capacity;
+
+        if (reason == EvictionReason::Capacity &&
+            handle->referenced.load(std::memory_order_relaxed))
+        {
+            handle->referenced.store(false, std::memory_order_relaxed);
+            continue;
+        }
+
+        K key = slot.key;
+        removeLocked(seg, key, h, slot.id, &evicted, reason);
+    }
+}
+
+//
+// Calls the eviction callback for evicted entries. It is called with no lock
+// held, so the callback may use the cache.
+//
+template <class K, class V, class F, template <class> class A>
+void CacheHashMap<K, V, F, A>::notify(std::vector<Evicted> &evicted)
+{
+    if (_onEvict)
+        for (Evicted &e : evicted)
+            _onEvict(e.key, e.value, e.reason);
+}
+
+//
+// Inserts key with value, replacing the value of an existing key. Entries are
+// evicted first if the segment of the key has no room left. An entry heavier
+// than the capacity of a segment only removes the existing one of key, and is
+// evicted itself.
+//
+template <class K, class V, class F, template <class> class A>
+void CacheHashMap<K, V, F, A>::insert(const K &key, const V &value,
+                                      Clock::duration ttl)
+{
+    HashCode h = _map.hashOf(key);
+    Segment &seg = segmentFor(h);
+    size_t weight = weigh(key, value);
+    int64_t expiry = ttl == Clock::duration::zero()
+                         ? 0
+                         : (Clock::now() + ttl).time_since_epoch().count();
+    std::vector<Evicted> evicted;
+
+    if (weight > _segmentCapacity)
+    {
+        {
+            // Lock access to the clock of the segment.
+            std::lock_guard<std::mutex> lock(seg.mutex);
+            auto handle = _map.find(key, h);
+
+            if (handle)
+                removeLocked(seg, key, h, handle->id, nullptr,
+                             EvictionReason::Capacity);
+        }
+
+        if (_onEvict)
+            _onEvict(key, value, EvictionReason::Capacity);
+        return;
+    }
+
+    {
+        // Lock access to the clock of the segment.
+        std::lock_guard<std::mutex> lock(seg.mutex);
+        size_t slot = 0;
+        bool replaced = _map.computeIfPresent(key, h, [&](const Entry &old) {
+            slot = old.slot;
+            return Entry(value, expiry, old.id, old.slot, true);
+        });
+
+        if (replaced)
+        {
+            seg.weight.fetch_sub(seg.clock[slot].weight);
+            seg.clock[slot].weight = 0;
+            makeRoom(seg, weight, slot, evicted);
+            seg.clock[slot].weight = weight;
+            seg.weight.fetch_add(weight);
+        }
+        else
+        {
+            makeRoom(seg, weight, SIZE_MAX, evicted);
+
+            if (seg.freeSlots.empty())
+            {
+                slot = seg.clock.size();
+                seg.clock.push_back(Slot());
+            }
+            else
+            {
+                slot = seg.freeSlots.back();
+                seg.freeSlots.pop_back();
+            }
+
+            uint64_t id = ++seg.nextId;
+            seg.clock[slot] = {key, id, weight, true};
+            seg.weight.fetch_add(weight);
+            _map.insert(key, Entry(value, expiry, id, slot, false), h);
+        }
+    }
+
+    notify(evicted);
+}
+
+//
+// Removes key. If key doesn't exists it throws "out of range" exception.
+//
+template <class K, class V, class F, template <class> class A>
+void CacheHashMap<K, V, F, A>::remove(const K &key)
+{
+    HashCode h = _map.hashOf(key);
+    Segment &seg = segmentFor(h);
+
+    // Lock access to the clock of the segment.
+    std::lock_guard<std::mutex> lock(seg.mutex);
+    auto handle = _map.find(key, h);
+
+    if (!handle || !removeLocked(seg, key, h, handle->id, nullptr,
+                                 EvictionReason::Capacity))
+        throw std::out_of_range("CacheHashMap: key doesn't exists");
+}
+
+template <class K, class V, class F, template <class> class A>
+bool CacheHashMap<K, V, F, A>::exists(const K &key)
+{
+    auto handle = _map.find(key);
+
+    return handle && !isExpired(*handle, handle->expiry == 0 ? 0 : now());
+}
+
+//
+// Returns the value of key, and marks it as referenced. An expired entry is
+// removed, and reported to the eviction callback. If key doesn't exists, or
+// has expired, it throws "out of range" exception.
+//
+template <class K, class V, class F, template <class> class A>
+V CacheHashMap<K, V, F, A>::lookup(const K &key)
+{
+    HashCode h = _map.hashOf(key);
+    uint64_t id;
+
+    {
+        auto handle = _map.find(key, h);
+
+        if (!handle)
+            throw std::out_of_range("CacheHashMap: key doesn't exists");
+
+        if (!isExpired(*handle, handle->expiry == 0 ? 0 : now()))
+        {
+            if (!handle->referenced.load(std::memory_order_relaxed))
+                handle->referenced.store(true, std::memory_order_relaxed);
+            return handle->value;
+        }
+        id = handle->id;
+    }
+
+    // Expire the entry, unless it was replaced in the meantime.
+    Segment &seg = segmentFor(h);
+    std::vector<Evicted> evicted;
+
+    {
+        // Lock access to the clock of the segment.
+        std::lock_guard<std::mutex> lock(seg.mutex);
+        removeLocked(seg, key, h, id, &evicted, EvictionReason::Expired);
+    }
+
+    notify(evicted);
+    throw std::out_of_range("CacheHashMap: key doesn't exists");
+}
+
+//
+// Returns the total weight of the entries.
+//
+template <class K, class V, class F, template <class> class A>
+size_t CacheHashMap<K, V, F, A>::getWeight()
+{
+    size_t weight = 0;
+
+    for (size_t s = 0; s < _segmentCount; ++s)
+        weight += _segments[s].weight.load(std::memory_order_relaxed);
+    return weight;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "hashmap.h"
+#include "lockfreehashmap.h"
+
+//
+// Compares throughput of HashMap and LockFreeHashMap at 1 to 64 threads, on a
+// mix of 80% lookups, 10% inserts and 10% removes over a fixed key range.
+//
+
+constexpr unsigned KEY_RANGE = 1 << 16;
+constexpr unsigned OPS_PER_THREAD = 200000;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key * 2654435761u;
+    }
+};
+
+template <class Map>
+void worker(Map *map, unsigned id)
+{
+    std::mt19937 rng(id);
+
+    for (unsigned i = 0; i < OPS_PER_THREAD; ++i)
+    {
+        unsigned r = rng();
+        unsigned key = r % KEY_RANGE;
+        unsigned op = (r >> 24) % 10;
+
+        if (op == 0)
+        {
+            map->insert(key, i);
+        }
+        else if (op == 1)
+        {
+            try
+            {
+                map->remove(key);
+            }
+            catch (std::out_of_range &e)
+            {
+            }
+        }
+        else
+        {
+            // Half of the keys are absent, exists() doesn't throw for them.
+            map->exists(key);
+        }
+    }
+}
+
+template <class Map>
+double run(unsigned threads)
+{
+    Map map(KEY_RANGE);
+
+    for (unsigned key = 0; key < KEY_RANGE; key += 2)
+        map.insert(key, key);
+
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back(worker<Map>, &map, t);
+    for (auto &t : workers)
+        t.join();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    return threads * double(OPS_PER_THREAD) / elapsed.count() / 1e6;
+}
+
+int main()
+{
+    std::printf("Millions of operations per second\n");
+    std::printf("%8s %12s %12s\n", "threads", "HashMap", "LockFree");
+
+    for (unsigned threads = 1; threads <= 64; threads *= 2)
+    {
+        double locked = run<HashMap<unsigned, unsigned, UnsignedHash>>(threads);
+        double lockFree =
+            run<LockFreeHashMap<unsigned, unsigned, UnsignedHash>>(threads);
+
+        std::printf("%8u %12.2f %12.2f\n", threads, locked, lockFree);
+    }
+}
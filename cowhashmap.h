@@ -0,0 +1,394 @@
+// The MIT License (MIT)
+//
+// Thread-safe generic copy-on-write hash map built on HashMap
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COWHASHMAP_H
+#define COWHASHMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "hashmap.h"
+
+//
+// CowHashMap is a map for read-mostly data. Readers see an immutable version
+// of the map, and writers never change a published version: they copy the
+// current version, apply a batch of changes to the private copy and then
+// publish it atomically in place of the old one. Updates are expensive, a
+// copy of the whole map each, so changes should be batched with update().
+//
+// Reads go through a Reader, which each reading thread keeps for as long as
+// it reads. A read announces the epoch it started in, in a slot owned by its
+// Reader, with a plain store and a fence, and then looks the key up in the
+// current version without any locks, stripe versions or atomic
+// read-modify-writes. A replaced version is freed once every Reader has left
+// the epochs in which it could have been current.
+//
+template <class K, class V, class F = DefaultHash<K>,
+          template <class> class A = PoolAllocator>
+class CowHashMap
+{
+public:
+    typedef HashMap<K, V, F, A> Map;
+
+private:
+    struct alignas(64) ReaderSlot
+    {
+        // Epoch of the read in progress, 0 if none
+        std::atomic<uint64_t> epoch{0};
+    };
+
+    struct Retired
+    {
+        Map *map;
+        uint64_t epoch;             // Last epoch in which map was current
+    };
+
+    std::atomic<Map *> _current;
+    std::atomic<uint64_t> _epoch;
+
+    // Lock access to publishing new versions
+    std::mutex _writerMutex;
+
+    // Lock access to the list of reader slots
+    std::mutex _readerMutex;
+    std::list<ReaderSlot> _readers;
+    std::vector<ReaderSlot *> _freeReaders;
+
+    // Replaced versions which readers may still use, guarded by _writerMutex
+    std::vector<Retired> _retired;
+
+    ReaderSlot *acquireSlot();
+    void releaseSlot(ReaderSlot *slot);
+    void publish(Map *map);
+    void reclaim();
+
+public:
+    //
+    // Reader gives its thread access to the current version of the map. A
+    // Reader must not be shared between threads, nor outlive its map.
+    //
+    class Reader
+    {
+        CowHashMap &_owner;
+        ReaderSlot *_slot;
+
+        Map &enter();
+        void leave();
+
+    public:
+        Reader(CowHashMap &owner);
+        ~Reader();
+        Reader(const Reader &other) = delete;
+        Reader& operator=(const Reader &other) = delete;
+
+        bool exists(const K &key);
+        V lookup(const K &key);
+        size_t getCount();
+
+        //
+        // Calls fn(Map &) with the current version of the map, which stays
+        // valid until fn returns. fn must only read it, e.g. with findFrozen().
+        //
+        template <class Fn>
+        auto read(Fn &&fn) -> decltype(fn(std::declval<Map &>()));
+    };
+
+    CowHashMap(size_t size, size_t stripeCount = Map::DEFAULT_STRIPES);
+    ~CowHashMap();
+    CowHashMap(const CowHashMap &other) = delete;
+    CowHashMap& operator=(const CowHashMap &other) = delete;
+
+    //
+    // Applies fn(Map &) to a private copy of the current version and then
+    // publishes the copy. Updates are serialized with each other, but never
+    // wait for readers.
+    //
+    template <class Fn>
+    void update(Fn &&fn);
+
+    //
+    // Publishes a map built by the caller in place of the current version.
+    //
+    void replace(Map &&map);
+
+    // Each of these copies the map, so prefer update() for more than one change
+    void insert(const K &key, const V &value);
+    void remove(const K &key);
+
+    // These use a temporary Reader, so prefer a long-lived one in hot loops
+    bool exists(const K &key);
+    V lookup(const K &key);
+    size_t getCount();
+};
+
+//
+// CowHashMap::Reader implementation
+//
+
+template <class K, class V, class F, template <class> class A>
+CowHashMap<K, V, F, A>::Reader::Reader(CowHashMap &owner)
+    : _owner(owner), _slot(owner.acquireSlot())
+{
+}
+
+template <class K, class V, class F, template <class> class A>
+CowHashMap<K, V, F, A>::Reader::~Reader()
+{
+    _owner.releaseSlot(_slot);
+}
+
+//
+// Announces the read, and returns the version it may use until leave(). The
+// fence orders the announcement before the load of the version, pairing with
+// the fence in publish(): either the writer sees the announced epoch, or the
+// read sees the version published after it.
+//
+template <class K, class V, class F, template <class> class A>
+typename CowHashMap<K, V, F, A>::Map &CowHashMap<K, V, F, A>::Reader::enter()
+{
+    _slot->epoch.store(_owner._epoch.load(std::memory_order_acquire),
+                       std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return *_owner._current.load(std::memory_order_acquire);
+}
+
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::Reader::leave()
+{
+    _slot->epoch.store(0, std::memory_order_release);
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+auto CowHashMap<K, V, F, A>::Reader::read(Fn &&fn)
+    -> decltype(fn(std::declval<Map &>()))
+{
+    struct Leave
+    {
+        Reader &reader;
+        ~Leave() { reader.leave(); }
+    } leave{*this};
+
+    return fn(enter());
+}
+
+template <class K, class V, class F, template <class> class A>
+bool CowHashMap<K, V, F, A>::Reader::exists(const K &key)
+{
+    bool found = enter().findFrozen(key) != nullptr;
+
+    leave();
+    return found;
+}
+
+template <class K, class V, class F, template <class> class A>
+V CowHashMap<K, V, F, A>::Reader::lookup(const K &key)
+{
+    const V *value = enter().findFrozen(key);
+
+    if (value == nullptr)
+    {
+        leave();
+        throw std::out_of_range("CowHashMap: key doesn't exists");
+    }
+
+    V result = *value;
+    leave();
+    return result;
+}
+
+template <class K, class V, class F, template <class> class A>
+size_t CowHashMap<K, V, F, A>::Reader::getCount()
+{
+    size_t count = enter().approximateSize();
+
+    leave();
+    return count;
+}
+
+//
+// CowHashMap implementation
+//
+
+template <class K, class V, class F, template <class> class A>
+CowHashMap<K, V, F, A>::CowHashMap(size_t size, size_t stripeCount)
+    : _current(new Map(size, stripeCount)), _epoch(1)
+{
+}
+
+template <class K, class V, class F, template <class> class A>
+CowHashMap<K, V, F, A>::~CowHashMap()
+{
+    for (Retired &r : _retired)
+        delete r.map;
+    delete _current.load(std::memory_order_relaxed);
+}
+
+//
+// Slots of destroyed readers are reused, so the list only grows to the
+// largest number of readers alive at once.
+//
+template <class K, class V, class F, template <class> class A>
+typename CowHashMap<K, V, F, A>::ReaderSlot *
+CowHashMap<K, V, F, A>::acquireSlot()
+{
+    std::lock_guard<std::mutex> lock(_readerMutex);
+
+    if (!_freeReaders.empty())
+    {
+        ReaderSlot *slot = _freeReaders.back();
+        _freeReaders.pop_back();
+        return slot;
+    }
+
+    _readers.emplace_back();
+    return &_readers.back();
+}
+
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::releaseSlot(ReaderSlot *slot)
+{
+    std::lock_guard<std::mutex> lock(_readerMutex);
+
+    _freeReaders.push_back(slot);
+}
+
+//
+// Publishes map and retires the replaced version, tagged with the last epoch
+// in which readers could have found it. The caller must hold _writerMutex.
+//
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::publish(Map *map)
+{
+    Map *old = _current.exchange(map, std::memory_order_acq_rel);
+    uint64_t epoch = _epoch.load(std::memory_order_relaxed);
+
+    _epoch.store(epoch + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    _retired.push_back({old, epoch});
+    reclaim();
+}
+
+//
+// Frees the retired versions no reader can still be using: a reader which
+// announced an epoch later than a version's last one has loaded a newer
+// version. The caller must hold _writerMutex.
+//
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::reclaim()
+{
+    uint64_t oldest = UINT64_MAX;
+
+    {
+        std::lock_guard<std::mutex> lock(_readerMutex);
+
+        for (ReaderSlot &slot : _readers)
+        {
+            uint64_t e = slot.epoch.load(std::memory_order_acquire);
+            if (e != 0 && e < oldest)
+                oldest = e;
+        }
+    }
+
+    size_t kept = 0;
+    for (Retired &r : _retired)
+    {
+        if (r.epoch < oldest)
+            delete r.map;
+        else
+            _retired[kept++] = r;
+    }
+    _retired.resize(kept);
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void CowHashMap<K, V, F, A>::update(Fn &&fn)
+{
+    std::lock_guard<std::mutex> lock(_writerMutex);
+
+    // The copy stays on this thread unless the map is large enough for
+    // HashMap to split it between threads (see HashMap::workerCount()).
+    Map *map = new Map(*_current.load(std::memory_order_relaxed));
+
+    try
+    {
+        fn(*map);
+        map->completeResize();
+    }
+    catch (...)
+    {
+        delete map;
+        throw;
+    }
+
+    publish(map);
+}
+
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::replace(Map &&map)
+{
+    Map *copy = new Map(std::move(map));
+    std::lock_guard<std::mutex> lock(_writerMutex);
+
+    copy->completeResize();
+    publish(copy);
+}
+
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::insert(const K &key, const V &value)
+{
+    update([&](Map &map) { map.insert(key, value); });
+}
+
+template <class K, class V, class F, template <class> class A>
+void CowHashMap<K, V, F, A>::remove(const K &key)
+{
+    update([&](Map &map) { map.remove(key); });
+}
+
+template <class K, class V, class F, template <class> class A>
+bool CowHashMap<K, V, F, A>::exists(const K &key)
+{
+    return Reader(*this).exists(key);
+}
+
+template <class K, class V, class F, template <class> class A>
+V CowHashMap<K, V, F, A>::lookup(const K &key)
+{
+    return Reader(*this).lookup(key);
+}
+
+template <class K, class V, class F, template <class> class A>
+size_t CowHashMap<K, V, F, A>::getCount()
+{
+    return Reader(*this).getCount();
+}
+
+#endif // COWHASHMAP_H
@@ -0,0 +1,916 @@
+// The MIT License (MIT)
+//
+// Thread-safe generic bucketized cuckoo hashmap
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CUCKOOHASHMAP_H
+#define CUCKOOHASHMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hashmap.h"
+
+//
+// CuckooHashMap has the basic operations of HashMap (find, exists, lookup,
+// insert, remove and getCount), but no iterators, copies, print() or
+// resize(), and getSize() counts slots rather than buckets. It is a
+// bucketized cuckoo hash table (Fan et al., "MemC3"; Li et al., "Algorithmic
+// Improvements for Fast Concurrent Cuckoo Hashing"). Every key has two
+// candidate buckets, the home bucket picked by the low bits of its hash code,
+// and an alternate one derived from the home bucket and a one byte tag of the
+// hash code. A bucket is one cache line with SLOTS element pointers and their
+// tags, so a lookup reads at most two buckets, plus the element whose tag
+// matched; there are no chains to walk.
+//
+// Like in HashMap, elements are immutable and freed through the epoch
+// reclaimer, and buckets are guarded by a fixed number of stripes, each one
+// with a mutex and a version counter which is odd while a writer holds it.
+// Readers don't lock: they trust a found element right away, and a miss only
+// if the versions of both stripes didn't change. Writers lock the stripes of
+// the two buckets, in order. When both buckets are full, a breadth first
+// search finds the shortest path of elements which can each move to their
+// other bucket, ending at a free slot, and the moves are made from its end,
+// each one under the locks of its two buckets only. If there is no such path
+// the table doubles, with all stripes locked.
+//
+// Keys with equal hash codes have the same two buckets in every table, so
+// once those are full of them, neither paths nor growing make room for one
+// more. Such keys go to the stash of the stripe instead, a list searched
+// under the lock; readers take the lock for the keys of a stripe whose stash
+// isn't empty. A stashed key moves back to a bucket when a key with its hash
+// code is removed from one.
+//
+template <class K, class V, class F = DefaultHash<K>,
+          template <class> class A = PoolAllocator>
+class CuckooHashMap
+{
+    struct Element
+    {
+        uint64_t hash;
+        K key;
+        V value;
+
+        template <class KK, class... Args>
+        Element(KK &&k, Args &&...args)
+            : hash(0), key(std::forward<KK>(k)),
+              value(std::forward<Args>(args)...) {}
+    };
+
+public:
+    // Number of elements in a bucket
+    static constexpr unsigned SLOTS = 7;
+
+private:
+    //
+    // Byte i of tags is the tag of slot i. A slot is empty if its element is
+    // nullptr, whatever its tag.
+    //
+    struct alignas(64) Bucket
+    {
+        std::atomic<uint64_t> tags;
+        std::atomic<Element *> slots[SLOTS];
+
+        Bucket() : tags(0)
+        {
+            for (auto &slot : slots)
+                slot.store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    static_assert(sizeof(Bucket) == 64,
+                  "CuckooHashMap: bucket must fill one cache line");
+
+    struct Table
+    {
+        size_t mask;            // Number of buckets - 1
+        Bucket *buckets;
+
+        explicit Table(size_t n) : mask(n - 1), buckets(new Bucket[n]) {}
+        ~Table() { delete [] buckets; }
+    };
+
+    struct Retired
+    {
+        Element *element;
+        uint64_t epoch;
+    };
+
+    struct RetiredTable
+    {
+        Table *table;
+        uint64_t epoch;
+    };
+
+    //
+    // An element is counted in the stripe of its home bucket. Tables never
+    // have fewer buckets than there are stripes, so that is the same stripe
+    // in every table.
+    //
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex;
+        std::atomic<uint64_t> version;
+        std::atomic<size_t> count;
+        std::vector<Retired> retired;
+        std::vector<Element *> stash;   // Elements which fit in no bucket
+        std::atomic<size_t> stashed;    // Size of stash, for readers
+
+        Stripe() : version(0), count(0), stashed(0) {}
+
+        // Locks the stripe for writing, like HashMap::Stripe::lock().
+        void lock()
+        {
+            mutex.lock();
+            version.store(version.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void unlock()
+        {
+            version.store(version.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_release);
+            mutex.unlock();
+        }
+    };
+
+    //
+    // Locks the stripes of two buckets in order, or their one stripe, and
+    // unlocks them when destroyed.
+    //
+    class BucketLock
+    {
+        Stripe *_first;
+        Stripe *_second;
+
+    public:
+        BucketLock(CuckooHashMap &map, size_t b1, size_t b2)
+        {
+            _first = &map.stripeFor(b1);
+            _second = &map.stripeFor(b2);
+            if (_first > _second)
+                std::swap(_first, _second);
+
+            _first->lock();
+            if (_second != _first)
+                _second->lock();
+        }
+
+        ~BucketLock()
+        {
+            if (_second != _first)
+                _second->unlock();
+            _first->unlock();
+        }
+
+        BucketLock(const BucketLock &) = delete;
+        BucketLock &operator=(const BucketLock &) = delete;
+    };
+
+    // Step of a cuckoo path: element is moved from slot of the bucket of the
+    // parent step to bucket.
+    struct PathStep
+    {
+        size_t bucket;
+        unsigned slot;
+        int parent;
+        Element *element;
+    };
+
+    std::atomic<Table *> _table;
+    size_t _stripeCount;
+    Stripe *_stripes;
+
+    // Tables replaced by grown ones, changed only with all stripes locked
+    std::vector<RetiredTable> _retiredTables;
+
+    EpochReclaimer _reclaimer;
+    A<Element> _allocator;
+
+    F hashFunctor;
+
+    // Number of retired elements in a stripe after which we try to free them
+    static constexpr size_t RECLAIM_THRESHOLD = 64;
+
+    // Number of optimistic attempts of a read before falling back to locking
+    static constexpr unsigned READ_RETRIES = 8;
+
+    // Number of buckets the cuckoo path search may visit
+    static constexpr size_t MAX_PATH_BUCKETS = 256;
+
+    // Number of evictions tried per element when moving to a grown table
+    static constexpr unsigned MAX_KICKS = 512;
+
+    uint64_t hash(const K &key)
+    {
+        return mixedHash(hashFunctor, key);
+    }
+
+    static unsigned tagOf(uint64_t h) { return h >> 56; }
+    static size_t homeBucket(Table *t, uint64_t h) { return h & t->mask; }
+
+    // The alternate of the alternate bucket is the bucket itself.
+    static size_t otherBucket(Table *t, size_t b, unsigned tag)
+    {
+        return (b ^ ((tag + 1) * 0xc6a4a7935bd1e995ull)) & t->mask;
+    }
+
+    Stripe &stripeFor(size_t b) { return _stripes[b & (_stripeCount - 1)]; }
+
+    template <class... Args>
+    Element *newElement(Args &&...args)
+    {
+        Element *e = _allocator.allocate();
+
+        try
+        {
+            return new (e) Element(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            _allocator.deallocate(e);
+            throw;
+        }
+    }
+
+    void deleteElement(Element *e)
+    {
+        e->~Element();
+        _allocator.deallocate(e);
+    }
+
+    static int findSlot(Bucket &b, uint64_t h, const K &key, Element *&found);
+    static int freeSlot(Bucket &b);
+    static bool fullOf(Table *t, size_t b1, size_t b2, uint64_t h);
+    static int findStashed(Stripe &stripe, uint64_t h, const K &key);
+    static void unstash(Stripe &stripe, Bucket &b, unsigned slot, uint64_t h);
+    static void place(Bucket &b, unsigned slot, Element *e);
+    static bool placeUnshared(Table *t, Element *e);
+
+    Element *findElement(const K &key, uint64_t h);
+    void insertElement(Element *e);
+    bool moveAlongPath(Table *t, size_t b1, size_t b2);
+    void grow(Table *t);
+    void retire(Stripe &stripe, Element *e);
+
+public:
+    static constexpr size_t DEFAULT_STRIPES = 1024;
+
+    //
+    // Result of find(), as in HashMap.
+    //
+    class Handle
+    {
+        EpochReclaimer::Guard _guard;
+        Element *_element;
+
+        friend class CuckooHashMap;
+
+        explicit Handle(EpochReclaimer &reclaimer)
+            : _guard(reclaimer), _element(nullptr) {}
+
+    public:
+        explicit operator bool() const { return _element != nullptr; }
+
+        const K &key() const { return _element->key; }
+        const V &value() const { return _element->value; }
+        const V &operator*() const { return _element->value; }
+        const V *operator->() const { return &_element->value; }
+    };
+
+    CuckooHashMap(size_t size, size_t stripeCount = DEFAULT_STRIPES);
+    ~CuckooHashMap();
+
+    CuckooHashMap(const CuckooHashMap &) = delete;
+    CuckooHashMap &operator=(const CuckooHashMap &) = delete;
+
+    Handle find(const K &key);
+    bool exists(const K &key);
+    V lookup(const K &key);
+    V operator[](const K &key) { return lookup(key); }
+    void insert(const K &key, const V &value);
+    void remove(const K &key);
+
+    size_t getCount();
+
+    // Number of slots in the table
+    size_t getSize()
+    {
+        return (_table.load(std::memory_order_acquire)->mask + 1) * SLOTS;
+    }
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the CuckooHashMap methods
+//====----------------------------------------------------------------------====
+
+//
+// The table starts with enough buckets for size elements at 7/8 of the slots
+// used. The stripe count is rounded down to a power of two, and is never
+// greater than the number of buckets.
+//
+template <class K, class V, class F, template <class> class A>
+CuckooHashMap<K, V, F, A>::CuckooHashMap(size_t size, size_t stripeCount)
+{
+    size_t buckets = 1;
+    while (buckets * SLOTS * 7 / 8 < size)
+        buckets *= 2;
+
+    _stripeCount = 1;
+    while (_stripeCount * 2 <= stripeCount && _stripeCount * 2 <= buckets)
+        _stripeCount *= 2;
+
+    _stripes = new Stripe[_stripeCount];
+    _table.store(new Table(buckets), std::memory_order_release);
+}
+
+template <class K, class V, class F, template <class> class A>
+CuckooHashMap<K, V, F, A>::~CuckooHashMap()
+{
+    Table *t = _table.load(std::memory_order_relaxed);
+    bool walk = !A<Element>::BULK_RELEASE ||
+                !std::is_trivially_destructible<Element>::value;
+
+    // Retired tables hold no elements of their own.
+    for (size_t b = 0; b <= t->mask && walk; ++b)
+    {
+        for (auto &slot : t->buckets[b].slots)
+        {
+            Element *e = slot.load(std::memory_order_relaxed);
+            if (e != nullptr)
+                deleteElement(e);
+        }
+    }
+
+    for (size_t s = 0; s < _stripeCount && walk; ++s)
+    {
+        for (Retired &r : _stripes[s].retired)
+            deleteElement(r.element);
+        for (Element *e : _stripes[s].stash)
+            deleteElement(e);
+    }
+
+    _allocator.release();
+
+    for (RetiredTable &r : _retiredTables)
+        delete r.table;
+    delete t;
+    delete [] _stripes;
+}
+
+//
+// Returns the slot of bucket b with the element of key, and sets found to
+// the element, or returns -1. Tags are compared eight at a time: a byte of x
+// is zero where the tag matches, and the bit trick below flags every such
+// byte (and rarely a byte above one), so the element compare filters out the
+// false matches.
+//
+template <class K, class V, class F, template <class> class A>
+int CuckooHashMap<K, V, F, A>::findSlot(Bucket &b, uint64_t h, const K &key,
+                                        Element *&found)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x0080808080808080ull;       // Bytes of SLOTS
+    uint64_t x = b.tags.load(std::memory_order_relaxed) ^ (tagOf(h) * ones);
+    uint64_t match = (x - ones) & ~x & highs;
+
+    for (; match != 0; match &= match - 1)
+    {
+        unsigned i = __builtin_ctzll(match) / 8;
+        Element *e = b.slots[i].load(std::memory_order_acquire);
+
+        if (e != nullptr && e->hash == h && e->key == key)
+        {
+            found = e;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+template <class K, class V, class F, template <class> class A>
+int CuckooHashMap<K, V, F, A>::freeSlot(Bucket &b)
+{
+    for (unsigned i = 0; i < SLOTS; ++i)
+        if (b.slots[i].load(std::memory_order_relaxed) == nullptr)
+            return i;
+    return -1;
+}
+
+//
+// Checks if buckets b1 and b2 of t are full of elements with hash code h, so
+// that no move or growing makes room in them for another key with h.
+//
+template <class K, class V, class F, template <class> class A>
+bool CuckooHashMap<K, V, F, A>::fullOf(Table *t, size_t b1, size_t b2,
+                                       uint64_t h)
+{
+    for (size_t b : {b1, b2})
+    {
+        for (auto &slot : t->buckets[b].slots)
+        {
+            Element *e = slot.load(std::memory_order_relaxed);
+            if (e == nullptr || e->hash != h)
+                return false;
+        }
+    }
+    return true;
+}
+
+//
+// Returns the index in the stash of the locked stripe of the element with
+// key, or -1.
+//
+template <class K, class V, class F, template <class> class A>
+int CuckooHashMap<K, V, F, A>::findStashed(Stripe &stripe, uint64_t h,
+                                           const K &key)
+{
+    for (size_t i = 0; i < stripe.stash.size(); ++i)
+        if (stripe.stash[i]->hash == h && stripe.stash[i]->key == key)
+            return i;
+    return -1;
+}
+
+//
+// Moves a stashed element with hash code h, if the locked stripe has one, to
+// the free slot of bucket b, one of the buckets of h.
+//
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::unstash(Stripe &stripe, Bucket &b,
+                                        unsigned slot, uint64_t h)
+{
+    for (size_t i = 0; i < stripe.stash.size(); ++i)
+    {
+        if (stripe.stash[i]->hash != h)
+            continue;
+
+        place(b, slot, stripe.stash[i]);
+        stripe.stash.erase(stripe.stash.begin() + i);
+        stripe.stashed.store(stripe.stash.size(), std::memory_order_relaxed);
+        return;
+    }
+}
+
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::place(Bucket &b, unsigned slot, Element *e)
+{
+    uint64_t tags = b.tags.load(std::memory_order_relaxed);
+
+    tags &= ~(0xffull << (8 * slot));
+    tags |= (uint64_t)tagOf(e->hash) << (8 * slot);
+    b.tags.store(tags, std::memory_order_relaxed);
+    b.slots[slot].store(e, std::memory_order_release);
+}
+
+//
+// Puts e into table t, which nobody else sees yet, evicting other elements
+// to their other buckets if both buckets of e are full. Returns false if
+// there was no room after MAX_KICKS evictions; t must be dropped then, since
+// the last evicted element is in none of its buckets.
+//
+template <class K, class V, class F, template <class> class A>
+bool CuckooHashMap<K, V, F, A>::placeUnshared(Table *t, Element *e)
+{
+    for (unsigned kick = 0; kick < MAX_KICKS; ++kick)
+    {
+        size_t b1 = homeBucket(t, e->hash);
+        size_t b2 = otherBucket(t, b1, tagOf(e->hash));
+        int slot;
+
+        if ((slot = freeSlot(t->buckets[b1])) >= 0)
+        {
+            place(t->buckets[b1], slot, e);
+            return true;
+        }
+        if ((slot = freeSlot(t->buckets[b2])) >= 0)
+        {
+            place(t->buckets[b2], slot, e);
+            return true;
+        }
+
+        Bucket &b = t->buckets[kick & 1 ? b2 : b1];
+        unsigned victim = (e->hash >> 8) % SLOTS;
+        Element *evicted = b.slots[victim].load(std::memory_order_relaxed);
+
+        place(b, victim, e);
+        e = evicted;
+    }
+
+    return false;
+}
+
+//
+// Returns the element with given key, or nullptr if key doesn't exists. The
+// caller must be inside of an epoch guard.
+//
+// The table is read again after the stripe versions, so a table replaced by
+// a grown one in the meantime (with all stripes locked) is noticed. A miss in
+// a stripe with stashed elements is retried under the lock, with the stash.
+//
+template <class K, class V, class F, template <class> class A>
+typename CuckooHashMap<K, V, F, A>::Element *
+CuckooHashMap<K, V, F, A>::findElement(const K &key, uint64_t h)
+{
+    Element *e = nullptr;
+
+    for (unsigned attempt = 0; attempt < READ_RETRIES; ++attempt)
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+        size_t b1 = homeBucket(t, h);
+        size_t b2 = otherBucket(t, b1, tagOf(h));
+        Stripe &s1 = stripeFor(b1);
+        Stripe &s2 = stripeFor(b2);
+        uint64_t v1 = s1.version.load(std::memory_order_acquire);
+        uint64_t v2 = s2.version.load(std::memory_order_acquire);
+
+        if ((v1 | v2) & 1 || _table.load(std::memory_order_acquire) != t)
+            continue;
+
+        if (findSlot(t->buckets[b1], h, key, e) >= 0 ||
+            findSlot(t->buckets[b2], h, key, e) >= 0)
+            return e;
+        if (s1.stashed.load(std::memory_order_relaxed) != 0)
+            break;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s1.version.load(std::memory_order_relaxed) == v1 &&
+            s2.version.load(std::memory_order_relaxed) == v2)
+            return nullptr;
+    }
+
+    for (;;)
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+        size_t b1 = homeBucket(t, h);
+        size_t b2 = otherBucket(t, b1, tagOf(h));
+
+        // Lock access to both buckets of the key.
+        BucketLock lock(*this, b1, b2);
+
+        if (_table.load(std::memory_order_relaxed) != t)
+            continue;
+        if (findSlot(t->buckets[b1], h, key, e) >= 0 ||
+            findSlot(t->buckets[b2], h, key, e) >= 0)
+            return e;
+
+        Stripe &stripe = stripeFor(b1);
+        int i = findStashed(stripe, h, key);
+        return i >= 0 ? stripe.stash[i] : nullptr;
+    }
+}
+
+template <class K, class V, class F, template <class> class A>
+typename CuckooHashMap<K, V, F, A>::Handle
+CuckooHashMap<K, V, F, A>::find(const K &key)
+{
+    Handle handle(_reclaimer);
+
+    handle._element = findElement(key, hash(key));
+    return handle;
+}
+
+template <class K, class V, class F, template <class> class A>
+bool CuckooHashMap<K, V, F, A>::exists(const K &key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    return findElement(key, hash(key)) != nullptr;
+}
+
+//
+// Returns value of the key. If key doesn't exists it throws "out of range"
+// exception.
+//
+template <class K, class V, class F, template <class> class A>
+V CuckooHashMap<K, V, F, A>::lookup(const K &key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    Element *e = findElement(key, hash(key));
+
+    if (e == nullptr)
+        throw std::out_of_range("CuckooHashMap: key doesn't exists");
+    return e->value;
+}
+
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::insert(const K &key, const V &value)
+{
+    Element *e = newElement(key, value);
+
+    e->hash = hash(key);
+    try
+    {
+        insertElement(e);
+    }
+    catch (...)
+    {
+        deleteElement(e);
+        throw;
+    }
+}
+
+//
+// Puts e in place of the element with the same key, or into a free slot of
+// one of its buckets. If both buckets are full, room is made by moving other
+// elements along a cuckoo path, or by growing the table, and it is tried
+// again. If they are full of elements with the hash code of e, e is stashed.
+//
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::insertElement(Element *e)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    for (;;)
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+        size_t b1 = homeBucket(t, e->hash);
+        size_t b2 = otherBucket(t, b1, tagOf(e->hash));
+
+        {
+            // Lock access to both buckets of the key.
+            BucketLock lock(*this, b1, b2);
+
+            if (_table.load(std::memory_order_relaxed) != t)
+                continue;
+
+            Element *old;
+            size_t b = b1;
+            int slot = findSlot(t->buckets[b], e->hash, e->key, old);
+
+            if (slot < 0)
+                slot = findSlot(t->buckets[b = b2], e->hash, e->key, old);
+            if (slot >= 0)
+            {
+                place(t->buckets[b], slot, e);
+                retire(stripeFor(b), old);
+                return;
+            }
+
+            Stripe &stripe = stripeFor(b1);
+
+            if ((slot = findStashed(stripe, e->hash, e->key)) >= 0)
+            {
+                old = stripe.stash[slot];
+                stripe.stash[slot] = e;
+                retire(stripe, old);
+                return;
+            }
+
+            bool stash = false;
+
+            if ((slot = freeSlot(t->buckets[b = b1])) >= 0 ||
+                (slot = freeSlot(t->buckets[b = b2])) >= 0 ||
+                (stash = fullOf(t, b1, b2, e->hash)))
+            {
+                if (stash)
+                {
+                    stripe.stash.push_back(e);
+                    stripe.stashed.store(stripe.stash.size(),
+                                         std::memory_order_relaxed);
+                }
+                else
+                    place(t->buckets[b], slot, e);
+
+                stripe.count.store(
+                    stripe.count.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        if (!moveAlongPath(t, b1, b2))
+            grow(t);
+    }
+}
+
+//
+// Searches breadth first, without locking, for a bucket with a free slot
+// which elements of b1 or b2 can be moved towards, and moves them along the
+// found path from its free end. Every move locks only its two buckets and
+// checks the element is still where the search saw it. Returns false if no
+// path was found, true otherwise, even if a move failed, so the insert is
+// tried again either way.
+//
+template <class K, class V, class F, template <class> class A>
+bool CuckooHashMap<K, V, F, A>::moveAlongPath(Table *t, size_t b1, size_t b2)
+{
+    std::vector<PathStep> steps;
+    int end = -1;
+
+    steps.reserve(MAX_PATH_BUCKETS + SLOTS);
+    steps.push_back({b1, 0, -1, nullptr});
+    if (b2 != b1)
+        steps.push_back({b2, 0, -1, nullptr});
+
+    for (size_t n = 0; n < steps.size() && end < 0; ++n)
+    {
+        Bucket &b = t->buckets[steps[n].bucket];
+
+        if (freeSlot(b) >= 0)
+        {
+            end = n;
+            break;
+        }
+        if (steps.size() >= MAX_PATH_BUCKETS)
+            continue;
+
+        for (unsigned i = 0; i < SLOTS; ++i)
+        {
+            Element *e = b.slots[i].load(std::memory_order_acquire);
+
+            if (e != nullptr)
+                steps.push_back({otherBucket(t, steps[n].bucket,
+                                             tagOf(e->hash)),
+                                 i, (int)n, e});
+        }
+    }
+
+    if (end < 0)
+        return false;
+
+    for (int n = end; steps[n].parent >= 0; n = steps[n].parent)
+    {
+        size_t from = steps[steps[n].parent].bucket;
+        size_t to = steps[n].bucket;
+
+        // Lock access to both buckets of the move.
+        BucketLock lock(*this, from, to);
+        int slot;
+
+        if (_table.load(std::memory_order_relaxed) != t ||
+            t->buckets[from].slots[steps[n].slot].load(
+                std::memory_order_relaxed) != steps[n].element ||
+            (slot = freeSlot(t->buckets[to])) < 0)
+            break;
+
+        place(t->buckets[to], slot, steps[n].element);
+        t->buckets[from].slots[steps[n].slot].store(
+            nullptr, std::memory_order_release);
+    }
+
+    return true;
+}
+
+//
+// Replaces table t, unless it was replaced already, by a table at least twice
+// the size. All stripes are locked, in order, for the time.
+//
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::grow(Table *t)
+{
+    for (size_t s = 0; s < _stripeCount; ++s)
+        _stripes[s].lock();
+
+    if (_table.load(std::memory_order_relaxed) == t)
+    {
+        Table *nt = nullptr;
+
+        for (size_t n = (t->mask + 1) * 2; nt == nullptr; n *= 2)
+        {
+            nt = new Table(n);
+
+            for (size_t b = 0; b <= t->mask && nt != nullptr; ++b)
+            {
+                for (auto &slot : t->buckets[b].slots)
+                {
+                    Element *e = slot.load(std::memory_order_relaxed);
+
+                    if (e != nullptr && !placeUnshared(nt, e))
+                    {
+                        delete nt;
+                        nt = nullptr;
+                        break;
+                    }
+                }
+            }
+        }
+
+        _table.store(nt, std::memory_order_release);
+        _retiredTables.push_back({t, _reclaimer.epoch()});
+        _reclaimer.tryAdvance();
+
+        size_t n = 0;
+        while (n < _retiredTables.size() &&
+               _reclaimer.isSafe(_retiredTables[n].epoch))
+            delete _retiredTables[n++].table;
+        _retiredTables.erase(_retiredTables.begin(),
+                             _retiredTables.begin() + n);
+    }
+
+    for (size_t s = _stripeCount; s > 0; --s)
+        _stripes[s - 1].unlock();
+}
+
+//
+// Adds an element taken out of the table to the retired list of the stripe,
+// which must be locked, and frees the elements no reader can see any more.
+//
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::retire(Stripe &stripe, Element *e)
+{
+    stripe.retired.push_back({e, _reclaimer.epoch()});
+
+    if (stripe.retired.size() < RECLAIM_THRESHOLD)
+        return;
+
+    _reclaimer.tryAdvance();
+
+    size_t n = 0;
+    while (n < stripe.retired.size() &&
+           _reclaimer.isSafe(stripe.retired[n].epoch))
+        deleteElement(stripe.retired[n++].element);
+    stripe.retired.erase(stripe.retired.begin(), stripe.retired.begin() + n);
+}
+
+//
+// Removes key. If key doesn't exists it throws "out of range" exception.
+//
+template <class K, class V, class F, template <class> class A>
+void CuckooHashMap<K, V, F, A>::remove(const K &key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    uint64_t h = hash(key);
+
+    for (;;)
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+        size_t b1 = homeBucket(t, h);
+        size_t b2 = otherBucket(t, b1, tagOf(h));
+
+        // Lock access to both buckets of the key.
+        BucketLock lock(*this, b1, b2);
+
+        if (_table.load(std::memory_order_relaxed) != t)
+            continue;
+
+        Element *e;
+        size_t b = b1;
+        int slot = findSlot(t->buckets[b], h, key, e);
+
+        if (slot < 0)
+            slot = findSlot(t->buckets[b = b2], h, key, e);
+
+        Stripe &stripe = stripeFor(b1);
+
+        if (slot >= 0)
+        {
+            t->buckets[b].slots[slot].store(nullptr,
+                                            std::memory_order_release);
+            retire(stripeFor(b), e);
+            unstash(stripe, t->buckets[b], slot, h);
+        }
+        else
+        {
+            if ((slot = findStashed(stripe, h, key)) < 0)
+                throw std::out_of_range("CuckooHashMap: key doesn't exists");
+
+            e = stripe.stash[slot];
+            stripe.stash.erase(stripe.stash.begin() + slot);
+            stripe.stashed.store(stripe.stash.size(),
+                                 std::memory_order_relaxed);
+            retire(stripe, e);
+        }
+
+        stripe.count.store(stripe.count.load(std::memory_order_relaxed) - 1,
+                           std::memory_order_relaxed);
+        return;
+    }
+}
+
+template <class K, class V, class F, template <class> class A>
+size_t CuckooHashMap<K, V, F, A>::getCount()
+{
+    size_t count = 0;
+
+    for (size_t s = 0; s < _stripeCount; ++s)
+        count += _stripes[s].count.load(std::memory_order_relaxed);
+    return count;
+}
+
+#endif
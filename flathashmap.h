@@ -0,0 +1,755 @@
+// The MIT License (MIT)
+//
+// Thread-safe generic open-addressing hashmap
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef FLATHASHMAP_H
+#define FLATHASHMAP_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hashmap.h"
+
+//
+// FlatHashMap has the same interface as HashMap, but instead of chaining
+// separately allocated elements it keeps keys and values inline in a flat
+// array of slots. Every slot has one control byte: either EMPTY, DELETED or
+// the low 7 bits of the key's hash. Control bytes are scanned in groups of 16,
+// so a lookup usually touches one control group and one slot.
+//
+// The map is split into shards, each one being an independent table guarded by
+// its own mutex, so multiple shards can be accessed at the same time.
+//
+template <class K, class V, class F = DefaultHash<K>>
+class FlatHashMap
+{
+public:
+    struct Element
+    {
+        K key;
+        V value;
+
+        Element(K k, V v) : key(k), value(v) {}
+    };
+
+private:
+    static constexpr size_t GROUP_WIDTH = 16;
+    static constexpr size_t DEFAULT_SHARDS = 16;
+
+    static constexpr int8_t CTRL_EMPTY = -128;  // 0b10000000
+    static constexpr int8_t CTRL_DELETED = -2;  // 0b11111110
+
+    typedef typename std::aligned_storage<sizeof(Element),
+                                          alignof(Element)>::type Slot;
+
+    //
+    // Bit mask of the slots in a group which match some control byte.
+    //
+    class BitMask
+    {
+        uint32_t _mask;
+
+    public:
+        explicit BitMask(uint32_t mask) : _mask(mask) {}
+
+        bool empty() const { return _mask == 0; }
+
+        unsigned lowest() const { return __builtin_ctz(_mask); }
+
+        void clearLowest() { _mask &= _mask - 1; }
+    };
+
+    //
+    // A group of GROUP_WIDTH control bytes loaded at once.
+    //
+    class Group
+    {
+#ifdef __SSE2__
+        __m128i _ctrl;
+
+    public:
+        explicit Group(const int8_t *ctrl)
+            : _ctrl(_mm_load_si128(reinterpret_cast<const __m128i *>(ctrl))) {}
+
+        BitMask match(int8_t h2) const
+        {
+            __m128i m = _mm_cmpeq_epi8(_mm_set1_epi8(h2), _ctrl);
+            return BitMask(_mm_movemask_epi8(m));
+        }
+
+        BitMask matchEmpty() const { return match(CTRL_EMPTY); }
+
+        // EMPTY and DELETED are the only control bytes with the sign bit set.
+        BitMask matchEmptyOrDeleted() const
+        {
+            return BitMask(_mm_movemask_epi8(_ctrl));
+        }
+#else
+        const int8_t *_ctrl;
+
+    public:
+        explicit Group(const int8_t *ctrl) : _ctrl(ctrl) {}
+
+        BitMask match(int8_t h2) const
+        {
+            uint32_t mask = 0;
+            for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+                if (_ctrl[i] == h2)
+                    mask |= 1u << i;
+            return BitMask(mask);
+        }
+
+        BitMask matchEmpty() const { return match(CTRL_EMPTY); }
+
+        BitMask matchEmptyOrDeleted() const
+        {
+            uint32_t mask = 0;
+            for (unsigned i = 0; i < GROUP_WIDTH; ++i)
+                if (_ctrl[i] < 0)
+                    mask |= 1u << i;
+            return BitMask(mask);
+        }
+#endif
+    };
+
+    //
+    // One independent open-addressing table. Capacity is always a power of two
+    // and a multiple of GROUP_WIDTH, so groups are aligned and never wrap.
+    //
+    struct alignas(64) Shard
+    {
+        std::mutex mutex;
+        int8_t *ctrl = nullptr;
+        Slot *slots = nullptr;
+        size_t capacity = 0;
+        size_t count = 0;
+
+        // Number of elements that can be inserted before a rehash is needed.
+        // Tombstones consume growth, so rehashing also purges them.
+        size_t growthLeft = 0;
+    };
+
+    // Total number of slots in all shards
+    size_t _size;
+
+    size_t _shardCount;
+    unsigned _shardShift;
+    Shard *_shards;
+
+    //
+    // Hash function is actually a class used as functor. Its result is mixed
+    // with a 64-bit finalizer, so the weak functors still spread well across
+    // control bytes, groups and shards.
+    //
+    F hashFunctor;
+
+    uint64_t hash(const K &key)
+    {
+        return mixedHash(hashFunctor, key);
+    }
+
+    static int8_t h2(uint64_t h) { return h & 0x7f; }
+    static uint64_t h1(uint64_t h) { return h >> 7; }
+
+    Shard &shardFor(uint64_t h)
+    {
+        return _shards[_shardShift == 64 ? 0 : h >> _shardShift];
+    }
+
+    static Element *slotElement(Shard &s, size_t i)
+    {
+        return reinterpret_cast<Element *>(&s.slots[i]);
+    }
+
+    static size_t roundCapacity(size_t n);
+    static void allocateShard(Shard &s, size_t capacity);
+    static void destroyShard(Shard &s);
+    static void setCtrl(Shard &s, size_t i, int8_t c) { s.ctrl[i] = c; }
+
+    Element *find(Shard &s, const K &key, uint64_t h);
+    size_t findInsertSlot(Shard &s, uint64_t h);
+    void rehashShard(Shard &s, size_t newCapacity);
+    void eraseSlot(Shard &s, size_t i);
+
+    void allocateShards(size_t size, size_t shardCount);
+    void destroyShards();
+    void copyFrom(FlatHashMap &other);
+
+public:
+    ~FlatHashMap();
+    bool exists(K key);
+    V lookup(K key);
+    void insert(K key, V value);
+    void remove(K key);
+    void resize(size_t newSize);
+    void print();
+    size_t getSize() { return _size; }
+
+    FlatHashMap()
+        : _size(0), _shardCount(0), _shardShift(64), _shards(nullptr) {}
+    FlatHashMap(size_t size, size_t shardCount = DEFAULT_SHARDS);
+    FlatHashMap(FlatHashMap &other);             // Copy constructor
+    FlatHashMap(FlatHashMap &&other);            // Move constructor
+
+    FlatHashMap& operator=(FlatHashMap &other);  // Copy assignment operator
+    FlatHashMap& operator=(FlatHashMap &&other); // Move assignment operator
+
+    V operator[](K key) { return lookup(key); }
+
+    //
+    // Iterator class
+    //
+    class Iterator
+    {
+        FlatHashMap<K, V, F> *_map;
+        size_t _shard = 0;
+        size_t _slot = 0;
+
+        Element *current() const
+        {
+            if (_map == nullptr || _shard >= _map->_shardCount)
+                return nullptr;
+            return slotElement(_map->_shards[_shard], _slot);
+        }
+
+        // Advances to the first full slot at or after (_shard, _slot).
+        void skipEmpty()
+        {
+            while (_shard < _map->_shardCount)
+            {
+                Shard &s = _map->_shards[_shard];
+                while (_slot < s.capacity && s.ctrl[_slot] < 0)
+                    ++_slot;
+                if (_slot < s.capacity)
+                    return;
+                ++_shard;
+                _slot = 0;
+            }
+        }
+
+    public:
+        Iterator() : _map(nullptr) {}
+        Iterator(FlatHashMap<K, V, F> *map, size_t shard)
+            : _map(map), _shard(shard)
+        {
+            if (_map != nullptr)
+                skipEmpty();
+        }
+
+        // Prefix increment operator
+        Iterator & operator++()
+        {
+            ++_slot;
+            skipEmpty();
+            return *this;
+        }
+
+        // Postfix increment operator
+        Iterator operator++(int)
+        {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        Element * operator*()
+        {
+            return current();
+        }
+
+        bool operator==(Iterator other)
+        {
+            return other.current() == current();
+        }
+
+        bool operator!=(Iterator other)
+        {
+            return other.current() != current();
+        }
+    };
+
+    Iterator begin() { return Iterator(this, 0); }
+    Iterator end() { return Iterator(this, _shardCount); }
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the FlatHashMap methods
+//====----------------------------------------------------------------------====
+
+//
+// Rounds n up to a power of two which is at least GROUP_WIDTH.
+//
+template <class K, class V, class F>
+size_t FlatHashMap<K, V, F>::roundCapacity(size_t n)
+{
+    size_t capacity = GROUP_WIDTH;
+    while (capacity < n)
+        capacity <<= 1;
+    return capacity;
+}
+
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::allocateShard(Shard &s, size_t capacity)
+{
+    s.capacity = capacity;
+    s.count = 0;
+    s.growthLeft = capacity - capacity / 8;
+    s.ctrl = static_cast<int8_t *>(::operator new(capacity,
+                                                  std::align_val_t(16)));
+    s.slots = static_cast<Slot *>(::operator new(capacity * sizeof(Slot)));
+    std::memset(s.ctrl, CTRL_EMPTY, capacity);
+}
+
+//
+// Destroys all elements in the shard and deallocates its arrays
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::destroyShard(Shard &s)
+{
+    if (s.ctrl == nullptr)
+        return;
+
+    for (size_t i = 0; i < s.capacity; ++i)
+        if (s.ctrl[i] >= 0)
+            slotElement(s, i)->~Element();
+
+    ::operator delete(s.ctrl, std::align_val_t(16));
+    ::operator delete(s.slots);
+    s.ctrl = nullptr;
+    s.slots = nullptr;
+    s.capacity = 0;
+    s.count = 0;
+    s.growthLeft = 0;
+}
+
+//
+// Allocates shardCount shards with the total of at least size slots
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::allocateShards(size_t size, size_t shardCount)
+{
+    _shardCount = 1;
+    _shardShift = 64;
+    while (_shardCount < shardCount)
+    {
+        _shardCount <<= 1;
+        --_shardShift;
+    }
+
+    _shards = new Shard[_shardCount];
+    _size = 0;
+
+    size_t perShard = roundCapacity((size + _shardCount - 1) / _shardCount);
+    for (size_t i = 0; i < _shardCount; ++i)
+    {
+        allocateShard(_shards[i], perShard);
+        _size += perShard;
+    }
+}
+
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::destroyShards()
+{
+    if (_shards == nullptr)
+        return;
+
+    for (size_t i = 0; i < _shardCount; ++i)
+    {
+        // Lock access to the shard.
+        std::lock_guard<std::mutex> lock(_shards[i].mutex);
+        destroyShard(_shards[i]);
+    }
+
+    delete [] _shards;
+    _shards = nullptr;
+    _shardCount = 0;
+    _shardShift = 64;
+    _size = 0;
+}
+
+//
+// Inserts all elements of other, which must have the same geometry as this.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::copyFrom(FlatHashMap &other)
+{
+    for (size_t i = 0; i < other._shardCount; ++i)
+    {
+        // Lock access to the shard of other.
+        std::lock_guard<std::mutex> lock(other._shards[i].mutex);
+        Shard &s = other._shards[i];
+
+        for (size_t j = 0; j < s.capacity; ++j)
+            if (s.ctrl[j] >= 0)
+                insert(slotElement(s, j)->key, slotElement(s, j)->value);
+    }
+}
+
+//
+// Returns the element with given key, or nullptr if it is not in the shard.
+// The shard must be locked by the caller.
+//
+template <class K, class V, class F>
+typename FlatHashMap<K, V, F>::Element *
+FlatHashMap<K, V, F>::find(Shard &s, const K &key, uint64_t h)
+{
+    size_t groupMask = s.capacity / GROUP_WIDTH - 1;
+    size_t g = h1(h) & groupMask;
+
+    // Triangular probing over the groups visits every group exactly once,
+    // because the number of groups is a power of two.
+    for (size_t step = 1; step <= groupMask + 1; ++step)
+    {
+        Group group(s.ctrl + g * GROUP_WIDTH);
+
+        for (BitMask m = group.match(h2(h)); !m.empty(); m.clearLowest())
+        {
+            Element *e = slotElement(s, g * GROUP_WIDTH + m.lowest());
+            if (e->key == key)
+                return e;
+        }
+
+        if (!group.matchEmpty().empty())
+            return nullptr;
+
+        g = (g + step) & groupMask;
+    }
+
+    return nullptr;
+}
+
+//
+// Returns the index of the first empty or deleted slot on the probe sequence
+// of hash h. The shard must have at least one such slot.
+//
+template <class K, class V, class F>
+size_t FlatHashMap<K, V, F>::findInsertSlot(Shard &s, uint64_t h)
+{
+    size_t groupMask = s.capacity / GROUP_WIDTH - 1;
+    size_t g = h1(h) & groupMask;
+
+    for (size_t step = 1; ; ++step)
+    {
+        BitMask m = Group(s.ctrl + g * GROUP_WIDTH).matchEmptyOrDeleted();
+        if (!m.empty())
+            return g * GROUP_WIDTH + m.lowest();
+        g = (g + step) & groupMask;
+    }
+}
+
+//
+// Moves all elements of the shard into a freshly allocated table of
+// newCapacity slots. Tombstones are dropped on the way.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::rehashShard(Shard &s, size_t newCapacity)
+{
+    Shard old;
+    old.ctrl = s.ctrl;
+    old.slots = s.slots;
+    old.capacity = s.capacity;
+
+    size_t count = s.count;
+    allocateShard(s, newCapacity);
+
+    for (size_t i = 0; i < old.capacity; ++i)
+    {
+        if (old.ctrl[i] < 0)
+            continue;
+
+        Element *e = slotElement(old, i);
+        uint64_t h = hash(e->key);
+        size_t j = findInsertSlot(s, h);
+
+        setCtrl(s, j, h2(h));
+        new (&s.slots[j]) Element(std::move(*e));
+        e->~Element();
+    }
+
+    s.count = count;
+    s.growthLeft -= count;
+
+    ::operator delete(old.ctrl, std::align_val_t(16));
+    ::operator delete(old.slots);
+}
+
+//
+// Destroys the element at slot i. The slot becomes EMPTY if its group still
+// has an empty slot, since then no probe sequence could have passed through
+// the group. Otherwise it becomes a DELETED tombstone.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::eraseSlot(Shard &s, size_t i)
+{
+    slotElement(s, i)->~Element();
+    --s.count;
+
+    size_t groupStart = i & ~(GROUP_WIDTH - 1);
+    if (!Group(s.ctrl + groupStart).matchEmpty().empty())
+    {
+        setCtrl(s, i, CTRL_EMPTY);
+        ++s.growthLeft;
+    }
+    else
+    {
+        setCtrl(s, i, CTRL_DELETED);
+    }
+}
+
+template <class K, class V, class F>
+FlatHashMap<K, V, F>::FlatHashMap(size_t size, size_t shardCount)
+{
+    allocateShards(size, shardCount);
+}
+
+//
+// Copy constructor
+//
+template <class K, class V, class F>
+FlatHashMap<K, V, F>::FlatHashMap(FlatHashMap &other)
+    : _size(0), _shardCount(0), _shardShift(64), _shards(nullptr),
+      hashFunctor(other.hashFunctor)
+{
+    if (other._shards == nullptr)
+        return;
+
+    allocateShards(other._size, other._shardCount);
+    copyFrom(other);
+}
+
+//
+// Move constructor
+//
+template <class K, class V, class F>
+FlatHashMap<K, V, F>::FlatHashMap(FlatHashMap &&other)
+    : hashFunctor(std::move(other.hashFunctor))
+{
+    _shards = other._shards;
+    _shardCount = other._shardCount;
+    _shardShift = other._shardShift;
+    _size = other._size;
+
+    other._shards = nullptr;
+    other._shardCount = 0;
+    other._shardShift = 64;
+    other._size = 0;
+}
+
+//
+// Copy assignment operator
+//
+template <class K, class V, class F>
+FlatHashMap<K, V, F>& FlatHashMap<K, V, F>::operator=(FlatHashMap &other)
+{
+    if (this != &other)
+    {
+        destroyShards();
+        hashFunctor = other.hashFunctor;
+
+        if (other._shards != nullptr)
+        {
+            allocateShards(other._size, other._shardCount);
+            copyFrom(other);
+        }
+    }
+    return *this;
+}
+
+//
+// Move assignment operator
+//
+template <class K, class V, class F>
+FlatHashMap<K, V, F>& FlatHashMap<K, V, F>::operator=(FlatHashMap &&other)
+{
+    if (this != &other)
+    {
+        destroyShards();
+
+        hashFunctor = std::move(other.hashFunctor);
+        _shards = other._shards;
+        _shardCount = other._shardCount;
+        _shardShift = other._shardShift;
+        _size = other._size;
+
+        other._shards = nullptr;
+        other._shardCount = 0;
+        other._shardShift = 64;
+        other._size = 0;
+    }
+    return *this;
+}
+
+template <class K, class V, class F>
+FlatHashMap<K, V, F>::~FlatHashMap()
+{
+    destroyShards();
+}
+
+//
+// Checks if key exists.
+//
+template <class K, class V, class F>
+bool FlatHashMap<K, V, F>::exists(K key)
+{
+    uint64_t h = hash(key);
+    Shard &s = shardFor(h);
+    // Lock access to the shard.
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    return find(s, key, h) != nullptr;
+}
+
+//
+// Returns value for given key. If key doesn't exists throws "out of range"
+// exception.
+//
+template <class K, class V, class F>
+V FlatHashMap<K, V, F>::lookup(K key)
+{
+    uint64_t h = hash(key);
+    Shard &s = shardFor(h);
+    // Lock access to the shard.
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Element *e = find(s, key, h);
+
+    if (e == nullptr)
+        throw std::out_of_range("FlatHashMap: key doesn't exists");
+
+    return e->value;
+}
+
+//
+// Inserts key-value pair into hashmap.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::insert(K key, V value)
+{
+    uint64_t h = hash(key);
+    Shard &s = shardFor(h);
+    // Lock access to the shard.
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    // If key exists, change the value.
+    Element *e = find(s, key, h);
+    if (e != nullptr)
+    {
+        e->value = value;
+        return;
+    }
+
+    // Grow when the shard is full, or only purge tombstones when most of the
+    // used-up growth is taken by them.
+    if (s.growthLeft == 0)
+        rehashShard(s, s.count * 2 >= s.capacity - s.capacity / 8
+                           ? s.capacity * 2 : s.capacity);
+
+    size_t i = findInsertSlot(s, h);
+    if (s.ctrl[i] == CTRL_EMPTY)
+        --s.growthLeft;
+
+    new (&s.slots[i]) Element(key, value);
+    setCtrl(s, i, h2(h));
+    ++s.count;
+}
+
+//
+// Removes key and corresponding value from hashmap. If key doesn't exists
+// it throws "out of range" exception.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::remove(K key)
+{
+    uint64_t h = hash(key);
+    Shard &s = shardFor(h);
+    // Lock access to the shard.
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Element *e = find(s, key, h);
+
+    if (e == nullptr)
+        throw std::out_of_range("FlatHashMap: key doesn't exists");
+
+    eraseSlot(s, reinterpret_cast<Slot *>(e) - s.slots);
+}
+
+//
+// Rehashes every shard so that all shards together have at least newSize
+// slots. Shards can only grow beyond what their elements need.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::resize(size_t newSize)
+{
+    size_t perShard = roundCapacity((newSize + _shardCount - 1) / _shardCount);
+    _size = 0;
+
+    for (size_t i = 0; i < _shardCount; ++i)
+    {
+        Shard &s = _shards[i];
+        // Lock access to the shard.
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        size_t capacity = perShard;
+        while (s.count > capacity - capacity / 8)
+            capacity <<= 1;
+
+        rehashShard(s, capacity);
+        _size += capacity;
+    }
+}
+
+//
+// Prints out hashmap.
+//
+template <class K, class V, class F>
+void FlatHashMap<K, V, F>::print()
+{
+    for (size_t i = 0; i < _shardCount; ++i)
+    {
+        Shard &s = _shards[i];
+        // Lock access to the shard.
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        if (s.count == 0)
+            continue;
+
+        std::cout << "[" << i << "] -> ";
+        for (size_t j = 0; j < s.capacity; ++j)
+        {
+            if (s.ctrl[j] < 0)
+                continue;
+
+            Element *e = slotElement(s, j);
+            std::cout << "(" << e->key << ", " << e->value << "), ";
+        }
+        std::cout << "" << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,506 @@
+// The MIT License (MIT)
+//
+// Read-only generic hashmap with a minimal perfect hash
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef FROZENHASHMAP_H
+#define FROZENHASHMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hashmap.h"
+
+//
+// FrozenHashMap is an immutable map built once from a HashMap. Its entries are
+// packed in one array without links, and placed by a minimal perfect hash
+// function, so every key has its own slot and a lookup reads one pilot and one
+// entry. Nothing changes after construction, so lookups need no locking.
+//
+// The perfect hash is built by hash and displace (as in CHD and PTHash): keys
+// are split into buckets of about BUCKET_SIZE keys, and each bucket gets a
+// pilot, the first number that sends all keys of the bucket to free slots.
+// Buckets are placed from the largest one, while most slots are still free.
+//
+// Pilots choose among a few more slots than keys, so even the last buckets
+// find free slots in a few tries. As in PTHash, the keys placed in the extra
+// slots are then remapped to the slots left free among the first ones, so the
+// entries still take one slot per key.
+//
+// Keys whose bytes are their value (integers, for example) and strings are
+// hashed by their bytes with a seed, so a build which happens to fail can be
+// retried with another seed. Other keys are hashed by the functor F, and must
+// all have different hash codes.
+//
+// For trivially copyable K and V the map can be saved to a file and loaded
+// back by mapping the file into memory, without copying the entries.
+//
+template <class K, class V, class F = DefaultHash<K>>
+class FrozenHashMap
+{
+public:
+    struct Entry
+    {
+        K key;
+        V value;
+
+        Entry(const K &k, const V &v) : key(k), value(v) {}
+    };
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t keySize;
+        uint32_t valueSize;
+        uint32_t reserved;
+        uint64_t seed;
+        uint64_t count;
+        uint64_t bucketCount;
+    };
+
+    static constexpr uint32_t FILE_VERSION = 2;
+
+private:
+    // Average number of keys per bucket
+    static constexpr size_t BUCKET_SIZE = 4;
+
+    // One extra slot per this many keys, which keeps the last tries short
+    static constexpr size_t SLACK = 64;
+
+    // Number of pilots tried for a bucket before the build starts over
+    static constexpr uint32_t MAX_PILOT = 1u << 24;
+
+    // Number of seeds tried before giving up
+    static constexpr unsigned MAX_SEEDS = 16;
+
+    uint64_t _seed = 0;
+    size_t _count = 0;
+    size_t _bucketCount = 0;
+    size_t _slotCount = 0;
+
+    const uint32_t *_pilots = nullptr;
+    const uint64_t *_remap = nullptr;     // Entries of slots from _count on
+    const Entry *_entries = nullptr;
+
+    // Storage of a built map, or the file of a loaded one
+    std::vector<uint32_t> _pilotStorage;
+    std::vector<uint64_t> _remapStorage;
+    std::vector<Entry> _entryStorage;
+    std::unique_ptr<MappedFile> _file;
+
+    F hashFunctor;
+
+    static uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Maps h to [0, n) by multiplying, which is faster than modulo.
+    static size_t reduce(uint64_t h, size_t n)
+    {
+        return (size_t)(((unsigned __int128)h * n) >> 64);
+    }
+
+    static uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        uint64_t h = mix(seed ^ size);
+
+        for (; size >= 8; size -= 8, p += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            h = mix(h ^ word);
+        }
+
+        uint64_t tail = 0;
+        std::memcpy(&tail, p, size);
+        return mix(h ^ tail);
+    }
+
+    // Whether keys are hashed by their bytes with a seed, or by the functor
+    static constexpr bool SEEDED =
+        std::is_same<K, std::string>::value ||
+        std::has_unique_object_representations<K>::value;
+
+    uint64_t hashKey(const K &key, uint64_t seed)
+    {
+        if constexpr (std::is_same<K, std::string>::value)
+            return hashBytes(key.data(), key.size(), seed);
+        else if constexpr (SEEDED)
+            return hashBytes(&key, sizeof key, seed);
+        else
+            return mixedHash(hashFunctor, key);
+    }
+
+    size_t slotOf(uint64_t h, uint32_t pilot) const
+    {
+        return reduce(mix(h ^ mix(pilot + 1)), _slotCount);
+    }
+
+    size_t entryOf(uint64_t h) const
+    {
+        size_t slot = slotOf(h, _pilots[reduce(h, _bucketCount)]);
+        return slot < _count ? slot : _remap[slot - _count];
+    }
+
+    static size_t slotCountFor(size_t count)
+    {
+        return count + count / SLACK + 1;
+    }
+
+    static size_t alignUp(size_t offset, size_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    enum class Placement
+    {
+        Placed,
+        EqualHashes,
+        NoPilot
+    };
+
+    Placement place(const std::vector<uint64_t> &hashes,
+                    std::vector<size_t> &slots);
+    void build(std::vector<std::pair<K, V>> &items);
+
+public:
+    FrozenHashMap() {}
+
+    template <template <class> class A>
+    explicit FrozenHashMap(HashMap<K, V, F, A> &map);
+
+    explicit FrozenHashMap(std::vector<std::pair<K, V>> items)
+    {
+        build(items);
+    }
+
+    FrozenHashMap(const FrozenHashMap &) = delete;
+    FrozenHashMap &operator=(const FrozenHashMap &) = delete;
+    FrozenHashMap(FrozenHashMap &&) = default;
+    FrozenHashMap &operator=(FrozenHashMap &&) = default;
+
+    // Returns the value of key, or nullptr if key doesn't exists.
+    const V *find(const K &key)
+    {
+        if (_count == 0)
+            return nullptr;
+
+        const Entry &e = _entries[entryOf(hashKey(key, _seed))];
+
+        return e.key == key ? &e.value : nullptr;
+    }
+
+    bool exists(const K &key)
+    {
+        return find(key) != nullptr;
+    }
+
+    V lookup(const K &key)
+    {
+        const V *value = find(key);
+
+        if (value == nullptr)
+            throw std::out_of_range("FrozenHashMap: key doesn't exists");
+        return *value;
+    }
+
+    V operator[](const K &key) { return lookup(key); }
+
+    size_t getCount() const { return _count; }
+
+    void save(const std::string &path);
+    void load(const std::string &path);
+
+    const Entry *begin() const { return _entries; }
+    const Entry *end() const { return _entries + _count; }
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the FrozenHashMap methods
+//====----------------------------------------------------------------------====
+
+//
+// Builds the map from all elements of map, which shouldn't be modified in the
+// meantime.
+//
+template <class K, class V, class F>
+template <template <class> class A>
+FrozenHashMap<K, V, F>::FrozenHashMap(HashMap<K, V, F, A> &map)
+{
+    std::vector<std::pair<K, V>> items;
+
+    items.reserve(map.getCount());
+    for (auto it = map.begin(); it != map.end(); ++it)
+        items.emplace_back((*it)->key, (*it)->value);
+
+    build(items);
+}
+
+//
+// Finds pilots for all buckets, and the slot of every key given its hash code.
+// Fails if keys of a bucket have equal hash codes, or if some bucket has no
+// pilot.
+//
+template <class K, class V, class F>
+typename FrozenHashMap<K, V, F>::Placement
+FrozenHashMap<K, V, F>::place(const std::vector<uint64_t> &hashes,
+                              std::vector<size_t> &slots)
+{
+    // Sort keys by bucket, and buckets from the largest one.
+
+    std::vector<size_t> start(_bucketCount + 1);
+    std::vector<size_t> keys(_count);
+    std::vector<size_t> order(_bucketCount);
+
+    for (uint64_t h : hashes)
+        ++start[reduce(h, _bucketCount) + 1];
+    for (size_t b = 0; b < _bucketCount; ++b)
+        start[b + 1] += start[b];
+
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < _count; ++i)
+        keys[fill[reduce(hashes[i], _bucketCount)]++] = i;
+
+    for (size_t b = 0; b < _bucketCount; ++b)
+        order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return start[a + 1] - start[a] > start[b + 1] - start[b];
+    });
+
+    std::vector<bool> taken(_slotCount);
+    std::vector<size_t> bucketSlots;
+
+    for (size_t b : order)
+    {
+        uint32_t pilot = 0;
+
+        // Keys with equal hash codes would always share a slot.
+        for (size_t k = start[b]; k < start[b + 1]; ++k)
+            for (size_t j = start[b]; j < k; ++j)
+                if (hashes[keys[j]] == hashes[keys[k]])
+                    return Placement::EqualHashes;
+
+        for (;; ++pilot)
+        {
+            if (pilot == MAX_PILOT)
+                return Placement::NoPilot;
+
+            bucketSlots.clear();
+            for (size_t k = start[b]; k < start[b + 1]; ++k)
+            {
+                size_t slot = slotOf(hashes[keys[k]], pilot);
+
+                if (taken[slot] ||
+                    std::find(bucketSlots.begin(), bucketSlots.end(), slot) !=
+                        bucketSlots.end())
+                    break;
+                bucketSlots.push_back(slot);
+            }
+
+            if (bucketSlots.size() == start[b + 1] - start[b])
+                break;
+        }
+
+        _pilotStorage[b] = pilot;
+        for (size_t k = start[b]; k < start[b + 1]; ++k)
+        {
+            slots[keys[k]] = bucketSlots[k - start[b]];
+            taken[bucketSlots[k - start[b]]] = true;
+        }
+    }
+
+    // Send the keys in the extra slots to the free slots below _count, of
+    // which there are as many.
+    _remapStorage.assign(_slotCount - _count, 0);
+    size_t nextFree = 0;
+
+    for (size_t slot = _count; slot < _slotCount; ++slot)
+    {
+        if (!taken[slot])
+            continue;
+        while (taken[nextFree])
+            ++nextFree;
+        _remapStorage[slot - _count] = nextFree++;
+    }
+
+    for (size_t &slot : slots)
+        if (slot >= _count)
+            slot = _remapStorage[slot - _count];
+
+    return Placement::Placed;
+}
+
+//
+// Builds the perfect hash function for the keys of items, and packs the
+// entries in their slots.
+//
+template <class K, class V, class F>
+void FrozenHashMap<K, V, F>::build(std::vector<std::pair<K, V>> &items)
+{
+    _count = items.size();
+    _bucketCount = _count / BUCKET_SIZE + 1;
+    _slotCount = slotCountFor(_count);
+    _pilotStorage.assign(_bucketCount, 0);
+
+    std::vector<uint64_t> hashes(_count);
+    std::vector<size_t> slots(_count);
+    Placement placement = Placement::NoPilot;
+
+    for (unsigned attempt = 0; attempt < (SEEDED ? MAX_SEEDS : 1); ++attempt)
+    {
+        _seed = mix(attempt + 1);
+        for (size_t i = 0; i < _count; ++i)
+            hashes[i] = hashKey(items[i].first, _seed);
+
+        placement = place(hashes, slots);
+        if (placement == Placement::Placed)
+            break;
+    }
+
+    if (placement == Placement::EqualHashes)
+        throw std::invalid_argument("FrozenHashMap: keys with equal hash "
+                                    "codes");
+    if (placement == Placement::NoPilot)
+        throw std::runtime_error("FrozenHashMap: no pilot places all keys "
+                                 "of a bucket");
+
+    std::vector<size_t> itemOf(_count);
+    for (size_t i = 0; i < _count; ++i)
+        itemOf[slots[i]] = i;
+
+    _entryStorage.clear();
+    _entryStorage.reserve(_count);
+    for (size_t slot = 0; slot < _count; ++slot)
+        _entryStorage.emplace_back(items[itemOf[slot]].first,
+                                   items[itemOf[slot]].second);
+
+    _pilots = _pilotStorage.data();
+    _remap = _remapStorage.data();
+    _entries = _entryStorage.data();
+    _file.reset();
+}
+
+//
+// Writes the map to the file at path: a FileHeader, the pilots, the remapped
+// slots aligned for uint64_t, and the entries aligned for Entry.
+//
+template <class K, class V, class F>
+void FrozenHashMap<K, V, F>::save(const std::string &path)
+{
+    static_assert(std::is_trivially_copyable<K>::value &&
+                  std::is_trivially_copyable<V>::value,
+                  "FrozenHashMap: files need trivially copyable K and V");
+
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+
+    if (file == nullptr)
+        throw std::runtime_error("FrozenHashMap: cannot open " + path);
+
+    FileHeader header = {{'H', 'M', 'A', 'P', 'F', 'R', 'O', 'Z'},
+                         FILE_VERSION, sizeof(K), sizeof(V), 0,
+                         _seed, _count, _bucketCount};
+    size_t remapCount = _slotCount - _count;
+    size_t pilotsEnd = sizeof header + _bucketCount * sizeof(uint32_t);
+    size_t remapOffset = alignUp(pilotsEnd, alignof(uint64_t));
+    size_t remapEnd = remapOffset + remapCount * sizeof(uint64_t);
+    size_t entryOffset = alignUp(remapEnd, alignof(Entry));
+    char zeros[alignof(Entry) + alignof(uint64_t)] = {};
+
+    bool ok =
+        std::fwrite(&header, sizeof header, 1, file) == 1 &&
+        std::fwrite(_pilots, sizeof(uint32_t), _bucketCount, file) ==
+            _bucketCount &&
+        std::fwrite(zeros, 1, remapOffset - pilotsEnd, file) ==
+            remapOffset - pilotsEnd &&
+        std::fwrite(_remap, sizeof(uint64_t), remapCount, file) ==
+            remapCount &&
+        std::fwrite(zeros, 1, entryOffset - remapEnd, file) ==
+            entryOffset - remapEnd &&
+        std::fwrite(_entries, sizeof(Entry), _count, file) == _count;
+
+    if (std::fclose(file) != 0 || !ok)
+        throw std::runtime_error("FrozenHashMap: cannot write " + path);
+}
+
+//
+// Replaces the map with the one in the file at path, written by save(). The
+// file is mapped into memory, and lookups read it in place.
+//
+template <class K, class V, class F>
+void FrozenHashMap<K, V, F>::load(const std::string &path)
+{
+    static_assert(std::is_trivially_copyable<K>::value &&
+                  std::is_trivially_copyable<V>::value,
+                  "FrozenHashMap: files need trivially copyable K and V");
+
+    std::unique_ptr<MappedFile> file(new MappedFile(path));
+    FileHeader header;
+
+    if (file->size() < sizeof header)
+        throw std::runtime_error("FrozenHashMap: bad file " + path);
+    std::memcpy(&header, file->data(), sizeof header);
+
+    size_t remapCount = slotCountFor(header.count) - header.count;
+    size_t remapOffset = alignUp(sizeof header +
+                                 header.bucketCount * sizeof(uint32_t),
+                                 alignof(uint64_t));
+    size_t entryOffset = alignUp(remapOffset + remapCount * sizeof(uint64_t),
+                                 alignof(Entry));
+
+    if (std::memcmp(header.magic, "HMAPFROZ", 8) != 0 ||
+        header.version != FILE_VERSION || header.keySize != sizeof(K) ||
+        header.valueSize != sizeof(V) ||
+        header.bucketCount != header.count / BUCKET_SIZE + 1 ||
+        file->size() < entryOffset ||
+        (file->size() - entryOffset) / sizeof(Entry) < header.count)
+        throw std::runtime_error("FrozenHashMap: bad file " + path);
+
+    _seed = header.seed;
+    _count = header.count;
+    _bucketCount = header.bucketCount;
+    _slotCount = slotCountFor(_count);
+    _pilots = reinterpret_cast<const uint32_t *>(file->data() +
+                                                 sizeof header);
+    _remap = reinterpret_cast<const uint64_t *>(file->data() + remapOffset);
+    _entries = reinterpret_cast<const Entry *>(file->data() + entryOffset);
+    _pilotStorage.clear();
+    _remapStorage.clear();
+    _entryStorage.clear();
+    _file = std::move(file);
+}
+
+#endif
@@ -24,515 +24,3217 @@
 #ifndef HASHMAP_H
 #define HASHMAP_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
 #include <mutex>
+#include <optional>
+#include <random>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-template <class K, class V, class F>
-class HashMap
+//
+// Returns a small number identifying the calling thread, assigned on its first
+// call. Used to spread threads over padded per-thread slots.
+//
+inline unsigned threadIndex()
+{
+    static std::atomic<unsigned> nextIndex(0);
+    thread_local unsigned index = nextIndex++;
+    return index;
+}
+
+//
+// Multiplies a by b to 128 bits and folds the halves together. This is the
+// mixing step of wyhash, one multiply which spreads every input bit over the
+// whole result.
+//
+inline uint64_t hashMix(uint64_t a, uint64_t b)
+{
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+//
+// Hashes len bytes at data with the given seed, following wyhash. Inputs
+// longer than 48 bytes are consumed by three independent multiply chains, so
+// the CPU runs them in parallel, which is where most of its speed comes from.
+//
+inline uint64_t hashBytes(const void *data, size_t len, uint64_t seed = 0)
+{
+    static constexpr uint64_t P0 = 0xa0761d6478bd642full;
+    static constexpr uint64_t P1 = 0xe7037ed1a0b428dbull;
+    static constexpr uint64_t P2 = 0x8ebc6af09c88c6e3ull;
+    static constexpr uint64_t P3 = 0x589965cc75374cc3ull;
+
+    auto read8 = [](const uint8_t *p) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    };
+    auto read4 = [](const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return (uint64_t)v;
+    };
+
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= hashMix(seed ^ P0, P1);
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            size_t d = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + d);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - d);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+                p[len - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        size_t i = len;
+
+        if (i > 48)
+        {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+
+            do
+            {
+                seed = hashMix(read8(p) ^ P1, read8(p + 8) ^ seed);
+                seed1 = hashMix(read8(p + 16) ^ P2, read8(p + 24) ^ seed1);
+                seed2 = hashMix(read8(p + 32) ^ P3, read8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+
+        while (i > 16)
+        {
+            seed = hashMix(read8(p) ^ P1, read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+
+    unsigned __int128 r = (unsigned __int128)(a ^ P1) * (b ^ seed);
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hashMix(a ^ P0 ^ len, b ^ P1);
+}
+
+//
+// Default hash functor of the maps. Integers, enums and pointers are mixed
+// with one multiply, strings are hashed with hashBytes() through
+// std::string_view, so std::string keys can be looked up by std::string_view
+// or const char * without making a temporary std::string. Any other type goes
+// to std::hash.
+//
+// Functors whose hash codes are mixed well already say so with an
+// is_avalanching typedef, and the maps don't mix them again (see mixedHash()).
+//
+template <class T, class Enable = void>
+struct DefaultHash
+{
+    uint64_t operator()(const T &key) const
+    {
+        return std::hash<T>()(key);
+    }
+};
+
+template <class T>
+struct DefaultHash<T, typename std::enable_if<std::is_integral<T>::value ||
+                                              std::is_enum<T>::value>::type>
+{
+    typedef void is_avalanching;
+
+    uint64_t operator()(T key) const
+    {
+        return hashMix((uint64_t)key ^ 0xa0761d6478bd642full,
+                       0xe7037ed1a0b428dbull);
+    }
+};
+
+template <class T>
+struct DefaultHash<T *>
+{
+    typedef void is_avalanching;
+
+    uint64_t operator()(const T *key) const
+    {
+        return DefaultHash<uintptr_t>()((uintptr_t)key);
+    }
+};
+
+template <>
+struct DefaultHash<std::string>
+{
+    typedef void is_transparent;
+    typedef void is_avalanching;
+
+    uint64_t operator()(std::string_view key) const
+    {
+        return hashBytes(key.data(), key.size());
+    }
+};
+
+template <>
+struct DefaultHash<std::string_view> : DefaultHash<std::string>
+{
+};
+
+//
+// Random seed for SeededHash, different for every instance.
+//
+struct HashSeed
+{
+    uint64_t seed;
+
+    HashSeed()
+    {
+        static const uint64_t base =
+            ((uint64_t)std::random_device()() << 32) ^ std::random_device()();
+        static std::atomic<uint64_t> counter(0);
+
+        seed = hashMix(base ^ counter++, 0x8ebc6af09c88c6e3ull);
+    }
+};
+
+//
+// Hash functor with a random seed per instance, so every map hashes keys
+// differently and nobody can prepare keys which all fall into one bucket of
+// it. Maps copy the functor along with their hash codes, so copies of a map
+// stay consistent.
+//
+template <class T, class Enable = void>
+struct SeededHash : HashSeed
+{
+    typedef void is_avalanching;
+
+    uint64_t operator()(const T &key) const
+    {
+        return hashMix(DefaultHash<T>()(key) ^ seed, 0xe7037ed1a0b428dbull);
+    }
+};
+
+template <class T>
+struct SeededHash<T, typename std::enable_if<std::is_integral<T>::value ||
+                                             std::is_enum<T>::value>::type>
+    : HashSeed
+{
+    typedef void is_avalanching;
+
+    uint64_t operator()(T key) const
+    {
+        return hashMix((uint64_t)key ^ seed, 0xe7037ed1a0b428dbull);
+    }
+};
+
+template <>
+struct SeededHash<std::string> : HashSeed
+{
+    typedef void is_transparent;
+    typedef void is_avalanching;
+
+    uint64_t operator()(std::string_view key) const
+    {
+        return hashBytes(key.data(), key.size(), seed);
+    }
+};
+
+template <>
+struct SeededHash<std::string_view> : SeededHash<std::string>
+{
+};
+
+// Whether F declares its hash codes mixed well, by an is_avalanching typedef
+template <class F, class Enable = void>
+struct IsAvalanching : std::false_type
+{
+};
+
+template <class F>
+struct IsAvalanching<F, std::void_t<typename F::is_avalanching>>
+    : std::true_type
+{
+};
+
+//
+// Returns the hash code of key by functor f, which the maps index by. Unless
+// f is avalanching, its result goes through the Murmur3 finalizer, so that
+// functors like the identity still spread keys over all bits.
+//
+template <class F, class Q>
+inline uint64_t mixedHash(F &f, const Q &key)
+{
+    uint64_t h = f(key);
+
+    if constexpr (!IsAvalanching<F>::value)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+    }
+    return h;
+}
+
+//
+// Node allocator which simply uses new and delete.
+//
+// A node allocator policy hands out memory for one node of type T at a time,
+// or for n nodes at once with allocateMany(). If BULK_RELEASE is true,
+// release() frees all nodes at once, so the map doesn't deallocate them one by
+// one when it is destroyed.
+//
+template <class T>
+class NewAllocator
 {
 public:
-    struct Element
+    static constexpr bool BULK_RELEASE = false;
+
+    T *allocate() { return static_cast<T *>(::operator new(sizeof(T))); }
+
+    void allocateMany(T **nodes, size_t n)
     {
-        K key;
-        V value;
-        Element *next = nullptr;
+        for (size_t i = 0; i < n; ++i)
+            nodes[i] = allocate();
+    }
+
+    void deallocate(T *p) { ::operator delete(p); }
+    void release() {}
+    void swap(NewAllocator &) {}
+};
+
+//
+// Node allocator which carves nodes out of large blocks. Freed nodes are kept
+// in free lists and reused. Threads are spread over padded shards, each with
+// its own free list and blocks, so they rarely share a lock. The blocks are
+// only freed by release() (or destruction), all at once.
+//
+template <class T>
+class PoolAllocator
+{
+    static constexpr unsigned SHARDS = 16;
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
+
+    union Node
+    {
+        Node *next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    static constexpr size_t NODES_PER_BLOCK =
+        BLOCK_BYTES / sizeof(Node) > 64 ? BLOCK_BYTES / sizeof(Node) : 64;
+
+    struct alignas(64) Shard
+    {
+        std::mutex mutex;
+        Node *free = nullptr;
+
+        // Unused part of the last block
+        Node *bump = nullptr;
+        Node *end = nullptr;
 
-        Element(K k, V v) : key(k), value(v) {}
+        std::vector<Node *> blocks;
     };
 
+    Shard _shards[SHARDS];
+
+    // Takes a node from the locked shard.
+    static Node *take(Shard &s)
+    {
+        Node *n = s.free;
+
+        if (n != nullptr)
+        {
+            s.free = n->next;
+        }
+        else
+        {
+            if (s.bump == s.end)
+            {
+                s.bump = new Node[NODES_PER_BLOCK];
+                s.end = s.bump + NODES_PER_BLOCK;
+                s.blocks.push_back(s.bump);
+            }
+            n = s.bump++;
+        }
+
+        return n;
+    }
+
+public:
+    static constexpr bool BULK_RELEASE = true;
+
+    PoolAllocator() {}
+    PoolAllocator(const PoolAllocator &) = delete;
+    PoolAllocator& operator=(const PoolAllocator &) = delete;
+
+    ~PoolAllocator() { release(); }
+
+    T *allocate()
+    {
+        Shard &s = _shards[threadIndex() % SHARDS];
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        return reinterpret_cast<T *>(take(s));
+    }
+
+    //
+    // Allocates n nodes, locking the shard only once.
+    //
+    void allocateMany(T **nodes, size_t n)
+    {
+        Shard &s = _shards[threadIndex() % SHARDS];
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        for (size_t i = 0; i < n; ++i)
+            nodes[i] = reinterpret_cast<T *>(take(s));
+    }
+
+    void deallocate(T *p)
+    {
+        Shard &s = _shards[threadIndex() % SHARDS];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        Node *n = reinterpret_cast<Node *>(p);
+
+        n->next = s.free;
+        s.free = n;
+    }
+
+    //
+    // Frees all blocks. There can be no nodes in use.
+    //
+    void release()
+    {
+        for (Shard &s : _shards)
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+
+            for (Node *block : s.blocks)
+                delete [] block;
+            s.blocks.clear();
+            s.free = s.bump = s.end = nullptr;
+        }
+    }
+
+    void swap(PoolAllocator &other)
+    {
+        for (unsigned i = 0; i < SHARDS; ++i)
+        {
+            std::swap(_shards[i].free, other._shards[i].free);
+            std::swap(_shards[i].bump, other._shards[i].bump);
+            std::swap(_shards[i].end, other._shards[i].end);
+            _shards[i].blocks.swap(other._shards[i].blocks);
+        }
+    }
+};
+
+//
+// Epoch based memory reclamation. Readers traverse shared nodes inside of an
+// EpochReclaimer::Guard. Writers retire nodes they have unlinked, tagging them
+// with the current epoch, and free them once the epoch moved two steps past
+// the tag. The epoch only advances when no reader is left in the epoch before
+// the current one, so no reader can still hold a reference to a freed node.
+//
+// Readers are counted in a fixed number of padded slots, a thread being
+// assigned a slot on its first use, so entering a critical section touches only
+// the cache line of the thread's own slot.
+//
+class EpochReclaimer
+{
+public:
+    static constexpr unsigned READER_SLOTS = 32;
+
 private:
-    // Table size
-    size_t _size;
+    struct alignas(64) ReaderSlot
+    {
+        // Number of readers which entered in an even and odd epoch.
+        std::atomic<uint64_t> active[2];
+
+        ReaderSlot() { active[0] = 0; active[1] = 0; }
+    };
+
+    std::atomic<uint64_t> _epoch;
+    ReaderSlot _slots[READER_SLOTS];
+
+    static unsigned threadSlot()
+    {
+        return threadIndex() % READER_SLOTS;
+    }
+
+public:
+    EpochReclaimer() : _epoch(0) {}
 
     //
-    // The table elements are pointers to Element. Table contains linked
-    // lists where elements of the list represents entries with key-value pairs.
+    // Read-side critical section. Guards can be copied, every copy keeps the
+    // epoch pinned until it is destroyed.
     //
-    Element **_table;
+    class Guard
+    {
+        EpochReclaimer *_reclaimer;
+        unsigned _slot;
+        unsigned _parity;
+
+    public:
+        explicit Guard(EpochReclaimer &reclaimer)
+            : _reclaimer(&reclaimer), _slot(threadSlot())
+        {
+            _parity = _reclaimer->enter(_slot);
+        }
+
+        Guard(const Guard &other)
+            : _reclaimer(other._reclaimer), _slot(other._slot),
+              _parity(other._parity)
+        {
+            if (_reclaimer != nullptr)
+                _reclaimer->_slots[_slot].active[_parity].fetch_add(1);
+        }
+
+        Guard& operator=(const Guard &other)
+        {
+            Guard tmp(other);
+            std::swap(_reclaimer, tmp._reclaimer);
+            std::swap(_slot, tmp._slot);
+            std::swap(_parity, tmp._parity);
+            return *this;
+        }
+
+        ~Guard()
+        {
+            if (_reclaimer != nullptr)
+                _reclaimer->_slots[_slot].active[_parity].fetch_sub(1);
+        }
+    };
 
     //
-    // We have one mutex for each _index of table, so multiple indexes can be
-    // accessed at the same time.
+    // Counts the caller as a reader of the current epoch and returns the
+    // parity it was counted in. The epoch is checked again after counting, so
+    // a reader never gets counted in an epoch which is already being retired.
     //
-    std::mutex **_mutexes;
+    unsigned enter(unsigned slot)
+    {
+        for (;;)
+        {
+            uint64_t e = _epoch.load();
+            _slots[slot].active[e & 1].fetch_add(1);
+            if (_epoch.load() == e)
+                return e & 1;
+            _slots[slot].active[e & 1].fetch_sub(1);
+        }
+    }
+
+    uint64_t epoch() { return _epoch.load(); }
 
     //
-    // Hash function is actually a class used as functor. This function
-    // calculates an _index where an element needs to be stored. The calculated
-    // _index is modulo of MAX_TABLE_SIZE.
+    // Moves the epoch forward to at least e. Used when adopting nodes retired
+    // under another reclaimer, which must have no readers at the time.
     //
-    F hashFunctor;
+    void catchUp(uint64_t e)
+    {
+        uint64_t current = _epoch.load();
+        while (current < e && !_epoch.compare_exchange_weak(current, e))
+            ;
+    }
+
+    //
+    // Advances the epoch if there are no readers left in the previous one.
+    //
+    bool tryAdvance()
+    {
+        uint64_t e = _epoch.load();
+        unsigned previous = (e + 1) & 1;
+
+        for (unsigned i = 0; i < READER_SLOTS; ++i)
+            if (_slots[i].active[previous].load() != 0)
+                return false;
+
+        return _epoch.compare_exchange_strong(e, e + 1);
+    }
+
+    //
+    // Checks if a node retired in the given epoch can be freed.
+    //
+    bool isSafe(uint64_t retiredEpoch)
+    {
+        return _epoch.load() >= retiredEpoch + 2;
+    }
+};
+
+//
+// Read-only memory mapping of a whole file, unmapped when destroyed.
+//
+class MappedFile
+{
+    const char *_data;
+    size_t _size;
+
+public:
+    explicit MappedFile(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fd < 0)
+            throw std::runtime_error("MappedFile: cannot open " + path);
+        if (::fstat(fd, &st) < 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("MappedFile: cannot stat " + path);
+        }
+
+        _size = st.st_size;
+        _data = nullptr;
+        if (_size > 0)
+        {
+            void *p = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("MappedFile: cannot map " + path);
+            }
 
-    unsigned hash(K key)
+            // Advice values are not flags, so each one needs its own call.
+            // They are only hints, and failing them doesn't affect reading.
+            (void)::madvise(p, _size, MADV_SEQUENTIAL);
+            (void)::madvise(p, _size, MADV_WILLNEED);
+            _data = static_cast<const char *>(p);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (_data != nullptr)
+            ::munmap(const_cast<char *>(_data), _size);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+};
+
+template <class K, class V, class F = DefaultHash<K>,
+          template <class> class A = PoolAllocator>
+class HashMap
+{
+public:
+    //
+    // The link and the hash code come first, so walking a chain touches the
+    // key only if the hash codes match. The hash code is set when the element
+    // is linked in, and moving the element to a new table doesn't call the
+    // hash functor again.
+    //
+    struct Element
+    {
+        std::atomic<Element *> next;
+        uint64_t hash;
+        K key;
+        V value;
+
+        // The value is constructed in place from args.
+        template <class KK, class... Args>
+        Element(KK &&k, Args &&...args)
+            : next(nullptr), hash(0), key(std::forward<KK>(k)),
+              value(std::forward<Args>(args)...) {}
+    };
+
+private:
+    //
+    // The table elements are pointers to Element. Table contains linked
+    // lists where elements of the list represents entries with key-value pairs.
+    //
+    // Once an element is linked into the table its key and value never change,
+    // inserting an existing key links in a new element in place of the old one.
+    // This lets lookup() and exists() walk the lists without locking.
+    //
+    // While the map is being resized, the table points to the next (new) one,
+    // and its buckets are moved there one by one. A moved bucket is marked with
+    // MOVED, so lookups and writers continue in the next table.
+    //
+    struct Table
+    {
+        size_t size;
+        std::atomic<Element *> *buckets;
+        std::atomic<Table *> next;
+
+        // Next bucket to be moved, and the number of buckets moved so far
+        alignas(64) std::atomic<size_t> moveCursor;
+        std::atomic<size_t> moved;
+
+        explicit Table(size_t n)
+            : size(n), buckets(new std::atomic<Element *>[n]), next(nullptr),
+              moveCursor(0), moved(0)
+        {
+            for (size_t i = 0; i < size; ++i)
+                buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~Table() { delete [] buckets; }
+    };
+
+    static Element *moved() { return reinterpret_cast<Element *>(1); }
+
+    std::atomic<Table *> _table;
+
+    //
+    // Buckets are guarded by a fixed number of lock stripes. Table sizes are
+    // powers of two and at least the stripe count, so bucket i is guarded by
+    // stripe i % _stripeCount, which is the same as the key's hash code modulo
+    // stripe count. That way a key stays in the same stripe across resizes,
+    // and moving a bucket to the next table needs only the lock of its own
+    // stripe.
+    //
+    // Stripes are laid out contiguously, each one padded to its own cache
+    // line, so neighbouring locks don't share a line and the stripe count
+    // doesn't grow with the table.
+    //
+    // Each stripe also has a version counter, which is odd while a writer holds
+    // the stripe (like in a seqlock), the number of elements in the stripe, and
+    // a list of elements the writers have unlinked but readers may still be
+    // looking at.
+    //
+    // If HASHMAP_LOCK_STATS is defined, stripes also count how often they were
+    // locked, how often the lock was already held, and how long the writers
+    // waited for it. Otherwise the counters aren't there at all.
+    //
+    struct Retired
+    {
+        Element *element;
+        uint64_t epoch;
+    };
+
+    struct alignas(64) Stripe
+    {
+        std::mutex mutex;
+        std::atomic<uint64_t> version;
+        std::atomic<size_t> count;
+        std::vector<Retired> retired;
+#ifdef HASHMAP_LOCK_STATS
+        std::atomic<uint64_t> acquisitions{0};
+        std::atomic<uint64_t> contentions{0};
+        std::atomic<uint64_t> waitNanos{0};
+#endif
+
+        Stripe() : version(0), count(0) {}
+
+        // Locks the stripe for writing, so Stripe can be used with lock_guard.
+        void lock()
+        {
+#ifdef HASHMAP_LOCK_STATS
+            if (!mutex.try_lock())
+            {
+                auto start = std::chrono::steady_clock::now();
+
+                mutex.lock();
+                contentions.fetch_add(1, std::memory_order_relaxed);
+                waitNanos.fetch_add(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count(),
+                    std::memory_order_relaxed);
+            }
+            acquisitions.fetch_add(1, std::memory_order_relaxed);
+#else
+            mutex.lock();
+#endif
+            version.store(version.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void unlock()
+        {
+            version.store(version.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_release);
+            mutex.unlock();
+        }
+    };
+
+    size_t _stripeCount;
+    Stripe *_stripes;
+
+    Stripe &stripeFor(uint64_t h)
+    {
+        return _stripes[h & (_stripeCount - 1)];
+    }
+
+    // Number of retired elements in a stripe after which we try to free them
+    static constexpr size_t RECLAIM_THRESHOLD = 64;
+
+    // Number of optimistic attempts of a read before falling back to locking
+    static constexpr unsigned READ_RETRIES = 8;
+
+    // Number of buckets each insert() and remove() moves while resizing
+    static constexpr unsigned MOVE_BATCH = 2;
+
+    // Number of keys the batched operations hash and prefetch at once
+    static constexpr size_t BATCH_SIZE = 64;
+
+    // Minimal number of elements load() and the parallel operations give to
+    // each of their threads, below which starting a thread doesn't pay off
+    static constexpr size_t LOAD_CHUNK = 1 << 16;
+
+    EpochReclaimer _reclaimer;
+
+    //
+    // Elements are allocated by the node allocator policy A, by default from
+    // the pool of large blocks.
+    //
+    A<Element> _allocator;
+
+    template <class... Args>
+    Element *newElement(Args &&...args)
+    {
+        Element *e = _allocator.allocate();
+
+        try
+        {
+            return new (e) Element(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            _allocator.deallocate(e);
+            throw;
+        }
+    }
+
+    void deleteElement(Element *e)
+    {
+        e->~Element();
+        _allocator.deallocate(e);
+    }
+
+    //
+    // Like deleteElement(), but used when the whole map is destroyed. If the
+    // allocator frees all nodes at once, only the element is destroyed.
+    //
+    void freeElement(Element *e)
+    {
+        if (A<Element>::BULK_RELEASE)
+            e->~Element();
+        else
+            deleteElement(e);
+    }
+
+    //
+    // Resizing is started (and the retired tables are kept) under the resize
+    // mutex. It is never held while a stripe is being locked.
+    //
+    struct RetiredTable
+    {
+        Table *table;
+        uint64_t epoch;
+    };
+
+    std::mutex _resizeMutex;
+    std::vector<RetiredTable> _retiredTables;
+
+    // Average number of elements per bucket after which the map grows
+    float _maxLoadFactor;
+
+    //
+    // Hash function is actually a class used as functor. This function
+    // calculates the hash code of a key, passing the result of the functor
+    // through a mixer (the MurmurHash3 finalizer), so all of its bits depend on
+    // all bits of the functor's result. Table sizes are powers of two, and an
+    // element is stored in the bucket at the low bits of the hash code, which
+    // weak functors alone would leave clustered.
+    //
+    // If the functor has an is_transparent member type, keys can be looked up
+    // by any type it accepts and which compares to K, like std::string_view for
+    // std::string keys, so no temporary K has to be made.
+    //
+    F hashFunctor;
+
+    template <class Q>
+    uint64_t hash(const Q &key)
+    {
+        return mixedHash(hashFunctor, key);
+    }
+
+    //
+    // Returns the first element in the bucket for hash code h, following moved
+    // buckets to the next table. The caller must be inside of an epoch guard.
+    //
+    Element *headFor(uint64_t h)
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            Element *head = t->buckets[h & (t->size - 1)].load(
+                std::memory_order_acquire);
+            if (head != moved())
+                return head;
+            t = t->next.load(std::memory_order_acquire);
+        }
+    }
+
+    //
+    // Returns the bucket for hash code h, following moved buckets to the next
+    // table. The caller must be inside of an epoch guard, and hold the stripe
+    // lock so the bucket isn't moved under it.
+    //
+    std::atomic<Element *> &bucketFor(uint64_t h)
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            std::atomic<Element *> &bucket = t->buckets[h & (t->size - 1)];
+            if (bucket.load(std::memory_order_acquire) != moved())
+                return bucket;
+            t = t->next.load(std::memory_order_acquire);
+        }
+    }
+
+    void allocateTableAndStripes(size_t size, size_t stripeCount);
+    void destroyTableAndStripes();
+    void copyFrom(HashMap &other);
+    void retire(Stripe &stripe, Element *e);
+    void reclaim(Stripe &stripe);
+
+    template <class Q>
+    Element *findElement(const Q &key, uint64_t h);
+
+    template <class Q, class Fn>
+    bool modifyLocked(Stripe &stripe, Table *t, const Q &key, uint64_t h,
+                      Fn &fn);
+
+    template <class Q, class Fn>
+    void modify(const Q &key, Fn fn) { modify(key, hash(key), fn); }
+
+    template <class Q, class Fn>
+    void modify(const Q &key, uint64_t h, Fn fn);
+
+    template <class Fn>
+    void findMany(const K *keys, size_t n, Fn fn);
+
+    template <class KeyOf, class Fn>
+    void modifyMany(size_t n, KeyOf keyOf, Fn fn);
+
+    template <class Q>
+    void removeElement(const Q &key, uint64_t h);
+
+    template <class KK, class... Args>
+    bool tryEmplaceKey(KK &&key, Args &&...args);
+    size_t roundSize(size_t size);
+    bool startResize(Table *t, size_t newSize);
+    void moveBucket(Table *t, Table *nt, size_t i);
+    void finishResize(Table *t, Table *nt);
+
+    template <class Fn>
+    void forEachInStripe(size_t s, Fn fn);
+
+    unsigned workerCount(unsigned threads, size_t elements);
+
+    void collectClass(Table *t, size_t i, size_t n,
+                      std::vector<Element *> &out);
+    void collectBucket(Table *t, size_t i, std::vector<Element *> &out);
+
+    template <class Fn>
+    void forEachStripeParallel(Fn fn, unsigned threads, size_t elements);
+
+    template <class Fn>
+    void runTransaction(const K *keys, size_t n, Fn &fn);
+
+public:
+    static constexpr size_t DEFAULT_STRIPES = 64;
+    static constexpr float DEFAULT_MAX_LOAD_FACTOR = 1.0f;
+
+    //
+    // Result of find(). It gives access to the found element without copying
+    // it, and keeps the element from being freed until the handle is
+    // destroyed, so handles should be short-lived. Evaluates to false if the
+    // key wasn't found.
+    //
+    class Handle
+    {
+        EpochReclaimer::Guard _guard;
+        Element *_element;
+
+        friend class HashMap;
+
+        explicit Handle(EpochReclaimer &reclaimer)
+            : _guard(reclaimer), _element(nullptr) {}
+
+    public:
+        explicit operator bool() const { return _element != nullptr; }
+
+        const K &key() const { return _element->key; }
+        const V &value() const { return _element->value; }
+        const V &operator*() const { return _element->value; }
+        const V *operator->() const { return &_element->value; }
+    };
+
+    ~HashMap();
+
+    //
+    // Hash code of a key, from hashOf(). Maps built on HashMap which need the
+    // hash code themselves, to pick a shard or a segment, pass it to the
+    // overloads taking one, so the key isn't hashed twice. It must come from
+    // this map, or one with an equal hash functor.
+    //
+    struct HashCode
+    {
+        uint64_t value;
+    };
+
+    HashCode hashOf(const K &key) { return {hash(key)}; }
+
+    Handle find(const K &key) { return find(key, hashOf(key)); }
+    bool exists(const K &key) { return exists(key, hashOf(key)); }
+    V lookup(const K &key) { return lookup(key, hashOf(key)); }
+
+    Handle find(const K &key, HashCode h);
+    bool exists(const K &key, HashCode h);
+    V lookup(const K &key, HashCode h);
+
+    //
+    // Finds key in a map which no thread modifies any more, like a version
+    // published by CowHashMap, without entering an epoch or checking stripe
+    // versions. Returns nullptr if key doesn't exists.
+    //
+    const V *findFrozen(const K &key);
+
+    void insert(const K &key, const V &value)
+    {
+        insert(key, value, hashOf(key));
+    }
+
+    void remove(const K &key) { remove(key, hashOf(key)); }
+
+    void insert(const K &key, const V &value, HashCode h);
+    void remove(const K &key, HashCode h);
+
+    // Lookups by other key types, if the hash functor is transparent
+    template <class Q, class FF = F, class = typename FF::is_transparent>
+    Handle find(const Q &key);
+
+    template <class Q, class FF = F, class = typename FF::is_transparent>
+    bool exists(const Q &key);
+
+    template <class Q, class FF = F, class = typename FF::is_transparent>
+    V lookup(const Q &key);
+
+    template <class Q, class FF = F, class = typename FF::is_transparent>
+    void remove(const Q &key);
+
+    //
+    // Batched operations over n keys (or key-value pairs). All keys of a batch
+    // are hashed and their buckets prefetched before any of them is resolved,
+    // so the cache misses overlap, and the writers take each stripe lock only
+    // once per batch. They don't throw on missing keys.
+    //
+    size_t lookupMany(const K *keys, size_t n, V *values, bool *found);
+    void existsMany(const K *keys, size_t n, bool *results);
+    void insertMany(const std::pair<K, V> *pairs, size_t n);
+    size_t removeMany(const K *keys, size_t n);
+
+    template <class KK, class... Args>
+    bool emplace(KK &&key, Args &&...args);
+
+    template <class... Args>
+    bool tryEmplace(const K &key, Args &&...args)
+    {
+        return tryEmplaceKey(key, std::forward<Args>(args)...);
+    }
+
+    template <class... Args>
+    bool tryEmplace(K &&key, Args &&...args)
+    {
+        return tryEmplaceKey(std::move(key), std::forward<Args>(args)...);
+    }
+
+    //
+    // Read-modify-write operations. Each one locks the stripe of the key once,
+    // and calls the given function once, under the lock, so it is atomic with
+    // respect to the other writers. Since elements are immutable, a changed
+    // value is stored in a new element which replaces the old one.
+    //
+    template <class Fn, class... Args>
+    bool upsert(const K &key, Fn fn, Args &&...args)
+    {
+        return upsert(key, hashOf(key), fn, std::forward<Args>(args)...);
+    }
+
+    template <class Fn, class... Args>
+    bool upsert(const K &key, HashCode h, Fn fn, Args &&...args);
+
+    template <class Fn>
+    bool computeIfPresent(const K &key, Fn fn)
+    {
+        return computeIfPresent(key, hashOf(key), fn);
+    }
+
+    template <class Fn>
+    bool computeIfPresent(const K &key, HashCode h, Fn fn);
+
+    template <class Fn>
+    V computeIfAbsent(const K &key, Fn fn);
+
+    bool insertOrAssign(const K &key, const V &value);
+
+    template <class Pred>
+    bool eraseIf(const K &key, Pred pred)
+    {
+        return eraseIf(key, hashOf(key), pred);
+    }
+
+    template <class Pred>
+    bool eraseIf(const K &key, HashCode h, Pred pred);
+
+    template <class T = V>
+    typename std::enable_if<std::is_arithmetic<T>::value, T>::type
+    fetchAdd(const K &key, T delta)
+    {
+        return fetchAdd(key, hashOf(key), delta);
+    }
+
+    template <class T = V>
+    typename std::enable_if<std::is_arithmetic<T>::value, T>::type
+    fetchAdd(const K &key, HashCode h, T delta);
+
+    //
+    // Multi-key transactions. transaction() locks the stripes of all given
+    // keys, in the order of their indexes so that concurrent transactions
+    // can't deadlock, and calls fn(Transaction &) under the locks. Through the
+    // Transaction, fn reads and writes the given keys, and only those. Its
+    // writes become visible together once fn returns, or are dropped if fn
+    // throws. Returns the result of fn.
+    //
+    // Keys in other stripes stay available to other threads meanwhile. fn
+    // must not call the map itself, since it may need a stripe fn holds.
+    //
+    class Transaction
+    {
+        struct Slot
+        {
+            K key;
+            uint64_t hash;
+            Element *current;           // Element in the map, or nullptr
+            Element *pending;           // Element to commit, or nullptr
+            bool changed;
+        };
+
+        HashMap &_map;
+        std::vector<Slot> _slots;
+
+        friend class HashMap;
+
+        explicit Transaction(HashMap &map) : _map(map) {}
+
+        // Returns the slot of key with hash code h, or nullptr.
+        Slot *findSlot(const K &key, uint64_t h)
+        {
+            size_t i = 0;
+
+            while (i < _slots.size() &&
+                   (_slots[i].hash != h || _slots[i].key != key))
+                ++i;
+            return i < _slots.size() ? &_slots[i] : nullptr;
+        }
+
+        Slot &slotFor(const K &key)
+        {
+            Slot *slot = findSlot(key, _map.hash(key));
+
+            if (slot == nullptr)
+                throw std::invalid_argument(
+                    "HashMap: key isn't part of the transaction");
+            return *slot;
+        }
+
+        static Element *visible(const Slot &slot)
+        {
+            return slot.changed ? slot.pending : slot.current;
+        }
+
+        void setPending(Slot &slot, Element *e)
+        {
+            if (slot.pending != nullptr)
+                _map.deleteElement(slot.pending);
+            slot.pending = e;
+            slot.changed = true;
+        }
+
+    public:
+        ~Transaction()
+        {
+            for (Slot &slot : _slots)
+                if (slot.pending != nullptr)
+                    _map.deleteElement(slot.pending);
+        }
+
+        Transaction(const Transaction &other) = delete;
+        Transaction& operator=(const Transaction &other) = delete;
+
+        bool exists(const K &key)
+        {
+            return visible(slotFor(key)) != nullptr;
+        }
+
+        // Returns nullptr if key doesn't exists.
+        const V *find(const K &key)
+        {
+            Element *e = visible(slotFor(key));
+            return e == nullptr ? nullptr : &e->value;
+        }
+
+        const V &lookup(const K &key)
+        {
+            Element *e = visible(slotFor(key));
+
+            if (e == nullptr)
+                throw std::out_of_range("HashMap: key doesn't exists");
+            return e->value;
+        }
+
+        void insert(const K &key, const V &value)
+        {
+            Slot &slot = slotFor(key);
+            setPending(slot, _map.newElement(key, value));
+        }
+
+        void remove(const K &key)
+        {
+            Slot &slot = slotFor(key);
+
+            if (visible(slot) == nullptr)
+                throw std::out_of_range("HashMap: key doesn't exists");
+            setPending(slot, nullptr);
+        }
+    };
+
+    template <class Fn>
+    using TransactionResult = typename std::decay<decltype(
+        std::declval<Fn &>()(std::declval<Transaction &>()))>::type;
+
+    template <class Fn>
+    TransactionResult<Fn> transaction(const K *keys, size_t n, Fn fn);
+
+    template <class Fn>
+    TransactionResult<Fn> transaction(std::initializer_list<K> keys, Fn fn)
+    {
+        return transaction(keys.begin(), keys.size(), fn);
+    }
+
+    //
+    // Statistics returned by stats(). chainLengths[n] is the number of buckets
+    // holding n elements. The lock counters have an entry per stripe, and are
+    // empty unless HASHMAP_LOCK_STATS is defined before including hashmap.h.
+    //
+    struct Stats
+    {
+        size_t count;
+        size_t size;
+        float loadFactor;
+        size_t longestChain;
+        std::vector<size_t> chainLengths;
+        std::vector<uint64_t> lockAcquisitions;
+        std::vector<uint64_t> lockContentions;
+        std::vector<uint64_t> lockWaitNanos;
+    };
+
+    //
+    // Snapshots. save() writes all elements to a file, in a versioned binary
+    // format: a SnapshotHeader followed by the keys and values, each record
+    // being the bytes of a K and then of a V. load() maps such a file into
+    // memory and replaces the contents of the map with it, building the table
+    // from several threads at once. K and V must be trivially copyable.
+    //
+    struct SnapshotHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t keySize;
+        uint32_t valueSize;
+        uint32_t reserved;
+        uint64_t count;
+    };
+
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+    void save(const std::string &path);
+    void load(const std::string &path);
+
+    //
+    // Bulk building. bulkLoad() replaces the contents of the map with the
+    // pairs in [first, last), a later pair winning over an earlier one with
+    // the same key. The pairs are partitioned by stripe first, then the
+    // buckets of each stripe are built by one thread, without locking, from
+    // elements allocated in batches. Like load(), it must not run while other
+    // threads use the map.
+    //
+    // reserve() grows the table so it holds n elements without exceeding the
+    // maximum load factor.
+    //
+    template <class It>
+    void bulkLoad(It first, It last, unsigned threads = 0);
+    void reserve(size_t n);
+
+    //
+    // Parallel operations, run on at most the given number of threads, or on
+    // one per hardware thread if it is 0. Each thread gets at least LOAD_CHUNK
+    // elements, so small maps are handled by the calling thread alone. The
+    // threads take whole stripes, and lock a stripe while working on it, so
+    // writers to other stripes can go on. fn may be called from several
+    // threads at once, and must not modify the map.
+    //
+    // parallelForEach() calls fn(key, value) for every element.
+    // parallelReduce() combines the results of fn(key, value) for all elements
+    // by combine(), starting from identity on every thread.
+    // clear() removes all elements.
+    //
+    template <class Fn>
+    void parallelForEach(Fn fn, unsigned threads = 0);
+
+    template <class T, class Fn, class Combine>
+    T parallelReduce(T identity, Fn fn, Combine combine, unsigned threads = 0);
+
+    void clear(unsigned threads = 0);
+
+    void resize(size_t newSize);
+    bool helpResize();
+    void completeResize();
+    void print();
+    Stats stats();
+    size_t size();
+    size_t approximateSize();
+    size_t getCount() { return approximateSize(); }
+    size_t getStripeCount() { return _stripeCount; }
+    float getMaxLoadFactor() { return _maxLoadFactor; }
+    void setMaxLoadFactor(float f) { _maxLoadFactor = f; }
+
+    size_t getSize()
+    {
+        Table *t = _table.load(std::memory_order_acquire);
+        return t == nullptr ? 0 : t->size;
+    }
+
+    std::atomic<Element *> *getTable()
+    {
+        return _table.load(std::memory_order_acquire)->buckets;
+    }
+
+    HashMap()
+        : _table(nullptr), _stripeCount(0), _stripes(nullptr),
+          _maxLoadFactor(DEFAULT_MAX_LOAD_FACTOR) {}
+    HashMap(size_t size, size_t stripeCount = DEFAULT_STRIPES,
+            const F &hashFunctor = F());
+
+    // Builds the map from the pairs in [first, last), see bulkLoad().
+    template <class It, class = typename std::iterator_traits<
+                            It>::iterator_category>
+    HashMap(It first, It last, unsigned threads = 0,
+            size_t stripeCount = DEFAULT_STRIPES);
+    HashMap(HashMap &other);             // Copy constructor
+    HashMap(HashMap &&other);            // Move constructor
+
+    HashMap& operator=(HashMap &other);  // Copy assignment operator
+    HashMap& operator=(HashMap &&other); // Move assignment operator
+
+    // Indexed access of HashMap elements
+    // T & operator[](int n) { return _data[n]; }
+    V operator[](const K &key) { return lookup(key); }
+
+    //
+    // Iterator class
+    //
+    // Iterators are weakly consistent: they can be used while other threads
+    // insert, remove and resize. Every element which is in the map for the
+    // whole iteration is visited once, elements inserted or removed meanwhile
+    // may or may not be. Iterators keep an epoch guard, so the elements they
+    // return are not freed until they are destroyed, which also means that
+    // long-lived iterators hold up reclaiming of removed elements.
+    //
+    // The buckets of the table current at begin() are visited one by one, and
+    // the elements of a bucket are collected at once (see collectBucket()),
+    // following it to the next tables if it was moved.
+    //
+    class Iterator
+    {
+        HashMap<K, V, F, A> *_map;
+        EpochReclaimer::Guard _guard;
+        Table *_table;
+        size_t _index = 0;
+        std::vector<Element *> _elements;
+        size_t _position = 0;
+
+        // Collects buckets until one has any elements, or there are no more.
+        void fill()
+        {
+            while (_position >= _elements.size() && _table != nullptr &&
+                   _index < _table->size)
+            {
+                _map->collectBucket(_table, _index++, _elements);
+                _position = 0;
+            }
+        }
+
+        void next()
+        {
+            ++_position;
+            fill();
+        }
+
+        Element *current() const
+        {
+            return _position < _elements.size() ? _elements[_position]
+                                                : nullptr;
+        }
+
+    public:
+        Iterator(HashMap<K, V, F, A> *map, bool begin)
+            : _map(map), _guard(map->_reclaimer), _table(nullptr)
+        {
+            if (begin)
+            {
+                _table = map->_table.load(std::memory_order_acquire);
+                fill();
+            }
+        }
+
+        // Prefix increment operator
+        Iterator & operator++()
+        {
+            next();
+            return *this;
+        }
+
+        // Postfix increment operator
+        Iterator operator++(int)
+        {
+            Iterator tmp = *this;
+            next();
+            return tmp;
+        }
+
+        Element * operator*()
+        {
+            return current();
+        }
+
+        bool operator==(const Iterator &other) const
+        {
+            return other.current() == current();
+        }
+
+        bool operator!=(const Iterator &other) const
+        {
+            return other.current() != current();
+        }
+    };
+
+    Iterator begin() { return Iterator(this, true); }
+    Iterator end() { return Iterator(this, false); }
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the HashMap methods
+//====----------------------------------------------------------------------====
+
+//
+// Rounds size up to a power of two, which is at least the stripe count.
+//
+template <class K, class V, class F, template <class> class A>
+size_t HashMap<K, V, F, A>::roundSize(size_t size)
+{
+    size_t rounded = _stripeCount;
+
+    while (rounded < size)
+        rounded *= 2;
+    return rounded;
+}
+
+//
+// Allocates new table and stripes. The stripe count is rounded down to a power
+// of two, and is never greater than the table size. The table size is rounded
+// up to a power of two.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::allocateTableAndStripes(size_t size,
+                                                  size_t stripeCount)
+{
+    _stripeCount = 1;
+    while (_stripeCount * 2 <= stripeCount && _stripeCount * 2 <= size)
+        _stripeCount *= 2;
+    _stripes = new Stripe[_stripeCount];
+
+    _table.store(new Table(roundSize(size)), std::memory_order_release);
+}
+
+//
+// Deallocates tables and stripes
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::destroyTableAndStripes()
+{
+    Table *t = _table.load(std::memory_order_acquire);
+
+    if (t == nullptr)
+        return;
+
+    // If there is nothing to do per element, the allocator frees them all at
+    // once, without walking the lists.
+    bool walk = !A<Element>::BULK_RELEASE ||
+                !std::is_trivially_destructible<Element>::value;
+
+    for (size_t s = 0; s < _stripeCount && walk; ++s)
+    {
+        // Lock access to table elements in stripe s.
+        std::lock_guard<std::mutex> lock(_stripes[s].mutex);
+
+        forEachInStripe(s, [this](Element *e) { freeElement(e); });
+
+        // There can be no readers left, so the retired elements can go too.
+        for (Retired &r : _stripes[s].retired)
+            freeElement(r.element);
+    }
+
+    _allocator.release();
+
+    while (t != nullptr)
+    {
+        Table *old = t;
+        t = t->next.load(std::memory_order_relaxed);
+        delete old;
+    }
+
+    for (RetiredTable &r : _retiredTables)
+        delete r.table;
+    _retiredTables.clear();
+
+    delete [] _stripes;
+    _table.store(nullptr, std::memory_order_relaxed);
+    _stripes = nullptr;
+    _stripeCount = 0;
+}
+
+//
+// Inserts all elements of other, one stripe of other at a time.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::copyFrom(HashMap &other)
+{
+    EpochReclaimer::Guard guard(other._reclaimer);
+    Table *t = _table.load(std::memory_order_relaxed);
+
+    // Both maps have the same stripe count, so the copies of the elements in
+    // stripe s of other go to buckets of stripe s here, which no other thread
+    // touches. Nobody else uses this map yet, so they are linked in directly,
+    // with their hash codes.
+    other.forEachStripeParallel([&](size_t s) {
+        size_t count = 0;
+
+        // Lock access to table elements of other in stripe s.
+        std::lock_guard<std::mutex> lock(other._stripes[s].mutex);
+
+        other.forEachInStripe(s, [&](Element *e) {
+            Element *copy = newElement(e->key, e->value);
+            std::atomic<Element *> &bucket =
+                t->buckets[e->hash & (t->size - 1)];
+
+            copy->hash = e->hash;
+            copy->next.store(bucket.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+            bucket.store(copy, std::memory_order_relaxed);
+            ++count;
+        });
+
+        _stripes[s].count.store(count, std::memory_order_relaxed);
+    }, 0, other.approximateSize());
+}
+
+//
+// Calls fn for every element of stripe s, in all tables. The stripe must be
+// locked, and the caller inside of an epoch guard, unless the map is not shared
+// with other threads. fn may delete the element.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void HashMap<K, V, F, A>::forEachInStripe(size_t s, Fn fn)
+{
+    Table *t = _table.load(std::memory_order_acquire);
+
+    while (t != nullptr)
+    {
+        for (size_t i = s; i < t->size; i += _stripeCount)
+        {
+            Element *tmp = t->buckets[i].load(std::memory_order_acquire);
+            if (tmp == moved())
+                continue;
+
+            while (tmp != nullptr)
+            {
+                Element *next = tmp->next.load(std::memory_order_acquire);
+                fn(tmp);
+                tmp = next;
+            }
+        }
+        t = t->next.load(std::memory_order_acquire);
+    }
+}
+
+//
+// Appends to out the elements of table t, and of the tables after it, whose
+// hash codes modulo n are i. n is the size of the table the caller started
+// from, so in bigger tables such elements are in buckets i, i + n, i + 2n, ...
+// and in smaller tables they share one bucket with other elements.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::collectClass(Table *t, size_t i, size_t n,
+                                       std::vector<Element *> &out)
+{
+    if (t->size >= n)
+    {
+        for (size_t j = i; j < t->size; j += n)
+        {
+            Element *tmp = t->buckets[j].load(std::memory_order_acquire);
+
+            if (tmp == moved())
+            {
+                collectClass(t->next.load(std::memory_order_acquire), j,
+                             t->size, out);
+                continue;
+            }
+
+            for (; tmp != nullptr; tmp = tmp->next.load())
+                out.push_back(tmp);
+        }
+        return;
+    }
+
+    Element *tmp = t->buckets[i & (t->size - 1)].load(
+        std::memory_order_acquire);
+
+    if (tmp == moved())
+    {
+        collectClass(t->next.load(std::memory_order_acquire), i, n, out);
+        return;
+    }
+
+    for (; tmp != nullptr; tmp = tmp->next.load())
+        if ((tmp->hash & (n - 1)) == i)
+            out.push_back(tmp);
+}
+
+//
+// Replaces the contents of out with the elements of bucket i of table t, or
+// wherever they were moved to. Like in findElement(), the lists are walked
+// without locking, and the result is trusted only if no writer held the
+// stripe in the meantime. The caller must be inside of an epoch guard.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::collectBucket(Table *t, size_t i,
+                                        std::vector<Element *> &out)
+{
+    Stripe &stripe = stripeFor(i);
+
+    for (unsigned attempt = 0; attempt < READ_RETRIES; ++attempt)
+    {
+        uint64_t version = stripe.version.load(std::memory_order_acquire);
+        if (version & 1)
+            continue;
+
+        out.clear();
+        collectClass(t, i, t->size, out);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (stripe.version.load(std::memory_order_relaxed) == version)
+            return;
+    }
+
+    // Lock access to table elements in the stripe.
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    out.clear();
+    collectClass(t, i, t->size, out);
+}
+
+//
+// Returns the number of worker threads to use for a parallel operation over
+// about elements elements, asked to run on threads threads. There is no point
+// in having more than stripes, nor in giving a thread less than LOAD_CHUNK
+// elements, so small maps are handled by the calling thread alone.
+//
+template <class K, class V, class F, template <class> class A>
+unsigned HashMap<K, V, F, A>::workerCount(unsigned threads, size_t elements)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::min({(size_t)threads, _stripeCount,
+                     elements / LOAD_CHUNK + 1});
+}
+
+//
+// Calls fn(s) for every stripe s, on threads threads for about elements
+// elements (see workerCount()). The calling thread is one of them. The
+// threads take the stripes one at a time, so stripes with long lists don't
+// hold up the others. An exception thrown by fn stops the remaining work,
+// and is rethrown.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void HashMap<K, V, F, A>::forEachStripeParallel(Fn fn, unsigned threads,
+                                                size_t elements)
+{
+    unsigned count = workerCount(threads, elements);
+    std::atomic<size_t> nextStripe(0);
+    std::vector<std::exception_ptr> errors(count);
+    std::vector<std::thread> workers;
+
+    auto work = [&](unsigned id) {
+        try
+        {
+            size_t s;
+            while ((s = nextStripe.fetch_add(1)) < _stripeCount)
+                fn(s);
+        }
+        catch (...)
+        {
+            errors[id] = std::current_exception();
+            nextStripe.store(_stripeCount);
+        }
+    };
+
+    for (unsigned id = 1; id < count; ++id)
+        workers.emplace_back(work, id);
+    if (count > 0)
+        work(0);
+    for (auto &worker : workers)
+        worker.join();
+
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+template <class K, class V, class F, template <class> class A>
+HashMap<K, V, F, A>::HashMap(size_t size, size_t stripeCount,
+                             const F &hashFunctor)
+    : _maxLoadFactor(DEFAULT_MAX_LOAD_FACTOR), hashFunctor(hashFunctor)
+{
+    allocateTableAndStripes(size, stripeCount);
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class It, class>
+HashMap<K, V, F, A>::HashMap(It first, It last, unsigned threads,
+                             size_t stripeCount)
+    : _maxLoadFactor(DEFAULT_MAX_LOAD_FACTOR)
+{
+    // Only the stripe count matters, bulkLoad() sizes the table.
+    allocateTableAndStripes(stripeCount, stripeCount);
+    bulkLoad(first, last, threads);
+}
+
+//
+// Copy constructor
+//
+template <class K, class V, class F, template <class> class A>
+HashMap<K, V, F, A>::HashMap(HashMap &other)
+    : _table(nullptr), _stripeCount(0), _stripes(nullptr),
+      _maxLoadFactor(other._maxLoadFactor), hashFunctor(other.hashFunctor)
+{
+    if (other.getSize() == 0)
+        return;
+
+    allocateTableAndStripes(other.getSize(), other._stripeCount);
+    copyFrom(other);
+}
+
+//
+// Move constructor
+//
+template <class K, class V, class F, template <class> class A>
+HashMap<K, V, F, A>::HashMap(HashMap &&other)
+    : hashFunctor(std::move(other.hashFunctor))
+{
+    _table.store(other._table.load());
+    _stripes = other._stripes;
+    _stripeCount = other._stripeCount;
+    _retiredTables.swap(other._retiredTables);
+    _allocator.swap(other._allocator);
+    _maxLoadFactor = other._maxLoadFactor;
+
+    // Elements retired in other are tagged with its epochs.
+    _reclaimer.catchUp(other._reclaimer.epoch());
+
+    other._table.store(nullptr);
+    other._stripes = nullptr;
+    other._stripeCount = 0;
+}
+
+//
+// Copy assignment operator
+//
+template <class K, class V, class F, template <class> class A>
+HashMap<K, V, F, A>& HashMap<K, V, F, A>::operator=(HashMap &other)
+{
+    if (this != &other)
+    {
+        destroyTableAndStripes();
+        hashFunctor = other.hashFunctor;
+        _maxLoadFactor = other._maxLoadFactor;
+
+        if (other.getSize() != 0)
+        {
+            allocateTableAndStripes(other.getSize(), other._stripeCount);
+            copyFrom(other);
+        }
+    }
+    return *this;
+}
+
+//
+// Move assignment operator
+//
+template <class K, class V, class F, template <class> class A>
+HashMap<K, V, F, A>& HashMap<K, V, F, A>::operator=(HashMap &&other)
+{
+    if (this != &other)
+    {
+        destroyTableAndStripes();
+
+        hashFunctor = std::move(other.hashFunctor);
+        _table.store(other._table.load());
+        _stripes = other._stripes;
+        _stripeCount = other._stripeCount;
+        _retiredTables.swap(other._retiredTables);
+        _allocator.swap(other._allocator);
+        _maxLoadFactor = other._maxLoadFactor;
+        _reclaimer.catchUp(other._reclaimer.epoch());
+
+        other._table.store(nullptr);
+        other._stripes = nullptr;
+        other._stripeCount = 0;
+    }
+    return *this;
+}
+
+template <class K, class V, class F, template <class> class A>
+HashMap<K, V, F, A>::~HashMap()
+{
+    destroyTableAndStripes();
+}
+
+//
+// Adds an unlinked element to the retired list of the stripe, which must be
+// locked by the caller. Once the list grows long enough, frees the elements no
+// reader can see any more.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::retire(Stripe &stripe, Element *e)
+{
+    stripe.retired.push_back({e, _reclaimer.epoch()});
+
+    if (stripe.retired.size() < RECLAIM_THRESHOLD)
+        return;
+
+    _reclaimer.tryAdvance();
+    reclaim(stripe);
+}
+
+//
+// Frees the retired elements of the stripe, which must be locked by the
+// caller, that no reader can see any more.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::reclaim(Stripe &stripe)
+{
+    // Elements are retired in the epoch order, so the safe ones are at front.
+    size_t n = 0;
+    while (n < stripe.retired.size() &&
+           _reclaimer.isSafe(stripe.retired[n].epoch))
+    {
+        deleteElement(stripe.retired[n].element);
+        ++n;
+    }
+    stripe.retired.erase(stripe.retired.begin(), stripe.retired.begin() + n);
+}
+
+template <class K, class V, class F, template <class> class A>
+const V *HashMap<K, V, F, A>::findFrozen(const K &key)
+{
+    if (_table.load(std::memory_order_acquire) == nullptr)
+        return nullptr;
+
+    uint64_t h = hash(key);
+    Element *tmp = headFor(h);
+
+    while (tmp != nullptr && (tmp->hash != h || tmp->key != key))
+        tmp = tmp->next.load(std::memory_order_acquire);
+
+    return tmp == nullptr ? nullptr : &tmp->value;
+}
+
+//
+// Returns the element with given key, or nullptr if key doesn't exists. The
+// caller must be inside of an epoch guard.
+//
+// The list is first walked without locking. A found element is returned right
+// away, since elements are immutable. A miss is trusted only if no writer held
+// the stripe in the meantime (a writer moving the bucket to the next table
+// could have led us to a wrong list), otherwise the walk is retried, and after
+// a few retries done under the lock.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Q>
+typename HashMap<K, V, F, A>::Element *
+HashMap<K, V, F, A>::findElement(const Q &key, uint64_t h)
+{
+    Stripe &stripe = stripeFor(h);
+
+    for (unsigned attempt = 0; attempt < READ_RETRIES; ++attempt)
+    {
+        uint64_t version = stripe.version.load(std::memory_order_acquire);
+        if (version & 1)
+            continue;
+
+        Element *tmp = headFor(h);
+
+        while (tmp != nullptr && (tmp->hash != h || tmp->key != key))
+            tmp = tmp->next.load(std::memory_order_acquire);
+
+        if (tmp != nullptr)
+            return tmp;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (stripe.version.load(std::memory_order_relaxed) == version)
+            return nullptr;
+    }
+
+    // Lock access to table elements in the stripe.
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    Element *tmp = bucketFor(h).load(std::memory_order_relaxed);
+
+    while (tmp != nullptr && (tmp->hash != h || tmp->key != key))
+        tmp = tmp->next.load(std::memory_order_relaxed);
+
+    return tmp;
+}
+
+//
+// Finds the element with given key in the locked stripe, and calls fn with it,
+// or with nullptr if key doesn't exists. fn returns the element which should
+// be there from now on: the same one to leave the list as it is, a new one
+// (from newElement()) to add or replace, or nullptr to remove.
+//
+// Returns true if the stripe now holds more than its share of the maximum
+// load of table t, the current table when the stripe was locked.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Q, class Fn>
+bool HashMap<K, V, F, A>::modifyLocked(Stripe &stripe, Table *t, const Q &key,
+                                       uint64_t h, Fn &fn)
+{
+    // Traverse the list and check if a key already exists.
+
+    std::atomic<Element *> *link = &bucketFor(h);
+    Element *tmp = link->load(std::memory_order_relaxed);
+
+    while (tmp != nullptr && (tmp->hash != h || tmp->key != key))
+    {
+        link = &tmp->next;
+        tmp = link->load(std::memory_order_relaxed);
+    }
+
+    Element *e = fn(tmp);
+
+    if (e == tmp)
+        return false;
+
+    // Link the new element in place of the old one, or at the end of list, or
+    // unlink the old one.
+
+    Element *next = tmp == nullptr
+                        ? nullptr
+                        : tmp->next.load(std::memory_order_relaxed);
+
+    if (e != nullptr)
+    {
+        e->hash = h;
+        e->next.store(next, std::memory_order_relaxed);
+        link->store(e, std::memory_order_release);
+    }
+    else
+    {
+        link->store(next, std::memory_order_release);
+    }
+
+    size_t count = stripe.count.load(std::memory_order_relaxed);
+
+    if (tmp == nullptr)
+    {
+        stripe.count.store(++count, std::memory_order_relaxed);
+        return count * _stripeCount > _maxLoadFactor * t->size;
+    }
+
+    if (e == nullptr)
+        stripe.count.store(--count, std::memory_order_relaxed);
+    retire(stripe, tmp);
+    return false;
+}
+
+//
+// Locks the stripe of the key and modifies its element by fn, see
+// modifyLocked(). Grows the map once the stripe holds more than its share of
+// the maximum load.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Q, class Fn>
+void HashMap<K, V, F, A>::modify(const Q &key, uint64_t h, Fn fn)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    for (unsigned n = 0; n < MOVE_BATCH && helpResize(); ++n)
+        ;
+
+    Stripe &stripe = stripeFor(h);
+    Table *t = _table.load(std::memory_order_acquire);
+    bool grow;
+
+    {
+        // Lock access to table elements in the stripe.
+        std::lock_guard<Stripe> lock(stripe);
+
+        grow = modifyLocked(stripe, t, key, h, fn);
+    }
+
+    if (grow)
+        startResize(t, t->size * 2);
+}
+
+//
+// Returns a handle to the element with given key. Unlike lookup() it doesn't
+// throw and doesn't copy the value.
+//
+template <class K, class V, class F, template <class> class A>
+typename HashMap<K, V, F, A>::Handle
+HashMap<K, V, F, A>::find(const K &key, HashCode h)
+{
+    Handle handle(_reclaimer);
+
+    handle._element = findElement(key, h.value);
+    return handle;
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class Q, class FF, class>
+typename HashMap<K, V, F, A>::Handle HashMap<K, V, F, A>::find(const Q &key)
+{
+    Handle handle(_reclaimer);
+
+    handle._element = findElement(key, hash(key));
+    return handle;
+}
+
+//
+// Checks if key exists.
+//
+template <class K, class V, class F, template <class> class A>
+bool HashMap<K, V, F, A>::exists(const K &key, HashCode h)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    return findElement(key, h.value) != nullptr;
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class Q, class FF, class>
+bool HashMap<K, V, F, A>::exists(const Q &key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    return findElement(key, hash(key)) != nullptr;
+}
+
+//
+// Returns value for given key. If key doesn't exists throws "out of range"
+// exception.
+//
+template <class K, class V, class F, template <class> class A>
+V HashMap<K, V, F, A>::lookup(const K &key, HashCode h)
+{
+    Handle handle = find(key, h);
+
+    if (!handle)
+        throw std::out_of_range("HashMap: key doesn't exists");
+
+    return *handle;
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class Q, class FF, class>
+V HashMap<K, V, F, A>::lookup(const Q &key)
+{
+    Handle handle = find(key);
+
+    if (!handle)
+        throw std::out_of_range("HashMap: key doesn't exists");
+
+    return *handle;
+}
+
+//
+// Inserts key-value pair into hashmap. If key exists, its element is replaced
+// by a new one.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::insert(const K &key, const V &value, HashCode h)
+{
+    modify(key, h.value, [&](Element *) { return newElement(key, value); });
+}
+
+//
+// Inserts an element constructed from key and args, the value being
+// constructed in place, unless key already exists. The element is constructed
+// first, even if it ends up not being inserted. Returns true if inserted.
+//
+template <class K, class V, class F, template <class> class A>
+template <class KK, class... Args>
+bool HashMap<K, V, F, A>::emplace(KK &&key, Args &&...args)
+{
+    Element *e = newElement(std::forward<KK>(key),
+                            std::forward<Args>(args)...);
+    bool inserted = false;
+
+    try
+    {
+        modify(e->key, [&](Element *old) {
+            inserted = old == nullptr;
+            return inserted ? e : old;
+        });
+    }
+    catch (...)
+    {
+        deleteElement(e);
+        throw;
+    }
+
+    if (!inserted)
+        deleteElement(e);
+
+    return inserted;
+}
+
+//
+// Like emplace(), but the element is constructed only if key doesn't exist.
+// Returns true if inserted.
+//
+template <class K, class V, class F, template <class> class A>
+template <class KK, class... Args>
+bool HashMap<K, V, F, A>::tryEmplaceKey(KK &&key, Args &&...args)
+{
+    bool inserted = false;
+
+    modify(key, [&](Element *old) {
+        if (old != nullptr)
+            return old;
+        inserted = true;
+        return newElement(std::forward<KK>(key), std::forward<Args>(args)...);
+    });
+
+    return inserted;
+}
+
+//
+// If key exists, calls fn with a copy of its value, which fn may change, and
+// stores the copy. Otherwise inserts the value constructed from args, without
+// calling fn. Returns true if inserted.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn, class... Args>
+bool HashMap<K, V, F, A>::upsert(const K &key, HashCode h, Fn fn,
+                                 Args &&...args)
+{
+    bool inserted = false;
+
+    modify(key, h.value, [&](Element *old) {
+        if (old == nullptr)
+        {
+            inserted = true;
+            return newElement(key, std::forward<Args>(args)...);
+        }
+
+        V value = old->value;
+        fn(value);
+        return newElement(key, std::move(value));
+    });
+
+    return inserted;
+}
+
+//
+// If key exists, replaces its value by fn(value). Returns true if key exists.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+bool HashMap<K, V, F, A>::computeIfPresent(const K &key, HashCode h, Fn fn)
+{
+    bool present = false;
+
+    modify(key, h.value, [&](Element *old) {
+        if (old == nullptr)
+            return old;
+        present = true;
+        return newElement(key, fn(old->value));
+    });
+
+    return present;
+}
+
+//
+// If key doesn't exist, inserts it with the value fn(). Returns the value of
+// key, either the existing or the inserted one.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+V HashMap<K, V, F, A>::computeIfAbsent(const K &key, Fn fn)
+{
+    std::optional<V> value;
+
+    // The value is copied under the lock, as once it is released the element
+    // may be replaced and freed.
+    modify(key, [&](Element *old) {
+        Element *e = old != nullptr ? old : newElement(key, fn());
+        value.emplace(e->value);
+        return e;
+    });
+
+    return std::move(*value);
+}
+
+//
+// Inserts key with value, or assigns value to the existing key. Returns true
+// if inserted.
+//
+template <class K, class V, class F, template <class> class A>
+bool HashMap<K, V, F, A>::insertOrAssign(const K &key, const V &value)
+{
+    bool inserted = false;
+
+    modify(key, [&](Element *old) {
+        inserted = old == nullptr;
+        return newElement(key, value);
+    });
+
+    return inserted;
+}
+
+//
+// Removes key if pred(value) is true. Returns true if removed.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Pred>
+bool HashMap<K, V, F, A>::eraseIf(const K &key, HashCode h, Pred pred)
+{
+    bool erased = false;
+
+    modify(key, h.value, [&](Element *old) -> Element * {
+        if (old == nullptr || !pred(old->value))
+            return old;
+        erased = true;
+        return nullptr;
+    });
+
+    return erased;
+}
+
+//
+// Adds delta to the value of key, inserting key with value delta if it doesn't
+// exist. Returns the value before the addition, or zero if inserted.
+//
+template <class K, class V, class F, template <class> class A>
+template <class T>
+typename std::enable_if<std::is_arithmetic<T>::value, T>::type
+HashMap<K, V, F, A>::fetchAdd(const K &key, HashCode h, T delta)
+{
+    T previous = T();
+
+    modify(key, h.value, [&](Element *old) {
+        if (old != nullptr)
+            previous = old->value;
+        return newElement(key, previous + delta);
+    });
+
+    return previous;
+}
+
+//
+// Locks the stripes of n keys in ascending order, finds their elements and
+// calls fn(Transaction &) under the locks. Then applies the writes of the
+// transaction by modifyLocked(), still under the locks. Grows the map once a
+// stripe holds more than its share of the maximum load.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void HashMap<K, V, F, A>::runTransaction(const K *keys, size_t n, Fn &fn)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    for (unsigned m = 0; m < MOVE_BATCH && helpResize(); ++m)
+        ;
+
+    Transaction tx(*this);
+    std::vector<size_t> stripes;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t h = hash(keys[i]);
+
+        if (tx.findSlot(keys[i], h) != nullptr)
+            continue;
+
+        tx._slots.push_back({keys[i], h, nullptr, nullptr, false});
+        stripes.push_back(h & (_stripeCount - 1));
+    }
+
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+
+    Table *t = _table.load(std::memory_order_acquire);
+    bool grow = false;
+
+    // Lock access to table elements in the stripes of all keys.
+    for (size_t s : stripes)
+        _stripes[s].lock();
+
+    try
+    {
+        for (auto &slot : tx._slots)
+        {
+            Element *tmp = bucketFor(slot.hash).load(std::memory_order_relaxed);
+
+            while (tmp != nullptr &&
+                   (tmp->hash != slot.hash || tmp->key != slot.key))
+                tmp = tmp->next.load(std::memory_order_relaxed);
+            slot.current = tmp;
+        }
+
+        fn(tx);
+
+        for (auto &slot : tx._slots)
+        {
+            if (!slot.changed)
+                continue;
+
+            auto commit = [&slot](Element *) { return slot.pending; };
+
+            if (modifyLocked(stripeFor(slot.hash), t, slot.key, slot.hash,
+                             commit))
+                grow = true;
+            slot.pending = nullptr;
+        }
+    }
+    catch (...)
     {
-        return hashFunctor(key) % _size;
+        for (size_t i = stripes.size(); i > 0; --i)
+            _stripes[stripes[i - 1]].unlock();
+        throw;
     }
 
-    void allocateTableAndMutexes(size_t size);
-    void destroyTableAndMutexes();
+    for (size_t i = stripes.size(); i > 0; --i)
+        _stripes[stripes[i - 1]].unlock();
 
-public:
-    ~HashMap();
-    bool exists(K key);
-    V lookup(K key);
-    void insert(K key, V value);
-    void remove(K key);
-    void resize(size_t newSize);
-    void print();
-    size_t getSize() { return _size; }
-    Element **getTable() { return _table; }
+    if (grow)
+        startResize(t, t->size * 2);
+}
 
-    HashMap() : _size(0), _table(nullptr), _mutexes(nullptr) {}
-    HashMap(size_t Size);
-    HashMap(HashMap &other);             // Copy constructor
-    HashMap(HashMap &&other);            // Move constructor
+//
+// Runs fn on a Transaction over n keys, see runTransaction(), and returns its
+// result. Equal keys are taken once.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+typename HashMap<K, V, F, A>::template TransactionResult<Fn>
+HashMap<K, V, F, A>::transaction(const K *keys, size_t n, Fn fn)
+{
+    typedef TransactionResult<Fn> Result;
 
-    HashMap& operator=(HashMap &other);  // Copy assignment operator
-    HashMap& operator=(HashMap &&other); // Move assignment operator
+    if constexpr (std::is_void<Result>::value)
+    {
+        runTransaction(keys, n, fn);
+    }
+    else
+    {
+        std::optional<Result> result;
+        auto run = [&](Transaction &tx) { result.emplace(fn(tx)); };
 
-    // Indexed access of HashMap elements
-    // T & operator[](int n) { return _data[n]; }
-    V operator[](K key) const { return lookup(key); }
+        runTransaction(keys, n, run);
+        return std::move(*result);
+    }
+}
 
-    //
-    // Iterator class
-    //
-    class Iterator
-    {
-        HashMap<K, V, F> *_map;
-        Element *_current = nullptr;
-        unsigned _index = 0;
+//
+// Removes key and corresponding value from hashmap. If key doesn't exists
+// it throws "out of range" exception.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Q>
+void HashMap<K, V, F, A>::removeElement(const Q &key, uint64_t h)
+{
+    modify(key, h, [](Element *old) -> Element * {
+        if (old == nullptr)
+            throw std::out_of_range("HashMap: key doesn't exists");
+        return nullptr;
+    });
+}
 
-        void next()
-        {
-            if (_current == nullptr)
-                return;
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::remove(const K &key, HashCode h)
+{
+    removeElement(key, h.value);
+}
 
-            if (_current->next == nullptr)
-            {
-                size_t size = _map->getSize();
+template <class K, class V, class F, template <class> class A>
+template <class Q, class FF, class>
+void HashMap<K, V, F, A>::remove(const Q &key)
+{
+    removeElement(key, hash(key));
+}
 
-                // Find a next element in the table different then nullptr
-                do
-                {
-                    ++_index;
-                }
-                while (_index < size && _map->getTable()[_index] == nullptr);
+//
+// Calls fn(i, element) for each of the n keys, element being nullptr if the
+// key doesn't exists.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void HashMap<K, V, F, A>::findMany(const K *keys, size_t n, Fn fn)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    uint64_t hashes[BATCH_SIZE];
 
-                if (_index < size)
-                    _current = _map->getTable()[_index];
-                else
-                    _current = nullptr;
-            }
-            else
-            {
-                _current = _current->next;
-            }
-        }
+    for (size_t first = 0; first < n; first += BATCH_SIZE)
+    {
+        size_t count = std::min(n - first, BATCH_SIZE);
+        Table *t = _table.load(std::memory_order_acquire);
 
-    public:
-        Iterator() {}
-        Iterator(HashMap<K, V, F> *map, Element *current)
-            : _map(map), _current(current) {}
+        // Hash all keys and prefetch their buckets, then prefetch the first
+        // elements of the buckets, and only then walk the lists.
 
-        // Prefix increment operator
-        Iterator & operator++()
+        for (size_t i = 0; i < count; ++i)
         {
-            next();
-            return *this;
+            hashes[i] = hash(keys[first + i]);
+            __builtin_prefetch(&t->buckets[hashes[i] & (t->size - 1)]);
         }
 
-        // Postfix increment operator
-        Iterator operator++(int)
+        for (size_t i = 0; i < count; ++i)
         {
-            Iterator tmp = *this;
-            next();
-            return tmp;
+            Element *head = t->buckets[hashes[i] & (t->size - 1)].load(
+                std::memory_order_relaxed);
+            if (head != nullptr && head != moved())
+                __builtin_prefetch(head);
         }
 
-        Element * operator*()
+        for (size_t i = 0; i < count; ++i)
+            fn(first + i, findElement(keys[first + i], hashes[i]));
+    }
+}
+
+//
+// Modifies the elements of n keys, keyOf(i) being the i-th key, by calling
+// fn(i, element), see modifyLocked(). Keys of a batch are grouped by stripe,
+// and each stripe is locked once. Keys in the same stripe keep their order, so
+// of the equal keys the last one is modified last.
+//
+template <class K, class V, class F, template <class> class A>
+template <class KeyOf, class Fn>
+void HashMap<K, V, F, A>::modifyMany(size_t n, KeyOf keyOf, Fn fn)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    uint64_t hashes[BATCH_SIZE];
+    unsigned order[BATCH_SIZE];
+
+    for (size_t first = 0; first < n; first += BATCH_SIZE)
+    {
+        for (unsigned m = 0; m < MOVE_BATCH && helpResize(); ++m)
+            ;
+
+        size_t count = std::min(n - first, BATCH_SIZE);
+        Table *t = _table.load(std::memory_order_acquire);
+        uint64_t mask = _stripeCount - 1;
+        bool grow = false;
+
+        for (size_t i = 0; i < count; ++i)
         {
-            return _current;
+            hashes[i] = hash(keyOf(first + i));
+            __builtin_prefetch(&t->buckets[hashes[i] & (t->size - 1)], 1);
         }
 
-        bool operator==(Iterator other)
+        // Insertion sort by stripe, which is stable.
+        for (size_t i = 0; i < count; ++i)
         {
-            return other._current == _current;
+            size_t j = i;
+            for (; j > 0 && (hashes[order[j - 1]] & mask) > (hashes[i] & mask);
+                 --j)
+                order[j] = order[j - 1];
+            order[j] = i;
         }
 
-        bool operator!=(Iterator other)
+        for (size_t i = 0; i < count; )
         {
-            return other._current != _current;
+            Stripe &stripe = stripeFor(hashes[order[i]]);
+            // Lock access to table elements in the stripe.
+            std::lock_guard<Stripe> lock(stripe);
+
+            do
+            {
+                size_t k = first + order[i];
+                auto fnk = [&](Element *old) { return fn(k, old); };
+
+                if (modifyLocked(stripe, t, keyOf(k), hashes[order[i]], fnk))
+                    grow = true;
+                ++i;
+            }
+            while (i < count && &stripeFor(hashes[order[i]]) == &stripe);
         }
-    };
 
-    Iterator begin()
-    {
-        Element *first = nullptr;
-        unsigned i = 0;
-        while (i < _size && _table[i] == nullptr)
-            ++i;
-        if (i < _size)
-            first = _table[i];
-        return Iterator(this, first);
+        if (grow)
+            startResize(t, t->size * 2);
     }
+}
 
-    Iterator end() { return Iterator(this, nullptr); }
-};
+//
+// Looks up n keys. For each key found, sets found[i] and copies its value to
+// values[i]. Returns the number of keys found.
+//
+template <class K, class V, class F, template <class> class A>
+size_t HashMap<K, V, F, A>::lookupMany(const K *keys, size_t n, V *values,
+                                       bool *found)
+{
+    size_t count = 0;
 
-//====----------------------------------------------------------------------====
-// Implementation of the HashMap methods
-//====----------------------------------------------------------------------====
+    findMany(keys, n, [&](size_t i, Element *e) {
+        found[i] = e != nullptr;
+        if (e != nullptr)
+        {
+            values[i] = e->value;
+            ++count;
+        }
+    });
+
+    return count;
+}
 
 //
-// Sets _size to size, and allocates new table and mutexes
+// Checks if n keys exist, setting results[i] for each.
 //
-template <class K, class V, class F>
-void HashMap<K, V, F>::allocateTableAndMutexes(size_t size)
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::existsMany(const K *keys, size_t n, bool *results)
 {
-    _size = size;
-    _table = new Element *[_size];
-    _mutexes = new std::mutex *[_size];
+    findMany(keys, n, [&](size_t i, Element *e) {
+        results[i] = e != nullptr;
+    });
+}
 
-    for (unsigned i = 0; i < _size; ++i)
-        _mutexes[i] = new std::mutex;
+//
+// Inserts n key-value pairs. Of the pairs with equal keys the last one wins.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::insertMany(const std::pair<K, V> *pairs, size_t n)
+{
+    modifyMany(n,
+               [pairs](size_t i) -> const K & { return pairs[i].first; },
+               [&](size_t i, Element *) {
+                   return newElement(pairs[i].first, pairs[i].second);
+               });
+}
 
-    for (unsigned i = 0; i < _size; ++i)
-    {
-        // Lock access to table elements at i.
-        std::lock_guard<std::mutex> lock(*_mutexes[i]);
+//
+// Removes n keys. Returns the number of keys which existed.
+//
+template <class K, class V, class F, template <class> class A>
+size_t HashMap<K, V, F, A>::removeMany(const K *keys, size_t n)
+{
+    size_t count = 0;
 
-        _table[i] = nullptr;
-    }
+    modifyMany(n,
+               [keys](size_t i) -> const K & { return keys[i]; },
+               [&](size_t, Element *old) -> Element * {
+                   if (old != nullptr)
+                       ++count;
+                   return nullptr;
+               });
+
+    return count;
 }
 
 //
-// Deallocates table and mutexes
+// Writes all elements to the file at path. Stripes are saved one at a time
+// under their lock, so the snapshot is consistent within each stripe, but not
+// across stripes while other threads insert or remove.
 //
-template <class K, class V, class F>
-void HashMap<K, V, F>::destroyTableAndMutexes()
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::save(const std::string &path)
 {
-    if (_table == nullptr)
-        return;
+    static_assert(std::is_trivially_copyable<K>::value &&
+                  std::is_trivially_copyable<V>::value,
+                  "HashMap: snapshots need trivially copyable K and V");
+
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+
+    if (file == nullptr)
+        throw std::runtime_error("HashMap: cannot open " + path);
+
+    SnapshotHeader header = {{'H', 'M', 'A', 'P', 'S', 'N', 'A', 'P'},
+                             SNAPSHOT_VERSION, sizeof(K), sizeof(V), 0, 0};
+    bool ok = std::fwrite(&header, sizeof header, 1, file) == 1;
 
-    for (unsigned i = 0; i < _size; ++i)
     {
+        EpochReclaimer::Guard guard(_reclaimer);
+
+        for (size_t s = 0; s < _stripeCount && ok; ++s)
         {
-            // Lock access to table elements at i.
-            std::lock_guard<std::mutex> lock(*_mutexes[i]);
+            // Lock access to table elements in the stripe.
+            std::lock_guard<std::mutex> lock(_stripes[s].mutex);
+
+            forEachInStripe(s, [&](Element *e) {
+                ok = ok && std::fwrite(&e->key, sizeof(K), 1, file) == 1 &&
+                     std::fwrite(&e->value, sizeof(V), 1, file) == 1;
+                ++header.count;
+            });
+        }
+    }
 
-            if (_table[i] == nullptr)
-                continue;
+    // Now that the count is known, write the header again.
+    ok = ok && std::fseek(file, 0, SEEK_SET) == 0 &&
+         std::fwrite(&header, sizeof header, 1, file) == 1;
 
-            Element *tmp = _table[i];
+    if (std::fclose(file) != 0 || !ok)
+        throw std::runtime_error("HashMap: cannot write " + path);
+}
 
-            while (tmp != nullptr)
+//
+// Replaces the contents of the map with the snapshot at path, written by
+// save(). The table is sized for the snapshot up front, and the elements are
+// linked in from several threads, each taking a range of the file. Must not
+// run concurrently with other operations on the map.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::load(const std::string &path)
+{
+    static_assert(std::is_trivially_copyable<K>::value &&
+                  std::is_trivially_copyable<V>::value,
+                  "HashMap: snapshots need trivially copyable K and V");
+
+    MappedFile file(path);
+    SnapshotHeader header;
+    const size_t recordSize = sizeof(K) + sizeof(V);
+
+    if (file.size() < sizeof header)
+        throw std::runtime_error("HashMap: bad snapshot " + path);
+    std::memcpy(&header, file.data(), sizeof header);
+    if (std::memcmp(header.magic, "HMAPSNAP", 8) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.keySize != sizeof(K) ||
+        header.valueSize != sizeof(V) ||
+        (file.size() - sizeof header) / recordSize < header.count)
+        throw std::runtime_error("HashMap: bad snapshot " + path);
+
+    size_t stripeCount = _stripeCount == 0 ? DEFAULT_STRIPES : _stripeCount;
+    size_t count = header.count;
+
+    destroyTableAndStripes();
+    allocateTableAndStripes(count / _maxLoadFactor + 1, stripeCount);
+
+    const char *records = file.data() + sizeof header;
+    Table *t = _table.load(std::memory_order_relaxed);
+    size_t threadCount = workerCount(0, count);
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(threadCount);
+
+    // Nobody else uses the map yet, so elements are pushed to the front of
+    // their buckets without locking.
+    auto build = [&](size_t id) {
+        std::vector<size_t> counts(_stripeCount);
+        size_t first = count * id / threadCount;
+        size_t last = count * (id + 1) / threadCount;
+
+        try
+        {
+            for (size_t i = first; i < last; ++i)
             {
-                Element *old = tmp;
-                tmp = tmp->next;
-                delete old;
+                K key;
+                V value;
+
+                std::memcpy(&key, records + i * recordSize, sizeof(K));
+                std::memcpy(&value, records + i * recordSize + sizeof(K),
+                            sizeof(V));
+
+                Element *e = newElement(key, value);
+                std::atomic<Element *> &bucket =
+                    t->buckets[(e->hash = hash(key)) & (t->size - 1)];
+                Element *head = bucket.load(std::memory_order_relaxed);
+
+                do
+                    e->next.store(head, std::memory_order_relaxed);
+                while (!bucket.compare_exchange_weak(head, e));
+
+                ++counts[e->hash & (_stripeCount - 1)];
             }
         }
-        delete _mutexes[i];
-    }
+        catch (...)
+        {
+            errors[id] = std::current_exception();
+        }
 
-    delete [] _table;
-    delete [] _mutexes;
-    _size = 0;
-}
+        for (size_t s = 0; s < _stripeCount; ++s)
+            _stripes[s].count.fetch_add(counts[s]);
+    };
 
-template <class K, class V, class F>
-HashMap<K, V, F>::HashMap(size_t size)
-{
-    allocateTableAndMutexes(size);
+    for (size_t id = 1; id < threadCount; ++id)
+        threads.emplace_back(build, id);
+    build(0);
+    for (auto &thread : threads)
+        thread.join();
+
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
 }
 
-//
-// Copy constructor
-//
-template <class K, class V, class F>
-HashMap<K, V, F>::HashMap(HashMap &other)
+template <class K, class V, class F, template <class> class A>
+template <class It>
+void HashMap<K, V, F, A>::bulkLoad(It first, It last, unsigned threads)
 {
-    allocateTableAndMutexes(other._size);
+    static_assert(std::is_base_of<std::random_access_iterator_tag,
+                                  typename std::iterator_traits<
+                                      It>::iterator_category>::value,
+                  "HashMap: bulkLoad() needs random access iterators");
+
+    size_t stripeCount = _stripeCount == 0 ? DEFAULT_STRIPES : _stripeCount;
+    size_t n = last - first;
+
+    destroyTableAndStripes();
+    allocateTableAndStripes(n / _maxLoadFactor + 1, stripeCount);
+
+    Table *t = _table.load(std::memory_order_relaxed);
+    const size_t stripes = _stripeCount;
+
+    // The input is cut into chunks, and the pairs of every chunk are counted
+    // per stripe, and then scattered to their stripe's part of order, keeping
+    // the input order within each stripe.
+    const size_t chunks = std::min<size_t>(stripes, 64);
+    std::vector<uint64_t> hashes(n);
+    std::vector<size_t> order(n);
+    std::vector<size_t> offsets(chunks * stripes);
+    std::vector<size_t> starts(stripes + 1);
+
+    forEachStripeParallel([&](size_t c) {
+        if (c >= chunks)
+            return;
+        for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; ++i)
+        {
+            hashes[i] = hash(first[i].first);
+            ++offsets[c * stripes + (hashes[i] & (stripes - 1))];
+        }
+    }, threads, n);
 
-    // Insert elements from other
-    for (unsigned i = 0; i < other._size; ++i)
+    size_t offset = 0;
+    for (size_t s = 0; s < stripes; ++s)
     {
-        // Lock access to table elements at i.
-        std::lock_guard<std::mutex> lock(*other._mutexes[i]);
+        starts[s] = offset;
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            size_t count = offsets[c * stripes + s];
+            offsets[c * stripes + s] = offset;
+            offset += count;
+        }
+    }
+    starts[stripes] = offset;
+
+    forEachStripeParallel([&](size_t c) {
+        if (c >= chunks)
+            return;
+        for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; ++i)
+            order[offsets[c * stripes + (hashes[i] & (stripes - 1))]++] = i;
+    }, threads, n);
+
+    // Every stripe owns its buckets, so they are built without locking.
+    forEachStripeParallel([&](size_t s) {
+        Element *nodes[BATCH_SIZE];
+        size_t available = 0;
+        size_t count = 0;
+
+        try
+        {
+            for (size_t k = starts[s]; k < starts[s + 1]; ++k)
+            {
+                size_t i = order[k];
+                uint64_t h = hashes[i];
+                const auto &pair = first[i];
+                std::atomic<Element *> &bucket = t->buckets[h & (t->size - 1)];
+                Element *tmp = bucket.load(std::memory_order_relaxed);
 
-        if (other._table[i] == nullptr)
-            continue;
+                while (tmp != nullptr &&
+                       (tmp->hash != h || tmp->key != pair.first))
+                    tmp = tmp->next.load(std::memory_order_relaxed);
+
+                if (tmp != nullptr)
+                {
+                    tmp->value = pair.second;
+                    continue;
+                }
+
+                if (available == 0)
+                {
+                    available =
+                        std::min<size_t>(BATCH_SIZE, starts[s + 1] - k);
+                    _allocator.allocateMany(nodes, available);
+                }
 
-        Element *tmp = other._table[i];
+                Element *e = new (nodes[available - 1])
+                    Element(pair.first, pair.second);
+                --available;
 
-        while (tmp != nullptr)
+                e->hash = h;
+                e->next.store(bucket.load(std::memory_order_relaxed),
+                              std::memory_order_relaxed);
+                bucket.store(e, std::memory_order_relaxed);
+                ++count;
+            }
+        }
+        catch (...)
         {
-            insert(tmp->key, tmp->value);
-            tmp = tmp->next;
+            for (size_t j = 0; j < available; ++j)
+                _allocator.deallocate(nodes[j]);
+            _stripes[s].count.store(count, std::memory_order_relaxed);
+            throw;
         }
-    }
+
+        for (size_t j = 0; j < available; ++j)
+            _allocator.deallocate(nodes[j]);
+        _stripes[s].count.store(count, std::memory_order_relaxed);
+    }, threads, n);
+}
+
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::reserve(size_t n)
+{
+    size_t size = n / _maxLoadFactor + 1;
+
+    if (_table.load(std::memory_order_acquire) == nullptr)
+        allocateTableAndStripes(size, DEFAULT_STRIPES);
+    else if (roundSize(size) > getSize())
+        resize(size);
 }
 
 //
-// Move constructor
+// Starts resizing table t to newSize buckets, unless t is not the current
+// table any more, or it is already being resized. The buckets are then moved
+// by helpResize().
 //
-template <class K, class V, class F>
-HashMap<K, V, F>::HashMap(HashMap &&other)
+template <class K, class V, class F, template <class> class A>
+bool HashMap<K, V, F, A>::startResize(Table *t, size_t newSize)
 {
-    _table = other._table;
-    _mutexes = other._mutexes;
-    _size = other._size;
+    std::lock_guard<std::mutex> lock(_resizeMutex);
+
+    if (_table.load(std::memory_order_acquire) != t ||
+        t->next.load(std::memory_order_acquire) != nullptr)
+        return false;
 
-    other._table = nullptr;
-    other._mutexes = nullptr;
-    other._size = 0;
+    t->next.store(new Table(roundSize(newSize)), std::memory_order_release);
+    return true;
 }
 
 //
-// Copy assignment operator
+// Moves all elements of bucket i of table t to the next table nt. Elements are
+// relinked, not copied. The stripe of the bucket must be locked for writing, so
+// the readers notice that the lists changed under them.
 //
-template <class K, class V, class F>
-HashMap<K, V, F>& HashMap<K, V, F>::operator=(HashMap &other)
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::moveBucket(Table *t, Table *nt, size_t i)
 {
-    if (this != &other)
+    Element *tmp = t->buckets[i].load(std::memory_order_relaxed);
+
+    while (tmp != nullptr)
     {
-        destroyTableAndMutexes();
-        allocateTableAndMutexes(other._size);
+        Element *next = tmp->next.load(std::memory_order_relaxed);
+        std::atomic<Element *> &bucket =
+            nt->buckets[tmp->hash & (nt->size - 1)];
+
+        // Released, since readers still walking the list of t can follow it
+        // into the list of nt.
+        tmp->next.store(bucket.load(std::memory_order_relaxed),
+                        std::memory_order_release);
+        bucket.store(tmp, std::memory_order_release);
+        tmp = next;
+    }
 
-        // Insert elements from other
-        for (unsigned i = 0; i < other._size; ++i)
-        {
-            // Lock access to table elements at i.
-            std::lock_guard<std::mutex> lock(*other._mutexes[i]);
+    t->buckets[i].store(moved(), std::memory_order_release);
+}
 
-            if (other._table[i] == nullptr)
-                continue;
+//
+// Makes nt the current table once all buckets of t were moved, and retires t.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::finishResize(Table *t, Table *nt)
+{
+    std::lock_guard<std::mutex> lock(_resizeMutex);
 
-            Element *tmp = other._table[i];
+    _table.store(nt, std::memory_order_release);
+    _retiredTables.push_back({t, _reclaimer.epoch()});
+    _reclaimer.tryAdvance();
 
-            while (tmp != nullptr)
-            {
-                insert(tmp->key, tmp->value);
-                tmp = tmp->next;
-            }
-        }
+    size_t n = 0;
+    while (n < _retiredTables.size() &&
+           _reclaimer.isSafe(_retiredTables[n].epoch))
+    {
+        delete _retiredTables[n].table;
+        ++n;
     }
-    return *this;
+    _retiredTables.erase(_retiredTables.begin(), _retiredTables.begin() + n);
 }
 
 //
-// Move assignment operator
+// Moves one bucket to the next table, if the map is being resized. Returns
+// false if there was nothing left to move. Besides insert() and remove(), it
+// can also be called by helper threads.
 //
-template <class K, class V, class F>
-HashMap<K, V, F>& HashMap<K, V, F>::operator=(HashMap &&other)
+template <class K, class V, class F, template <class> class A>
+bool HashMap<K, V, F, A>::helpResize()
 {
-    if (this != &other)
-    {
-        destroyTableAndMutexes();
+    EpochReclaimer::Guard guard(_reclaimer);
+    Table *t = _table.load(std::memory_order_acquire);
+    Table *nt = t->next.load(std::memory_order_acquire);
+
+    if (nt == nullptr)
+        return false;
 
-        _table = other._table;
-        _mutexes = other._mutexes;
-        _size = other._size;
+    size_t i = t->moveCursor.fetch_add(1);
+    if (i >= t->size)
+        return false;
 
-        other._table = nullptr;
-        other._mutexes = nullptr;
-        other._size = 0;
+    {
+        // Lock access to table elements at i.
+        std::lock_guard<Stripe> lock(stripeFor(i));
+        moveBucket(t, nt, i);
     }
+
+    if (t->moved.fetch_add(1) + 1 == t->size)
+        finishResize(t, nt);
+
+    return true;
 }
 
-template <class K, class V, class F>
-HashMap<K, V, F>::~HashMap()
+//
+// Helps moving the buckets until the resize in progress, if any, is done.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::completeResize()
 {
-    destroyTableAndMutexes();
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    while (_table.load(std::memory_order_acquire)->next.load() != nullptr)
+        if (!helpResize())
+            std::this_thread::yield();
 }
 
 //
-// Checks if key exists.
+// Resizes the table to newSize buckets, rounded up to a power of two. Other
+// operations can run while the buckets are being moved.
 //
-template <class K, class V, class F>
-bool HashMap<K, V, F>::exists(K key)
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::resize(size_t newSize)
 {
-    unsigned i = hash(key);
-    // Lock access to table elements at i.
-    std::lock_guard<std::mutex> lock(*_mutexes[i]);
-    Element *tmp = _table[i];
+    EpochReclaimer::Guard guard(_reclaimer);
 
-    while (tmp != nullptr && tmp->key != key)
-        tmp = tmp->next;
+    do
+        completeResize();
+    while (!startResize(_table.load(std::memory_order_acquire), newSize));
 
-    return tmp != nullptr;
+    completeResize();
 }
 
 //
-// Returns value for given key. If key doesn't exists throws "out of range"
-// exception.
+// Returns the number of elements, as it was at one moment. The per-stripe
+// counts are summed without locking, and the sum is trusted only if no
+// writer held any of the stripes in the meantime. After a few retries the
+// stripes are all locked, in order, which stops the writers for a moment.
 //
-template <class K, class V, class F>
-V HashMap<K, V, F>::lookup(K key)
+template <class K, class V, class F, template <class> class A>
+size_t HashMap<K, V, F, A>::size()
 {
-    unsigned i = hash(key);
-    // Lock access to table elements at i.
-    std::lock_guard<std::mutex> lock(*_mutexes[i]);
-    Element *tmp = _table[i];
+    std::vector<uint64_t> versions(_stripeCount);
 
-    while (tmp != nullptr && tmp->key != key)
-        tmp = tmp->next;
+    for (unsigned attempt = 0; attempt < READ_RETRIES; ++attempt)
+    {
+        size_t count = 0;
+        size_t s = 0;
 
-    if (tmp == nullptr)
-        throw std::out_of_range("HashMap: key doesn't exists");
+        for (; s < _stripeCount; ++s)
+        {
+            versions[s] = _stripes[s].version.load(std::memory_order_acquire);
+            if (versions[s] & 1)
+                break;
+            count += _stripes[s].count.load(std::memory_order_relaxed);
+        }
+        if (s < _stripeCount)
+            continue;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        for (s = 0; s < _stripeCount; ++s)
+            if (_stripes[s].version.load(std::memory_order_relaxed) !=
+                versions[s])
+                break;
+        if (s == _stripeCount)
+            return count;
+    }
 
-    return tmp->value;
+    // Lock access to the counts of all stripes.
+    size_t count = 0;
+
+    for (size_t s = 0; s < _stripeCount; ++s)
+        _stripes[s].mutex.lock();
+    for (size_t s = 0; s < _stripeCount; ++s)
+        count += _stripes[s].count.load(std::memory_order_relaxed);
+    for (size_t s = _stripeCount; s > 0; --s)
+        _stripes[s - 1].mutex.unlock();
+
+    return count;
 }
 
 //
-// Inserts key-value pair into hashmap.
+// Returns the number of elements by summing the per-stripe counts, without
+// waiting for anything. While other threads insert or remove the result may
+// be off by the number of their changes in flight.
 //
-template <class K, class V, class F>
-void HashMap<K, V, F>::insert(K key, V value)
+template <class K, class V, class F, template <class> class A>
+size_t HashMap<K, V, F, A>::approximateSize()
 {
-    unsigned i = hash(key);
-    // Lock access to table elements at i.
-    std::lock_guard<std::mutex> lock(*_mutexes[i]);
+    size_t count = 0;
 
-    if (_table[i] == nullptr)
-    {
-        _table[i] = new Element(key, value);
-    }
-    else
-    {
-        Element *tmp = _table[i];
+    for (size_t s = 0; s < _stripeCount; ++s)
+        count += _stripes[s].count.load(std::memory_order_relaxed);
 
-        // Traverse the list and check if a key already exists.
+    return count;
+}
 
-        while (tmp->next != nullptr && tmp->key != key)
-            tmp = tmp->next;
+//
+// Calls fn(key, value) for every element, from threads threads.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void HashMap<K, V, F, A>::parallelForEach(Fn fn, unsigned threads)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
 
-        // If key exists, change the value, otherwise add new element to end of
-        // list.
+    forEachStripeParallel([&](size_t s) {
+        // Lock access to table elements in the stripe.
+        std::lock_guard<std::mutex> lock(_stripes[s].mutex);
 
-        if (tmp->key == key)
-            tmp->value = value;
-        else
-            tmp->next = new Element(key, value);
-    }
+        forEachInStripe(s, [&](Element *e) { fn(e->key, e->value); });
+    }, threads, approximateSize());
 }
 
 //
-// Removes key and corresponding value from hashmap. If key doesn't exists
-// it throws "out of range" exception.
+// Returns combine() of fn(key, value) for all elements. Every thread combines
+// the results for its stripes, starting from identity, and then the results
+// of the threads are combined, so identity must not change what it is
+// combined with.
 //
-template <class K, class V, class F>
-void HashMap<K, V, F>::remove(K key)
+template <class K, class V, class F, template <class> class A>
+template <class T, class Fn, class Combine>
+T HashMap<K, V, F, A>::parallelReduce(T identity, Fn fn, Combine combine,
+                                      unsigned threads)
 {
-    unsigned i = hash(key);
-    // Lock access to table elements at i.
-    std::lock_guard<std::mutex> lock(*_mutexes[i]);
-    Element *tmp = _table[i];
-    Element *prev = nullptr;
+    EpochReclaimer::Guard guard(_reclaimer);
+    std::vector<T> partial;
+    std::mutex partialMutex;
 
-    while (tmp != nullptr && tmp->key != key)
-    {
-        prev = tmp;
-        tmp = tmp->next;
-    }
+    forEachStripeParallel([&](size_t s) {
+        T result = identity;
 
-    if (tmp == nullptr)
-        throw std::out_of_range("HashMap: key doesn't exists");
+        {
+            // Lock access to table elements in the stripe.
+            std::lock_guard<std::mutex> lock(_stripes[s].mutex);
 
-    if (prev == nullptr)
-        _table[i] = tmp->next;
-    else
-        prev->next = tmp->next;
+            forEachInStripe(s, [&](Element *e) {
+                result = combine(result, fn(e->key, e->value));
+            });
+        }
+
+        std::lock_guard<std::mutex> lock(partialMutex);
+        partial.push_back(result);
+    }, threads, approximateSize());
 
-    delete tmp;
+    T result = identity;
+    for (T &p : partial)
+        result = combine(result, p);
+    return result;
 }
 
-template <class K, class V, class F>
-void HashMap<K, V, F>::resize(size_t newSize)
+//
+// Removes all elements, from threads threads. Readers may still be walking
+// the lists, so the elements are retired rather than freed. They are added to
+// the retired ones all at once, and freed right away if no reader can see
+// them any more, otherwise by later writers to the stripe.
+//
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::clear(unsigned threads)
 {
-    Element **newTable = new Element *[newSize];
+    size_t elements = approximateSize();
 
-    // Populate the new table.
-    for (unsigned i = 0; i < _size; ++i)
     {
-        // Lock access to table elements at i.
-        std::lock_guard<std::mutex> lock(*_mutexes[i]);
-
-        if (_table[i] == nullptr)
-            continue;
+        EpochReclaimer::Guard guard(_reclaimer);
 
-        Element *tmp = _table[i];
+        forEachStripeParallel([&](size_t s) {
+            Stripe &stripe = _stripes[s];
 
-        while (tmp != nullptr)
-        {
-            Element *old = tmp;
+            // Lock access to table elements in the stripe.
+            std::lock_guard<Stripe> lock(stripe);
 
-            unsigned newIdx = hashFunctor(tmp->key) % newSize;
-            if (newTable[newIdx] == nullptr)
+            for (Table *t = _table.load(); t != nullptr; t = t->next.load())
             {
-                newTable[newIdx] = new Element(tmp->key, tmp->value);
+                for (size_t i = s; i < t->size; i += _stripeCount)
+                {
+                    Element *tmp =
+                        t->buckets[i].load(std::memory_order_relaxed);
+                    if (tmp == moved())
+                        continue;
+
+                    t->buckets[i].store(nullptr, std::memory_order_release);
+                    for (; tmp != nullptr; tmp = tmp->next.load())
+                        stripe.retired.push_back({tmp, _reclaimer.epoch()});
+                }
             }
-            else
-            {
-                Element *p = newTable[newIdx];
 
-                // Traverse the list and check if a key already exists.
+            stripe.count.store(0, std::memory_order_relaxed);
+        }, threads, elements);
+    }
 
-                while (p->next != nullptr && p->key != tmp->key)
-                    p = p->next;
+    // The elements are safe once two epochs have passed, which they do right
+    // away if there are no readers.
+    _reclaimer.tryAdvance();
+    _reclaimer.tryAdvance();
 
-                // If key exists, change the value, otherwise add new element to
-                // end of list.
+    forEachStripeParallel([&](size_t s) {
+        // Lock access to the retired elements of the stripe.
+        std::lock_guard<Stripe> lock(_stripes[s]);
+        reclaim(_stripes[s]);
+    }, threads, elements);
+}
 
-                if (p->key == tmp->key)
-                    p->value = tmp->value;
-                else
-                    p->next = new Element(tmp->key, tmp->value);
-            }
+//
+// Collects statistics of the map. Stripes are locked one at a time, so the
+// result is consistent within each stripe, but not across stripes while other
+// threads insert or remove. During a resize, buckets of both tables count.
+//
+template <class K, class V, class F, template <class> class A>
+typename HashMap<K, V, F, A>::Stats HashMap<K, V, F, A>::stats()
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    Stats st;
+
+    st.count = 0;
+    st.size = getSize();
+    st.longestChain = 0;
+
+    for (size_t s = 0; s < _stripeCount; ++s)
+    {
+        // Lock access to table elements in the stripe, without counting it.
+        std::lock_guard<std::mutex> lock(_stripes[s].mutex);
+
+        for (Table *t = _table.load(); t != nullptr; t = t->next.load())
+        {
+            for (size_t i = s; i < t->size; i += _stripeCount)
+            {
+                Element *tmp = t->buckets[i].load(std::memory_order_acquire);
+                size_t n = 0;
+
+                if (tmp == moved())
+                    continue;
 
-            tmp = tmp->next;
-            delete old;
+                for (; tmp != nullptr; tmp = tmp->next.load())
+                    ++n;
+
+                if (n >= st.chainLengths.size())
+                    st.chainLengths.resize(n + 1);
+                ++st.chainLengths[n];
+                st.count += n;
+                st.longestChain = std::max(st.longestChain, n);
+            }
         }
 
-        delete _mutexes[i];
-    }
+#ifdef HASHMAP_LOCK_STATS
+        Stripe &stripe = _stripes[s];
 
-    // Finally deallocate old table and mutexes.
-    delete [] _table;
-    delete [] _mutexes;
+        st.lockAcquisitions.push_back(stripe.acquisitions.load());
+        st.lockContentions.push_back(stripe.contentions.load());
+        st.lockWaitNanos.push_back(stripe.waitNanos.load());
+#endif
+    }
 
-    _size = newSize;
-    _table = newTable;
-    //mutexes = (std::mutex **) malloc(newSize * sizeof(std::mutex *));
-    _mutexes = new std::mutex *[newSize];
+    st.loadFactor = st.size == 0 ? 0.0f : (float)st.count / st.size;
+    return st;
 }
 
 //
 // Prints out hashmap.
 //
-template <class K, class V, class F>
-void HashMap<K, V, F>::print()
+template <class K, class V, class F, template <class> class A>
+void HashMap<K, V, F, A>::print()
 {
-    for (unsigned i = 0; i < _size; ++i)
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    for (Table *t = _table.load(); t != nullptr; t = t->next.load())
     {
-        // Lock access to table elements at i.
-        std::lock_guard<std::mutex> lock(*_mutexes[i]);
+        for (size_t i = 0; i < t->size; ++i)
+        {
+            // Lock access to table elements at i.
+            std::lock_guard<std::mutex> lock(stripeFor(i).mutex);
 
-        if (_table[i] == nullptr)
-            continue;
+            Element *tmp = t->buckets[i].load(std::memory_order_acquire);
 
-        Element *tmp = _table[i];
+            if (tmp == nullptr || tmp == moved())
+                continue;
 
-        std::cout << "[" << i << "] -> ";
-        while (tmp != nullptr)
-        {
-            std::cout << "(" << tmp->key << ", "
-                      << tmp->value << "), ";
-            tmp = tmp->next;
+            std::cout << "[" << i << "] -> ";
+            while (tmp != nullptr)
+            {
+                std::cout << "(" << tmp->key << ", "
+                          << tmp->value << "), ";
+                tmp = tmp->next;
+            }
+            std::cout << "" << std::endl;
         }
-        std::cout << "" << std::endl;
     }
 }
 
@@ -0,0 +1,613 @@
+// The MIT License (MIT)
+//
+// Thread-safe hashmap for small trivially copyable keys and values
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef INLINEHASHMAP_H
+#define INLINEHASHMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "hashmap.h"
+
+//
+// Tells if keys of type K and values of type V can be kept inline by
+// InlineHashMap: both must be trivially copyable and 1, 2, 4 or 8 bytes long,
+// and equal keys must have equal bytes.
+//
+template <class T>
+struct IsInlineWord
+    : std::integral_constant<bool, std::is_trivially_copyable<T>::value &&
+                                       (sizeof(T) == 1 || sizeof(T) == 2 ||
+                                        sizeof(T) == 4 || sizeof(T) == 8)>
+{
+};
+
+template <class K, class V>
+struct IsInlineable
+    : std::integral_constant<bool,
+                             IsInlineWord<K>::value && IsInlineWord<V>::value &&
+                                 std::has_unique_object_representations<
+                                     K>::value>
+{
+};
+
+//
+// InlineHashMap keeps keys and values inline in buckets of one cache line
+// each, so there is no allocation per element, and keys are compared as
+// integers. A bucket holds as many pairs as fit next to its control word: 3
+// for 8 byte keys and values, 7 for 4 byte ones. A key is in its home bucket,
+// or in one of the following buckets if the home bucket was full; every
+// bucket counts the keys which had to be placed past it, so a lookup stops at
+// the first bucket whose count is zero.
+//
+// Like in HashMap, readers don't lock. The map is split into shards, each one
+// an independent table with a mutex and a version counter, which is odd while
+// a writer holds the shard. Readers read the slots as relaxed atomics and
+// retry if the version changed; after a few retries they lock the shard. Grown
+// tables are retired and freed by the epoch reclaimer.
+//
+// Only keys and values for which IsInlineable holds are supported. AutoHashMap
+// picks InlineHashMap for those, and HashMap otherwise.
+//
+template <class K, class V, class F = DefaultHash<K>>
+class InlineHashMap
+{
+    static_assert(IsInlineable<K, V>::value,
+                  "InlineHashMap: keys and values must be small and "
+                  "trivially copyable");
+
+    // Unsigned integer type of N bytes
+    template <size_t N>
+    struct Word
+    {
+        typedef typename std::conditional<
+            N == 1, uint8_t,
+            typename std::conditional<
+                N == 2, uint16_t,
+                typename std::conditional<N == 4, uint32_t,
+                                          uint64_t>::type>::type>::type Type;
+    };
+
+    typedef typename Word<sizeof(K)>::Type KeyWord;
+    typedef typename Word<sizeof(V)>::Type ValueWord;
+
+    static constexpr size_t CACHE_LINE = 64;
+
+    // Offset of the key array, which follows the 32-bit control word.
+    static constexpr size_t KEYS_OFFSET =
+        sizeof(KeyWord) > 4 ? sizeof(KeyWord) : 4;
+
+    static constexpr size_t slotsFitting()
+    {
+        size_t n = 0;
+
+        while (n < 16)
+        {
+            size_t keysEnd = KEYS_OFFSET + (n + 1) * sizeof(KeyWord);
+            size_t valuesOffset = (keysEnd + sizeof(ValueWord) - 1) /
+                                  sizeof(ValueWord) * sizeof(ValueWord);
+            if (valuesOffset + (n + 1) * sizeof(ValueWord) > CACHE_LINE)
+                break;
+            ++n;
+        }
+        return n;
+    }
+
+public:
+    // Number of key-value pairs in a bucket
+    static constexpr unsigned SLOTS = slotsFitting();
+
+private:
+    // The low 16 bits of the control word mark the used slots, the high 16
+    // bits count the keys placed past the bucket. The count sticks once it
+    // reaches its maximum.
+    static constexpr uint32_t USED_MASK = 0xffff;
+    static constexpr uint32_t OVERFLOW_ONE = 0x10000;
+    static constexpr uint32_t OVERFLOW_MAX = 0xffff0000;
+
+    struct alignas(CACHE_LINE) Bucket
+    {
+        std::atomic<uint32_t> control;
+        std::atomic<KeyWord> keys[SLOTS];
+        std::atomic<ValueWord> values[SLOTS];
+
+        Bucket() : control(0) {}
+    };
+
+    static_assert(sizeof(Bucket) == CACHE_LINE,
+                  "InlineHashMap: bucket must fill one cache line");
+
+    struct Table
+    {
+        size_t mask;            // Number of buckets - 1
+        size_t limit;           // Number of keys after which it grows
+        Bucket *buckets;
+
+        explicit Table(size_t n)
+            : mask(n - 1), limit(n * SLOTS * MAX_LOAD_NUM / MAX_LOAD_DEN),
+              buckets(new Bucket[n]) {}
+        ~Table() { delete [] buckets; }
+    };
+
+    struct RetiredTable
+    {
+        Table *table;
+        uint64_t epoch;
+    };
+
+    struct alignas(CACHE_LINE) Shard
+    {
+        std::mutex mutex;
+        std::atomic<uint64_t> version;
+        std::atomic<Table *> table;
+        std::atomic<size_t> count;
+        std::vector<RetiredTable> retired;
+
+        Shard() : version(0), table(nullptr), count(0) {}
+
+        // Locks the shard for writing, so Shard can be used with lock_guard.
+        void lock()
+        {
+            mutex.lock();
+            version.store(version.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void unlock()
+        {
+            version.store(version.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_release);
+            mutex.unlock();
+        }
+    };
+
+    // Tables grow once MAX_LOAD_NUM / MAX_LOAD_DEN of their slots are used.
+    static constexpr size_t MAX_LOAD_NUM = 7;
+    static constexpr size_t MAX_LOAD_DEN = 8;
+
+    // Number of optimistic attempts of a read before falling back to locking
+    static constexpr unsigned READ_RETRIES = 8;
+
+    size_t _shardCount;
+    Shard *_shards;
+    EpochReclaimer _reclaimer;
+
+    F hashFunctor;
+
+    uint64_t hash(const K &key)
+    {
+        return mixedHash(hashFunctor, key);
+    }
+
+    // Shards are picked by the high bits, buckets by the low bits.
+    Shard &shardFor(uint64_t h)
+    {
+        return _shards[(h >> 32) & (_shardCount - 1)];
+    }
+
+    template <class T, class W>
+    static W toWord(const T &t)
+    {
+        W w;
+        std::memcpy(&w, &t, sizeof w);
+        return w;
+    }
+
+    template <class T, class W>
+    static T fromWord(W w)
+    {
+        T t;
+        std::memcpy(&t, &w, sizeof t);
+        return t;
+    }
+
+    static bool probe(Table *t, KeyWord k, uint64_t h, size_t &bucket,
+                      unsigned &slot);
+    static void place(Table *t, KeyWord k, ValueWord v, uint64_t h);
+    bool findValue(const K &key, ValueWord &value);
+    void grow(Shard &s);
+
+public:
+    static constexpr size_t DEFAULT_SHARDS = 64;
+
+    //
+    // Creates a map with room for size elements in total, split into
+    // shardCount shards (rounded down to a power of two).
+    //
+    InlineHashMap(size_t size, size_t shardCount = DEFAULT_SHARDS);
+    ~InlineHashMap();
+
+    InlineHashMap(const InlineHashMap &) = delete;
+    InlineHashMap &operator=(const InlineHashMap &) = delete;
+
+    std::optional<V> find(const K &key)
+    {
+        ValueWord v;
+
+        if (!findValue(key, v))
+            return std::nullopt;
+        return fromWord<V>(v);
+    }
+
+    bool exists(const K &key)
+    {
+        ValueWord v;
+        return findValue(key, v);
+    }
+
+    V lookup(const K &key);
+    V operator[](const K &key) { return lookup(key); }
+    void insert(const K &key, const V &value);
+    void remove(const K &key);
+
+    size_t getCount();
+
+    // Number of slots in all tables
+    size_t getSize();
+
+    //
+    // Calls fn(key, value) for every element, locking one shard at a time.
+    // fn must not modify the map.
+    //
+    template <class Fn>
+    void forEach(Fn fn);
+};
+
+//
+// AutoHashMap is InlineHashMap when K and V can be kept inline, and HashMap
+// otherwise. Both have exists(), lookup(), operator[], insert(), remove() and
+// getCount().
+//
+template <class K, class V, class F = DefaultHash<K>>
+using AutoHashMap =
+    typename std::conditional<IsInlineable<K, V>::value, InlineHashMap<K, V, F>,
+                              HashMap<K, V, F>>::type;
+
+//====----------------------------------------------------------------------====
+// Implementation of the InlineHashMap methods
+//====----------------------------------------------------------------------====
+
+template <class K, class V, class F>
+InlineHashMap<K, V, F>::InlineHashMap(size_t size, size_t shardCount)
+{
+    _shardCount = 1;
+    while (_shardCount * 2 <= shardCount)
+        _shardCount *= 2;
+
+    // Enough buckets for the share of size of every shard, at most loaded.
+    size_t perShard = size / _shardCount + 1;
+    size_t buckets = 1;
+    while (buckets * SLOTS * MAX_LOAD_NUM / MAX_LOAD_DEN < perShard)
+        buckets *= 2;
+
+    _shards = new Shard[_shardCount];
+    for (size_t i = 0; i < _shardCount; ++i)
+        _shards[i].table.store(new Table(buckets));
+}
+
+template <class K, class V, class F>
+InlineHashMap<K, V, F>::~InlineHashMap()
+{
+    for (size_t i = 0; i < _shardCount; ++i)
+    {
+        for (RetiredTable &r : _shards[i].retired)
+            delete r.table;
+        delete _shards[i].table.load();
+    }
+    delete [] _shards;
+}
+
+//
+// Looks for key k in table t. If it is there, bucket and slot are set to
+// where it is. The walk is bounded by the table size, so a reader seeing the
+// table in the middle of a change always gets out.
+//
+template <class K, class V, class F>
+bool InlineHashMap<K, V, F>::probe(Table *t, KeyWord k, uint64_t h,
+                                   size_t &bucket, unsigned &slot)
+{
+    size_t i = h & t->mask;
+
+    for (size_t n = 0; n <= t->mask; ++n)
+    {
+        Bucket &b = t->buckets[i];
+        uint32_t control = b.control.load(std::memory_order_relaxed);
+
+        for (uint32_t used = control & USED_MASK; used != 0; used &= used - 1)
+        {
+            unsigned j = __builtin_ctz(used);
+
+            if (b.keys[j].load(std::memory_order_relaxed) == k)
+            {
+                bucket = i;
+                slot = j;
+                return true;
+            }
+        }
+
+        if ((control & ~USED_MASK) == 0)
+            break;
+        i = (i + 1) & t->mask;
+    }
+
+    return false;
+}
+
+//
+// Puts key k, which isn't in t yet, into the first bucket with a free slot,
+// counting it in the overflow counts of the full buckets before. There must
+// be a free slot.
+//
+template <class K, class V, class F>
+void InlineHashMap<K, V, F>::place(Table *t, KeyWord k, ValueWord v,
+                                   uint64_t h)
+{
+    const uint32_t full = (1u << SLOTS) - 1;
+    size_t i = h & t->mask;
+
+    for (;;)
+    {
+        Bucket &b = t->buckets[i];
+        uint32_t control = b.control.load(std::memory_order_relaxed);
+
+        if ((control & full) != full)
+        {
+            unsigned j = __builtin_ctz(~control & full);
+
+            b.keys[j].store(k, std::memory_order_relaxed);
+            b.values[j].store(v, std::memory_order_relaxed);
+            b.control.store(control | (1u << j), std::memory_order_relaxed);
+            return;
+        }
+
+        if ((control & ~USED_MASK) != OVERFLOW_MAX)
+            b.control.store(control + OVERFLOW_ONE,
+                            std::memory_order_relaxed);
+        i = (i + 1) & t->mask;
+    }
+}
+
+//
+// Finds the value of key. The table is first probed without locking, and the
+// result is trusted only if no writer held the shard in the meantime.
+//
+template <class K, class V, class F>
+bool InlineHashMap<K, V, F>::findValue(const K &key, ValueWord &value)
+{
+    uint64_t h = hash(key);
+    KeyWord k = toWord<K, KeyWord>(key);
+    Shard &s = shardFor(h);
+    size_t bucket;
+    unsigned slot;
+
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    for (unsigned attempt = 0; attempt < READ_RETRIES; ++attempt)
+    {
+        uint64_t version = s.version.load(std::memory_order_acquire);
+        if (version & 1)
+            continue;
+
+        Table *t = s.table.load(std::memory_order_acquire);
+        bool found = probe(t, k, h, bucket, slot);
+        if (found)
+            value = t->buckets[bucket].values[slot].load(
+                std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.version.load(std::memory_order_relaxed) == version)
+            return found;
+    }
+
+    // Lock access to the table of the shard.
+    std::lock_guard<std::mutex> lock(s.mutex);
+    Table *t = s.table.load(std::memory_order_relaxed);
+
+    if (!probe(t, k, h, bucket, slot))
+        return false;
+    value = t->buckets[bucket].values[slot].load(std::memory_order_relaxed);
+    return true;
+}
+
+//
+// Returns value of the key. If key doesn't exists it throws "out of range"
+// exception.
+//
+template <class K, class V, class F>
+V InlineHashMap<K, V, F>::lookup(const K &key)
+{
+    ValueWord v;
+
+    if (!findValue(key, v))
+        throw std::out_of_range("InlineHashMap: key doesn't exists");
+    return fromWord<V>(v);
+}
+
+//
+// Moves the elements of the locked shard into a table twice the size. The old
+// table is retired, and the tables retired long enough ago are freed.
+//
+template <class K, class V, class F>
+void InlineHashMap<K, V, F>::grow(Shard &s)
+{
+    Table *old = s.table.load(std::memory_order_relaxed);
+    Table *t = new Table((old->mask + 1) * 2);
+
+    for (size_t i = 0; i <= old->mask; ++i)
+    {
+        Bucket &b = old->buckets[i];
+        uint32_t used = b.control.load(std::memory_order_relaxed) & USED_MASK;
+
+        for (; used != 0; used &= used - 1)
+        {
+            unsigned j = __builtin_ctz(used);
+            KeyWord k = b.keys[j].load(std::memory_order_relaxed);
+
+            place(t, k, b.values[j].load(std::memory_order_relaxed),
+                  hash(fromWord<K>(k)));
+        }
+    }
+
+    s.table.store(t, std::memory_order_release);
+    s.retired.push_back({old, _reclaimer.epoch()});
+
+    _reclaimer.tryAdvance();
+    size_t n = 0;
+    while (n < s.retired.size() && _reclaimer.isSafe(s.retired[n].epoch))
+        delete s.retired[n++].table;
+    s.retired.erase(s.retired.begin(), s.retired.begin() + n);
+}
+
+//
+// Inserts key with value, replacing the value of an existing key.
+//
+template <class K, class V, class F>
+void InlineHashMap<K, V, F>::insert(const K &key, const V &value)
+{
+    uint64_t h = hash(key);
+    KeyWord k = toWord<K, KeyWord>(key);
+    ValueWord v = toWord<V, ValueWord>(value);
+    Shard &s = shardFor(h);
+    size_t bucket;
+    unsigned slot;
+
+    // Lock access to the table of the shard.
+    std::lock_guard<Shard> lock(s);
+    Table *t = s.table.load(std::memory_order_relaxed);
+
+    if (probe(t, k, h, bucket, slot))
+    {
+        t->buckets[bucket].values[slot].store(v, std::memory_order_relaxed);
+        return;
+    }
+
+    if (s.count.load(std::memory_order_relaxed) + 1 > t->limit)
+    {
+        grow(s);
+        t = s.table.load(std::memory_order_relaxed);
+    }
+
+    place(t, k, v, h);
+    s.count.store(s.count.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
+//
+// Removes key, and takes it out of the overflow counts of the buckets between
+// its home bucket and the one it was in. If key doesn't exists it throws "out
+// of range" exception.
+//
+template <class K, class V, class F>
+void InlineHashMap<K, V, F>::remove(const K &key)
+{
+    uint64_t h = hash(key);
+    KeyWord k = toWord<K, KeyWord>(key);
+    Shard &s = shardFor(h);
+    size_t bucket;
+    unsigned slot;
+
+    // Lock access to the table of the shard.
+    std::lock_guard<Shard> lock(s);
+    Table *t = s.table.load(std::memory_order_relaxed);
+
+    if (!probe(t, k, h, bucket, slot))
+        throw std::out_of_range("InlineHashMap: key doesn't exists");
+
+    Bucket &b = t->buckets[bucket];
+    b.control.store(b.control.load(std::memory_order_relaxed) & ~(1u << slot),
+                    std::memory_order_relaxed);
+
+    for (size_t i = h & t->mask; i != bucket; i = (i + 1) & t->mask)
+    {
+        uint32_t control =
+            t->buckets[i].control.load(std::memory_order_relaxed);
+
+        if ((control & ~USED_MASK) != OVERFLOW_MAX)
+            t->buckets[i].control.store(control - OVERFLOW_ONE,
+                                        std::memory_order_relaxed);
+    }
+
+    s.count.store(s.count.load(std::memory_order_relaxed) - 1,
+                  std::memory_order_relaxed);
+}
+
+template <class K, class V, class F>
+size_t InlineHashMap<K, V, F>::getCount()
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < _shardCount; ++i)
+        count += _shards[i].count.load(std::memory_order_relaxed);
+    return count;
+}
+
+template <class K, class V, class F>
+size_t InlineHashMap<K, V, F>::getSize()
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i < _shardCount; ++i)
+    {
+        // Lock access to the table of the shard.
+        std::lock_guard<std::mutex> lock(_shards[i].mutex);
+        size += (_shards[i].table.load()->mask + 1) * SLOTS;
+    }
+    return size;
+}
+
+template <class K, class V, class F>
+template <class Fn>
+void InlineHashMap<K, V, F>::forEach(Fn fn)
+{
+    for (size_t s = 0; s < _shardCount; ++s)
+    {
+        // Lock access to the table of the shard.
+        std::lock_guard<std::mutex> lock(_shards[s].mutex);
+        Table *t = _shards[s].table.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i <= t->mask; ++i)
+        {
+            Bucket &b = t->buckets[i];
+            uint32_t used =
+                b.control.load(std::memory_order_relaxed) & USED_MASK;
+
+            for (; used != 0; used &= used - 1)
+            {
+                unsigned j = __builtin_ctz(used);
+
+                fn(fromWord<K>(b.keys[j].load(std::memory_order_relaxed)),
+                   fromWord<V>(b.values[j].load(std::memory_order_relaxed)));
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,744 @@
+// The MIT License (MIT)
+//
+// Lock-free generic hashmap
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef LOCKFREEHASHMAP_H
+#define LOCKFREEHASHMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+
+#include "hashmap.h"
+
+//
+// LockFreeHashMap has the same interface as HashMap, but doesn't use any locks.
+// It is a split-ordered list (Shalev and Shavit): all elements are kept in one
+// lock-free sorted linked list (Harris and Michael), ordered by bit reversed
+// hash codes. A bucket is a pointer to a dummy node in that list, so doubling
+// the number of buckets never moves an element, new buckets are just split off
+// their parents the first time they are used.
+//
+// A thread preempted in the middle of an operation never blocks the others.
+// Unlinked elements are freed through the epoch reclaimer.
+//
+template <class K, class V, class F = DefaultHash<K>>
+class LockFreeHashMap
+{
+    //
+    // Node of the list. Dummy nodes have an even and elements an odd split
+    // order key. The lowest bit of next marks the node as logically removed.
+    //
+    struct Node
+    {
+        uint64_t soKey;
+        std::atomic<Node *> next;
+
+        // Link and epoch in the list of retired nodes
+        Node *retiredNext = nullptr;
+        uint64_t retiredEpoch = 0;
+
+        explicit Node(uint64_t so) : soKey(so), next(nullptr) {}
+    };
+
+public:
+    struct Element : Node
+    {
+        K key;
+        V value;
+
+        Element(uint64_t so, K k, V v) : Node(so), key(k), value(v) {}
+    };
+
+private:
+    static constexpr unsigned SEGMENTS = 64;
+    static constexpr size_t MAX_SIZE = size_t(1) << 62;
+
+    // Average number of elements per bucket after which buckets are doubled
+    static constexpr size_t LOAD_FACTOR = 2;
+
+    // Number of retired nodes after which we try to free them
+    static constexpr size_t RECLAIM_THRESHOLD = 256;
+
+    //
+    // Buckets are kept in segments, segment s > 0 holding the 2^(s-1) buckets
+    // starting at bucket 2^(s-1), and segment 0 holding bucket 0. Segments are
+    // allocated when first used, and never move.
+    //
+    std::atomic<std::atomic<Node *> *> _segments[SEGMENTS];
+
+    // Number of buckets, always a power of two
+    std::atomic<size_t> _size;
+
+    // Number of elements
+    std::atomic<size_t> _count;
+
+    // Dummy node of bucket 0, the head of the list
+    Node *_head;
+
+    // Stack of unlinked nodes waiting for readers to leave
+    std::atomic<Node *> _retired;
+    std::atomic<size_t> _retiredCount;
+
+    EpochReclaimer _reclaimer;
+
+    //
+    // Hash function is actually a class used as functor. Its result is mixed
+    // with a 64-bit finalizer, so the weak functors still spread well.
+    //
+    F hashFunctor;
+
+    uint64_t hash(const K &key)
+    {
+        return mixedHash(hashFunctor, key);
+    }
+
+    static uint64_t reverse(uint64_t x)
+    {
+        const uint64_t m1 = 0x5555555555555555ULL;
+        const uint64_t m2 = 0x3333333333333333ULL;
+        const uint64_t m4 = 0x0f0f0f0f0f0f0f0fULL;
+
+        x = ((x >> 1) & m1) | ((x & m1) << 1);
+        x = ((x >> 2) & m2) | ((x & m2) << 2);
+        x = ((x >> 4) & m4) | ((x & m4) << 4);
+        return __builtin_bswap64(x);
+    }
+
+    static uint64_t regularKey(uint64_t h) { return reverse(h | 1ULL << 63); }
+    static uint64_t dummyKey(size_t bucket) { return reverse(bucket); }
+
+    static bool isMarked(Node *p)
+    {
+        return reinterpret_cast<uintptr_t>(p) & 1;
+    }
+
+    static Node *mark(Node *p)
+    {
+        return reinterpret_cast<Node *>(reinterpret_cast<uintptr_t>(p) | 1);
+    }
+
+    static Node *unmark(Node *p)
+    {
+        return reinterpret_cast<Node *>(reinterpret_cast<uintptr_t>(p) & ~1);
+    }
+
+    static void deleteNode(Node *n)
+    {
+        if (n->soKey & 1)
+            delete static_cast<Element *>(n);
+        else
+            delete n;
+    }
+
+    std::atomic<Node *> &bucketSlot(size_t bucket);
+    Node *getBucket(size_t bucket);
+    Node *initializeBucket(size_t bucket);
+    bool search(Node *start, uint64_t so, const K *key, Node *&pred,
+                Node *&curr);
+    Element *find(const K &key);
+    void retire(Node *n);
+    void init();
+    void destroy();
+
+public:
+    ~LockFreeHashMap();
+    bool exists(K key);
+    V lookup(K key);
+    void insert(K key, V value);
+    void remove(K key);
+    void resize(size_t newSize);
+    void print();
+    size_t getSize() { return _size.load(); }
+    size_t getCount() { return _count.load(); }
+
+    LockFreeHashMap() : LockFreeHashMap(2) {}
+    LockFreeHashMap(size_t size);
+    LockFreeHashMap(LockFreeHashMap &other);            // Copy constructor
+    LockFreeHashMap(LockFreeHashMap &&other);           // Move constructor
+
+    LockFreeHashMap& operator=(LockFreeHashMap &other);  // Copy assignment
+    LockFreeHashMap& operator=(LockFreeHashMap &&other); // Move assignment
+
+    V operator[](K key) { return lookup(key); }
+
+    //
+    // Iterator class. Iterators are weakly consistent: they can be used while
+    // other threads insert and remove, and see every element which is in the
+    // map during the whole iteration. An iterator keeps its elements from being
+    // freed until it is destroyed.
+    //
+    class Iterator
+    {
+        EpochReclaimer::Guard _guard;
+        Node *_current;
+
+        // Advances to the first element at or after n which isn't removed.
+        void skip(Node *n)
+        {
+            while (n != nullptr &&
+                   ((n->soKey & 1) == 0 || isMarked(n->next.load())))
+                n = unmark(n->next.load());
+            _current = n;
+        }
+
+    public:
+        Iterator(LockFreeHashMap<K, V, F> *map, Node *start)
+            : _guard(map->_reclaimer), _current(nullptr)
+        {
+            skip(start);
+        }
+
+        // Prefix increment operator
+        Iterator & operator++()
+        {
+            if (_current != nullptr)
+                skip(unmark(_current->next.load()));
+            return *this;
+        }
+
+        // Postfix increment operator
+        Iterator operator++(int)
+        {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        Element * operator*()
+        {
+            return static_cast<Element *>(_current);
+        }
+
+        bool operator==(const Iterator &other)
+        {
+            return other._current == _current;
+        }
+
+        bool operator!=(const Iterator &other)
+        {
+            return other._current != _current;
+        }
+    };
+
+    Iterator begin() { return Iterator(this, _head); }
+    Iterator end() { return Iterator(this, nullptr); }
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the LockFreeHashMap methods
+//====----------------------------------------------------------------------====
+
+//
+// Allocates the head of the list, which is also the dummy node of bucket 0.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::init()
+{
+    for (unsigned s = 0; s < SEGMENTS; ++s)
+        _segments[s].store(nullptr, std::memory_order_relaxed);
+
+    _count.store(0);
+    _retired.store(nullptr);
+    _retiredCount.store(0);
+    _head = new Node(dummyKey(0));
+    bucketSlot(0).store(_head, std::memory_order_release);
+}
+
+//
+// Deallocates all nodes and segments. There can be no other threads using the
+// map at this point.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::destroy()
+{
+    if (_head == nullptr)
+        return;
+
+    Node *n = _head;
+    while (n != nullptr)
+    {
+        Node *next = unmark(n->next.load());
+        deleteNode(n);
+        n = next;
+    }
+
+    n = _retired.exchange(nullptr);
+    while (n != nullptr)
+    {
+        Node *next = n->retiredNext;
+        deleteNode(n);
+        n = next;
+    }
+
+    for (unsigned s = 0; s < SEGMENTS; ++s)
+        delete [] _segments[s].exchange(nullptr);
+
+    _head = nullptr;
+    _count.store(0);
+}
+
+template <class K, class V, class F>
+LockFreeHashMap<K, V, F>::LockFreeHashMap(size_t size)
+{
+    size_t n = 1;
+    while (n < size && n < MAX_SIZE)
+        n <<= 1;
+    _size.store(n);
+    init();
+}
+
+//
+// Copy constructor
+//
+template <class K, class V, class F>
+LockFreeHashMap<K, V, F>::LockFreeHashMap(LockFreeHashMap &other)
+    : LockFreeHashMap(other.getSize())
+{
+    for (Iterator it = other.begin(); it != other.end(); ++it)
+        insert((*it)->key, (*it)->value);
+}
+
+//
+// Move constructor
+//
+template <class K, class V, class F>
+LockFreeHashMap<K, V, F>::LockFreeHashMap(LockFreeHashMap &&other)
+    : hashFunctor(std::move(other.hashFunctor))
+{
+    for (unsigned s = 0; s < SEGMENTS; ++s)
+        _segments[s].store(other._segments[s].exchange(nullptr));
+
+    _size.store(other._size.load());
+    _count.store(other._count.exchange(0));
+    _head = other._head;
+    _retired.store(other._retired.exchange(nullptr));
+    _retiredCount.store(other._retiredCount.exchange(0));
+    _reclaimer.catchUp(other._reclaimer.epoch());
+
+    // Leave other as an empty, but usable map.
+    other.init();
+}
+
+//
+// Copy assignment operator
+//
+template <class K, class V, class F>
+LockFreeHashMap<K, V, F>&
+LockFreeHashMap<K, V, F>::operator=(LockFreeHashMap &other)
+{
+    if (this != &other)
+    {
+        destroy();
+        _size.store(other.getSize());
+        init();
+
+        for (Iterator it = other.begin(); it != other.end(); ++it)
+            insert((*it)->key, (*it)->value);
+    }
+    return *this;
+}
+
+//
+// Move assignment operator
+//
+template <class K, class V, class F>
+LockFreeHashMap<K, V, F>&
+LockFreeHashMap<K, V, F>::operator=(LockFreeHashMap &&other)
+{
+    if (this != &other)
+    {
+        destroy();
+
+        hashFunctor = std::move(other.hashFunctor);
+        for (unsigned s = 0; s < SEGMENTS; ++s)
+            _segments[s].store(other._segments[s].exchange(nullptr));
+
+        _size.store(other._size.load());
+        _count.store(other._count.exchange(0));
+        _head = other._head;
+        _retired.store(other._retired.exchange(nullptr));
+        _retiredCount.store(other._retiredCount.exchange(0));
+        _reclaimer.catchUp(other._reclaimer.epoch());
+
+        other.init();
+    }
+    return *this;
+}
+
+template <class K, class V, class F>
+LockFreeHashMap<K, V, F>::~LockFreeHashMap()
+{
+    destroy();
+}
+
+//
+// Returns the slot of the bucket, allocating its segment if needed. Threads
+// racing to allocate the same segment agree on one through compare-exchange.
+//
+template <class K, class V, class F>
+std::atomic<typename LockFreeHashMap<K, V, F>::Node *> &
+LockFreeHashMap<K, V, F>::bucketSlot(size_t bucket)
+{
+    unsigned s = bucket == 0 ? 0 : 64 - __builtin_clzll(bucket);
+    size_t first = s == 0 ? 0 : size_t(1) << (s - 1);
+    size_t segmentSize = s == 0 ? 1 : size_t(1) << (s - 1);
+
+    std::atomic<Node *> *segment = _segments[s].load(std::memory_order_acquire);
+
+    if (segment == nullptr)
+    {
+        std::atomic<Node *> *fresh = new std::atomic<Node *>[segmentSize];
+        for (size_t i = 0; i < segmentSize; ++i)
+            fresh[i].store(nullptr, std::memory_order_relaxed);
+
+        if (_segments[s].compare_exchange_strong(segment, fresh))
+            segment = fresh;
+        else
+            delete [] fresh;
+    }
+
+    return segment[bucket - first];
+}
+
+//
+// Returns the dummy node of the bucket, initializing the bucket if needed.
+//
+template <class K, class V, class F>
+typename LockFreeHashMap<K, V, F>::Node *
+LockFreeHashMap<K, V, F>::getBucket(size_t bucket)
+{
+    Node *dummy = bucketSlot(bucket).load(std::memory_order_acquire);
+    if (dummy != nullptr)
+        return dummy;
+    return initializeBucket(bucket);
+}
+
+//
+// Splits a bucket off its parent (the bucket index without its highest bit)
+// by linking its dummy node into the list. If another thread did it first, its
+// dummy node is used.
+//
+template <class K, class V, class F>
+typename LockFreeHashMap<K, V, F>::Node *
+LockFreeHashMap<K, V, F>::initializeBucket(size_t bucket)
+{
+    size_t parent = bucket & ~(size_t(1) << (63 - __builtin_clzll(bucket)));
+    Node *start = getBucket(parent);
+    Node *dummy = new Node(dummyKey(bucket));
+    Node *pred;
+    Node *curr;
+
+    for (;;)
+    {
+        if (search(start, dummy->soKey, nullptr, pred, curr))
+        {
+            delete dummy;
+            dummy = curr;
+            break;
+        }
+
+        dummy->next.store(curr, std::memory_order_relaxed);
+        if (pred->next.compare_exchange_strong(curr, dummy))
+            break;
+    }
+
+    bucketSlot(bucket).store(dummy, std::memory_order_release);
+    return dummy;
+}
+
+//
+// Searches the list from start for the node with split order key so, and also
+// with the given key if it is an element. Returns true if found, with curr
+// being the node and pred its predecessor. Otherwise curr is the first node
+// with a greater split order key (or nullptr), and a new node goes between
+// pred and curr. Removed nodes are unlinked on the way.
+//
+// The caller must be inside of an epoch guard.
+//
+template <class K, class V, class F>
+bool LockFreeHashMap<K, V, F>::search(Node *start, uint64_t so, const K *key,
+                                      Node *&pred, Node *&curr)
+{
+retry:
+    pred = start;
+    curr = unmark(pred->next.load());
+
+    while (curr != nullptr)
+    {
+        Node *next = curr->next.load();
+
+        if (isMarked(next))
+        {
+            // curr is removed, unlink it or start over if pred changed.
+            Node *expected = curr;
+            if (!pred->next.compare_exchange_strong(expected, unmark(next)))
+                goto retry;
+            retire(curr);
+            curr = unmark(next);
+            continue;
+        }
+
+        if (curr->soKey > so)
+            return false;
+
+        if (curr->soKey == so &&
+            (key == nullptr || static_cast<Element *>(curr)->key == *key))
+            return true;
+
+        pred = curr;
+        curr = next;
+    }
+
+    return false;
+}
+
+//
+// Returns the element with given key, or nullptr if key doesn't exists. Unlike
+// search() it only reads, skipping over the removed nodes. The caller must be
+// inside of an epoch guard.
+//
+template <class K, class V, class F>
+typename LockFreeHashMap<K, V, F>::Element *
+LockFreeHashMap<K, V, F>::find(const K &key)
+{
+    uint64_t h = hash(key);
+    uint64_t so = regularKey(h);
+    Node *curr = getBucket(h & (_size.load() - 1));
+
+    while (curr != nullptr && curr->soKey <= so)
+    {
+        Node *next = curr->next.load();
+
+        if (curr->soKey == so && !isMarked(next) &&
+            static_cast<Element *>(curr)->key == key)
+            return static_cast<Element *>(curr);
+
+        curr = unmark(next);
+    }
+
+    return nullptr;
+}
+
+//
+// Pushes an unlinked node to the retired stack. Once enough nodes are there,
+// takes the whole stack, frees the nodes no reader can see any more, and puts
+// the others back.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::retire(Node *n)
+{
+    n->retiredEpoch = _reclaimer.epoch();
+    n->retiredNext = _retired.load();
+    while (!_retired.compare_exchange_weak(n->retiredNext, n))
+        ;
+
+    if (_retiredCount.fetch_add(1) + 1 < RECLAIM_THRESHOLD)
+        return;
+
+    _retiredCount.store(0);
+    _reclaimer.tryAdvance();
+
+    Node *keep = nullptr;
+    Node *keepTail = nullptr;
+    size_t kept = 0;
+
+    for (Node *r = _retired.exchange(nullptr); r != nullptr; )
+    {
+        Node *next = r->retiredNext;
+
+        if (_reclaimer.isSafe(r->retiredEpoch))
+        {
+            deleteNode(r);
+        }
+        else
+        {
+            r->retiredNext = keep;
+            keep = r;
+            if (keepTail == nullptr)
+                keepTail = r;
+            ++kept;
+        }
+        r = next;
+    }
+
+    if (keep != nullptr)
+    {
+        keepTail->retiredNext = _retired.load();
+        while (!_retired.compare_exchange_weak(keepTail->retiredNext, keep))
+            ;
+        _retiredCount.fetch_add(kept);
+    }
+}
+
+//
+// Checks if key exists.
+//
+template <class K, class V, class F>
+bool LockFreeHashMap<K, V, F>::exists(K key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+
+    return find(key) != nullptr;
+}
+
+//
+// Returns value for given key. If key doesn't exists throws "out of range"
+// exception.
+//
+template <class K, class V, class F>
+V LockFreeHashMap<K, V, F>::lookup(K key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    Element *e = find(key);
+
+    if (e == nullptr)
+        throw std::out_of_range("LockFreeHashMap: key doesn't exists");
+
+    return e->value;
+}
+
+//
+// Inserts key-value pair into hashmap. If key exists, the new element is
+// linked in front of the old one, which is then removed. Doubles the number of
+// buckets once the average load per bucket gets over LOAD_FACTOR.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::insert(K key, V value)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    uint64_t h = hash(key);
+    Element *e = new Element(regularKey(h), key, value);
+    Node *start = getBucket(h & (_size.load() - 1));
+    Node *pred;
+    Node *curr;
+    bool found;
+
+    do
+    {
+        found = search(start, e->soKey, &e->key, pred, curr);
+        e->next.store(curr, std::memory_order_relaxed);
+    }
+    while (!pred->next.compare_exchange_strong(curr, e));
+
+    if (found)
+    {
+        // Mark the old element as removed. If someone else removed it first,
+        // the new element is counted as added.
+        Node *next = curr->next.load();
+        while (!isMarked(next))
+        {
+            if (curr->next.compare_exchange_weak(next, mark(next)))
+            {
+                Node *expected = curr;
+                if (e->next.compare_exchange_strong(expected, unmark(next)))
+                    retire(curr);
+                return;
+            }
+        }
+    }
+
+    size_t size = _size.load();
+    if (_count.fetch_add(1) + 1 > size * LOAD_FACTOR && size < MAX_SIZE)
+        _size.compare_exchange_strong(size, size * 2);
+}
+
+//
+// Removes key and corresponding value from hashmap. If key doesn't exists
+// it throws "out of range" exception.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::remove(K key)
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    uint64_t h = hash(key);
+    uint64_t so = regularKey(h);
+    Node *start = getBucket(h & (_size.load() - 1));
+    Node *pred;
+    Node *curr;
+
+    for (;;)
+    {
+        if (!search(start, so, &key, pred, curr))
+            throw std::out_of_range("LockFreeHashMap: key doesn't exists");
+
+        // Logically remove by marking, then try to unlink. If that fails,
+        // search again, which unlinks the removed nodes it passes.
+        Node *next = curr->next.load();
+        if (isMarked(next) ||
+            !curr->next.compare_exchange_strong(next, mark(next)))
+            continue;
+
+        _count.fetch_sub(1);
+
+        Node *expected = curr;
+        if (pred->next.compare_exchange_strong(expected, next))
+            retire(curr);
+        else
+            search(start, so, &key, pred, curr);
+        return;
+    }
+}
+
+//
+// The number of buckets only grows, a smaller newSize is ignored. Growing
+// doesn't move any element.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::resize(size_t newSize)
+{
+    size_t size = _size.load();
+
+    while (size < newSize && size < MAX_SIZE)
+        if (_size.compare_exchange_weak(size, size * 2))
+            size *= 2;
+}
+
+//
+// Prints out hashmap, one line per initialized bucket in the list order.
+//
+template <class K, class V, class F>
+void LockFreeHashMap<K, V, F>::print()
+{
+    EpochReclaimer::Guard guard(_reclaimer);
+    bool empty = true;
+
+    for (Node *n = _head; n != nullptr; n = unmark(n->next.load()))
+    {
+        if ((n->soKey & 1) == 0)
+        {
+            if (!empty)
+                std::cout << "" << std::endl;
+            std::cout << "[" << reverse(n->soKey) << "] -> ";
+            empty = false;
+        }
+        else if (!isMarked(n->next.load()))
+        {
+            Element *e = static_cast<Element *>(n);
+            std::cout << "(" << e->key << ", " << e->value << "), ";
+        }
+    }
+    std::cout << "" << std::endl;
+}
+
+#endif
@@ -0,0 +1,400 @@
+// The MIT License (MIT)
+//
+// Thread-safe generic hashmap sharded over NUMA nodes
+// Copyright (c) 2016-2018 Jozef Kolek <jkolek@gmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SHARDEDHASHMAP_H
+#define SHARDEDHASHMAP_H
+
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+
+//
+// NUMA topology of the machine, read from /sys/devices/system/node. On
+// machines without NUMA (or without sysfs) there is one node with all CPUs.
+//
+class NumaTopology
+{
+    std::vector<std::vector<unsigned>> _cpus;   // CPUs of each node
+    std::vector<unsigned> _nodeOfCpu;
+
+    // Parses a list like "0-3,8,10-11".
+    static std::vector<unsigned> parseList(const std::string &list)
+    {
+        std::vector<unsigned> items;
+        size_t pos = 0;
+
+        while (pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+
+            std::string range = list.substr(pos, end - pos);
+            size_t dash = range.find('-');
+
+            if (!range.empty() && range.find_first_not_of("0123456789-\n") ==
+                                      std::string::npos)
+            {
+                unsigned first = std::stoul(range.substr(0, dash));
+                unsigned last = dash == std::string::npos
+                                    ? first
+                                    : std::stoul(range.substr(dash + 1));
+                for (unsigned i = first; i <= last; ++i)
+                    items.push_back(i);
+            }
+            pos = end + 1;
+        }
+
+        return items;
+    }
+
+    static std::string readLine(const std::string &path)
+    {
+        std::ifstream file(path);
+        std::string line;
+
+        std::getline(file, line);
+        return line;
+    }
+
+public:
+    NumaTopology()
+    {
+        const std::string root = "/sys/devices/system/node/";
+
+        for (unsigned node : parseList(readLine(root + "online")))
+        {
+            std::vector<unsigned> cpus = parseList(
+                readLine(root + "node" + std::to_string(node) + "/cpulist"));
+
+            if (cpus.empty())
+                continue;
+            for (unsigned cpu : cpus)
+            {
+                if (cpu >= _nodeOfCpu.size())
+                    _nodeOfCpu.resize(cpu + 1);
+                _nodeOfCpu[cpu] = _cpus.size();
+            }
+            _cpus.push_back(cpus);
+        }
+
+        if (_cpus.empty())
+        {
+            _cpus.resize(1);
+            for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency();
+                 ++cpu)
+                _cpus[0].push_back(cpu);
+            _nodeOfCpu.assign(_cpus[0].size(), 0);
+        }
+    }
+
+    // Returns the topology, read on the first call.
+    static const NumaTopology &get()
+    {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    unsigned getNodeCount() const { return _cpus.size(); }
+    const std::vector<unsigned> &getCpus(unsigned node) const
+    {
+        return _cpus[node];
+    }
+
+    // Returns the node of the CPU the calling thread runs on.
+    unsigned currentNode() const
+    {
+        int cpu = ::sched_getcpu();
+
+        if (cpu < 0 || (unsigned)cpu >= _nodeOfCpu.size())
+            return 0;
+        return _nodeOfCpu[cpu];
+    }
+
+    //
+    // Binds the calling thread to the CPUs of node, and makes it prefer memory
+    // of node for new pages. Returns false if the thread couldn't be bound;
+    // the memory policy is only a hint, and is silently skipped where it isn't
+    // supported.
+    //
+    bool bindToNode(unsigned node) const
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        for (unsigned cpu : _cpus[node])
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+
+        if (::sched_setaffinity(0, sizeof set, &set) != 0)
+            return false;
+
+#ifdef SYS_set_mempolicy
+        if (getNodeCount() > 1)
+        {
+            const int MPOL_PREFERRED_MODE = 1;
+            unsigned long mask[16] = {};
+
+            if (node < sizeof mask * 8)
+            {
+                mask[node / (8 * sizeof(long))] |=
+                    1ul << (node % (8 * sizeof(long)));
+                ::syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, mask,
+                          sizeof mask * 8);
+            }
+        }
+#endif
+        return true;
+    }
+};
+
+//
+// ShardedHashMap splits keys over a number of independent HashMaps (shards),
+// by the high bits of the key's mixed hash code, so the bits HashMap uses to
+// pick buckets stay independent. Shards are spread over NUMA nodes round-robin.
+// Each shard is constructed by a thread bound to its node, so by the first
+// touch policy its table, stripes and reclaimer live in that node's memory.
+// Tables allocated when a shard grows, and elements, come from the memory of
+// the thread doing it, so threads bound to a node (see bindToNode()) should
+// mostly work on that node's shards; getLocalShards() and getNodeOf() tell
+// which shards those are.
+//
+// On a machine with a single node this is plain sharding.
+//
+template <class K, class V, class F = DefaultHash<K>,
+          template <class> class A = PoolAllocator>
+class ShardedHashMap
+{
+public:
+    typedef HashMap<K, V, F, A> Shard;
+
+private:
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::vector<unsigned> _nodeOfShard;
+    std::vector<std::vector<size_t>> _shardsOfNode;
+
+    // Shards hash by copies of it, so a key's hash code is computed once,
+    // here, and passed down to its shard.
+    F hashFunctor;
+
+    typename Shard::HashCode hashOf(const K &key)
+    {
+        return {mixedHash(hashFunctor, key)};
+    }
+
+    size_t shardIndex(typename Shard::HashCode h)
+    {
+        return ((h.value >> 32) * _shards.size()) >> 32;
+    }
+
+    Shard &shardFor(typename Shard::HashCode h)
+    {
+        return *_shards[shardIndex(h)];
+    }
+
+    template <class Fn>
+    void forEachNode(Fn fn);
+
+public:
+    static constexpr size_t SHARDS_PER_NODE = 4;
+
+    //
+    // Creates shardCount shards (by default SHARDS_PER_NODE per NUMA node),
+    // together sized for size elements, each one with stripeCount stripes.
+    //
+    ShardedHashMap(size_t size, size_t shardCount = 0,
+                   size_t stripeCount = Shard::DEFAULT_STRIPES);
+
+    ShardedHashMap(const ShardedHashMap &) = delete;
+    ShardedHashMap &operator=(const ShardedHashMap &) = delete;
+
+    Shard &getShard(const K &key) { return shardFor(hashOf(key)); }
+    Shard &getShard(size_t i) { return *_shards[i]; }
+    size_t getShardCount() const { return _shards.size(); }
+    size_t getShardIndex(const K &key) { return shardIndex(hashOf(key)); }
+
+    // NUMA node the shard was placed on
+    unsigned getNodeOf(size_t shard) const { return _nodeOfShard[shard]; }
+
+    // Shards placed on the node of the calling thread
+    const std::vector<size_t> &getLocalShards() const
+    {
+        return _shardsOfNode[NumaTopology::get().currentNode() %
+                             _shardsOfNode.size()];
+    }
+
+    typename Shard::Handle find(const K &key)
+    {
+        auto h = hashOf(key);
+        return shardFor(h).find(key, h);
+    }
+
+    bool exists(const K &key)
+    {
+        auto h = hashOf(key);
+        return shardFor(h).exists(key, h);
+    }
+
+    V lookup(const K &key)
+    {
+        auto h = hashOf(key);
+        return shardFor(h).lookup(key, h);
+    }
+
+    V operator[](const K &key) { return lookup(key); }
+
+    void insert(const K &key, const V &value)
+    {
+        auto h = hashOf(key);
+        shardFor(h).insert(key, value, h);
+    }
+
+    void remove(const K &key)
+    {
+        auto h = hashOf(key);
+        shardFor(h).remove(key, h);
+    }
+
+    template <class Fn, class... Args>
+    bool upsert(const K &key, Fn fn, Args &&...args)
+    {
+        auto h = hashOf(key);
+        return shardFor(h).upsert(key, h, fn, std::forward<Args>(args)...);
+    }
+
+    template <class T = V>
+    typename std::enable_if<std::is_arithmetic<T>::value, T>::type
+    fetchAdd(const K &key, T delta)
+    {
+        auto h = hashOf(key);
+        return shardFor(h).fetchAdd(key, h, delta);
+    }
+
+    size_t getCount()
+    {
+        size_t count = 0;
+
+        for (auto &shard : _shards)
+            count += shard->getCount();
+        return count;
+    }
+
+    //
+    // Calls fn(key, value) for every element of every shard, from a thread per
+    // node, bound to that node. fn is called from several threads at once.
+    //
+    template <class Fn>
+    void parallelForEach(Fn fn);
+};
+
+//====----------------------------------------------------------------------====
+// Implementation of the ShardedHashMap methods
+//====----------------------------------------------------------------------====
+
+template <class K, class V, class F, template <class> class A>
+ShardedHashMap<K, V, F, A>::ShardedHashMap(size_t size, size_t shardCount,
+                                           size_t stripeCount)
+{
+    const NumaTopology &topology = NumaTopology::get();
+    unsigned nodes = topology.getNodeCount();
+
+    if (shardCount == 0)
+        shardCount = nodes * SHARDS_PER_NODE;
+
+    _shards.resize(shardCount);
+    _nodeOfShard.resize(shardCount);
+    _shardsOfNode.resize(nodes);
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        _nodeOfShard[i] = i % nodes;
+        _shardsOfNode[i % nodes].push_back(i);
+    }
+
+    // Shards are constructed on threads bound to their nodes, so their memory
+    // is first touched there.
+    size_t shardSize = size / shardCount + 1;
+
+    forEachNode([&](unsigned node) {
+        for (size_t i : _shardsOfNode[node])
+            _shards[i].reset(new Shard(shardSize, stripeCount,
+                                       hashFunctor));
+    });
+}
+
+//
+// Calls fn(node) for every NUMA node, on a thread bound to the node. An
+// exception thrown by fn is rethrown once all threads are done.
+//
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void ShardedHashMap<K, V, F, A>::forEachNode(Fn fn)
+{
+    const NumaTopology &topology = NumaTopology::get();
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(_shardsOfNode.size());
+
+    for (unsigned node = 0; node < _shardsOfNode.size(); ++node)
+    {
+        threads.emplace_back([&, node] {
+            try
+            {
+                topology.bindToNode(node);
+                fn(node);
+            }
+            catch (...)
+            {
+                errors[node] = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+template <class K, class V, class F, template <class> class A>
+template <class Fn>
+void ShardedHashMap<K, V, F, A>::parallelForEach(Fn fn)
+{
+    forEachNode([&](unsigned node) {
+        for (size_t i : _shardsOfNode[node])
+            _shards[i]->parallelForEach(fn, 1);
+    });
+}
+
+#endif
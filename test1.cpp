@@ -1,5 +1,8 @@
 #include <iostream>
 #include <cassert>
+#include <set>
+#include <string>
+#include <string_view>
 
 #include "hashmap.h"
 
@@ -15,7 +18,22 @@ public:
     }
 };
 
+class StringViewHash
+{
+public:
+    typedef void is_transparent;
+
+    unsigned operator()(std::string_view key)
+    {
+        unsigned res = 0;
+        for (char c : key)
+            res = res * 31 + (unsigned char) c;
+        return res;
+    }
+};
+
 HashMap<unsigned, std::string, UnsignedHash> umap(MAX_TABLE_SIZE);
+HashMap<std::string, std::string, StringViewHash> smap(MAX_TABLE_SIZE);
 
 int main()
 {
@@ -75,6 +93,102 @@ int main()
 
     assert(msg == "HashMap: key doesn't exists");
 
+    // Test find, which doesn't throw
+
+    auto found = umap.find(43);
+    assert(found && *found == "new value" && found.key() == 43);
+    assert(!umap.find(30));
+
+    // Test emplace and tryEmplace
+
+    assert(umap.emplace(55u, 3, 'x') == true);
+    assert(umap.lookup(55) == "xxx");
+    assert(umap.emplace(55u, "other") == false);
+    assert(umap.tryEmplace(55, "other") == false);
+    assert(umap.lookup(55) == "xxx");
+    assert(umap.tryEmplace(56, 2, 'y') == true);
+    assert(umap.lookup(56) == "yy");
+    umap.remove(55);
+    umap.remove(56);
+
+    // Test lookup by std::string_view in a std::string keyed map
+
+    smap.insert("apple", "red");
+    smap.insert("banana", "yellow");
+
+    std::string_view key = "apple";
+    assert(smap.exists(key));
+    assert(smap.find(key)->size() == 3);
+    assert(smap.lookup(std::string_view("banana")) == "yellow");
+    assert(!smap.find(std::string_view("cherry")));
+    smap.remove(key);
+    assert(!smap.exists(key));
+    assert(smap["banana"] == "yellow");
+
+    // Test read-modify-write operations
+
+    HashMap<unsigned, unsigned, UnsignedHash> cmap(MAX_TABLE_SIZE);
+
+    assert(cmap.fetchAdd(1, 5u) == 0);
+    assert(cmap.fetchAdd(1, 2u) == 5);
+    assert(cmap.lookup(1) == 7);
+
+    assert(cmap.upsert(2, [](unsigned &v) { v *= 2; }, 10u));
+    assert(!cmap.upsert(2, [](unsigned &v) { v *= 2; }, 10u));
+    assert(cmap.lookup(2) == 20);
+
+    assert(cmap.computeIfPresent(2, [](unsigned v) { return v + 1; }));
+    assert(!cmap.computeIfPresent(3, [](unsigned v) { return v + 1; }));
+    assert(cmap.lookup(2) == 21 && !cmap.exists(3));
+
+    assert(cmap.computeIfAbsent(3, [] { return 30u; }) == 30);
+    assert(cmap.computeIfAbsent(3, [] { return 31u; }) == 30);
+
+    assert(cmap.insertOrAssign(4, 40));
+    assert(!cmap.insertOrAssign(4, 41));
+    assert(cmap.lookup(4) == 41);
+
+    assert(!cmap.eraseIf(4, [](unsigned v) { return v == 40; }));
+    assert(cmap.eraseIf(4, [](unsigned v) { return v == 41; }));
+    assert(!cmap.exists(4) && cmap.getCount() == 3);
+    assert(cmap.size() == 3 && cmap.approximateSize() == 3);
+
+    // Test statistics
+
+    auto st = umap.stats();
+    size_t buckets = 0, elements = 0;
+
+    for (size_t n = 0; n < st.chainLengths.size(); ++n)
+    {
+        buckets += st.chainLengths[n];
+        elements += n * st.chainLengths[n];
+    }
+    assert(st.count == umap.getCount() && elements == st.count);
+    assert(st.size == umap.getSize() && buckets == st.size);
+    assert(st.longestChain == st.chainLengths.size() - 1);
+    assert(st.lockAcquisitions.empty());
+
+    // Test batched operations
+
+    std::pair<unsigned, std::string> pairs[] = {
+        {1000, "a"}, {1001, "b"}, {1002, "c"}, {1000, "d"}
+    };
+    umap.insertMany(pairs, 4);
+
+    unsigned keys[] = {1000, 1001, 1002, 1003};
+    std::string values[4];
+    bool present[4];
+
+    assert(umap.lookupMany(keys, 4, values, present) == 3);
+    assert(present[0] && values[0] == "d");
+    assert(present[1] && values[1] == "b");
+    assert(present[2] && values[2] == "c");
+    assert(!present[3]);
+
+    assert(umap.removeMany(keys, 4) == 3);
+    umap.existsMany(keys, 4, present);
+    assert(!present[0] && !present[1] && !present[2] && !present[3]);
+
     // Test move constructor
 
     size_t tmpSize = umap.getSize();
@@ -111,5 +225,51 @@ int main()
     assert(umap5.getSize() == tmpSize);
     assert(umap4.lookup(754) == umap5.lookup(754));
 
+    // Test the default hash functors
+
+    HashMap<std::string, unsigned> dmap(16);
+    std::string bytes;
+
+    for (unsigned i = 0; i < 200; ++i)
+    {
+        dmap.insert(bytes, i);
+        bytes += (char)('a' + i % 26);
+    }
+    assert(dmap.lookup("") == 0);
+    assert(dmap.lookup(std::string_view("abc")) == 3);
+    assert(dmap.exists(bytes.substr(0, 199)));
+    assert(!dmap.exists(bytes));
+
+    std::set<uint64_t> codes;
+    DefaultHash<unsigned> intHash;
+    DefaultHash<std::string> stringHash;
+
+    for (unsigned i = 0; i < 1000; ++i)
+    {
+        codes.insert(intHash(i << 10) & 0xffff);
+        codes.insert(stringHash(std::to_string(i)) >> 48);
+    }
+    assert(codes.size() > 1900);
+
+    SeededHash<std::string> seeded1;
+    SeededHash<std::string> seeded2;
+    assert(seeded1("key") != seeded2("key"));
+    assert(seeded1("key") == seeded1(std::string("key")));
+
+    // Avalanching functors aren't mixed again, others are
+    assert(mixedHash(stringHash, "key") == stringHash("key"));
+    assert(mixedHash(seeded1, "key") == seeded1("key"));
+    UnsignedHash identity;
+    assert(mixedHash(identity, 5u) != 5);
+
+    HashMap<unsigned, unsigned, SeededHash<unsigned>> seededMap(16);
+    for (unsigned i = 0; i < 1000; ++i)
+        seededMap.insert(i, i);
+    HashMap<unsigned, unsigned, SeededHash<unsigned>> seededCopy(seededMap);
+    HashMap<unsigned, unsigned, SeededHash<unsigned>> seededMoved;
+    seededMoved = std::move(seededCopy);
+    for (unsigned i = 0; i < 1000; ++i)
+        assert(seededMoved.lookup(i) == i);
+
     std::cout << "Success!" << std::endl;
 }
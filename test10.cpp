@@ -0,0 +1,122 @@
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "inlinehashmap.h"
+
+constexpr unsigned KEYS = 50000;
+
+class UnsignedHash
+{
+public:
+    uint64_t operator()(uint64_t key)
+    {
+        return key;
+    }
+};
+
+class StringHash
+{
+public:
+    unsigned operator()(const std::string &key)
+    {
+        unsigned h = 0;
+
+        for (char c : key)
+            h = h * 31 + c;
+        return h;
+    }
+};
+
+static_assert(IsInlineable<uint64_t, uint64_t>::value, "");
+static_assert(IsInlineable<unsigned, float>::value, "");
+static_assert(!IsInlineable<std::string, unsigned>::value, "");
+static_assert(!IsInlineable<float, unsigned>::value, "");
+static_assert(std::is_same<AutoHashMap<uint64_t, uint64_t, UnsignedHash>,
+                           InlineHashMap<uint64_t, uint64_t,
+                                         UnsignedHash>>::value, "");
+static_assert(std::is_same<AutoHashMap<std::string, unsigned, StringHash>,
+                           HashMap<std::string, unsigned,
+                                   StringHash>>::value, "");
+
+InlineHashMap<uint64_t, uint64_t, UnsignedHash> map(100, 4);
+
+void writer(unsigned id)
+{
+    for (uint64_t i = id; i < KEYS; i += 4)
+        map.insert(i, i * 3);
+}
+
+void reader()
+{
+    for (uint64_t i = 0; i < KEYS; ++i)
+    {
+        std::optional<uint64_t> v = map.find(i);
+        assert(!v || *v == i * 3);
+    }
+}
+
+int main()
+{
+    assert(map.SLOTS == 3);
+    assert((InlineHashMap<unsigned, unsigned, UnsignedHash>::SLOTS == 7));
+
+    // Test concurrent inserts (growing the tables) and lookups
+
+    std::vector<std::thread> threads;
+    for (unsigned id = 0; id < 4; ++id)
+        threads.emplace_back(writer, id);
+    for (unsigned id = 0; id < 2; ++id)
+        threads.emplace_back(reader);
+    for (auto &t : threads)
+        t.join();
+
+    assert(map.getCount() == KEYS);
+    assert(map.getSize() >= KEYS);
+    for (uint64_t i = 0; i < KEYS; ++i)
+        assert(map.lookup(i) == i * 3 && map[i] == i * 3);
+    assert(!map.exists(KEYS));
+
+    // Test replacing and removing
+
+    for (uint64_t i = 0; i < KEYS; i += 2)
+        map.insert(i, i);
+    for (uint64_t i = 1; i < KEYS; i += 2)
+        map.remove(i);
+    assert(map.getCount() == KEYS / 2);
+    for (uint64_t i = 0; i < KEYS; ++i)
+        assert(map.exists(i) == (i % 2 == 0));
+    try
+    {
+        map.remove(1);
+        assert(false);
+    }
+    catch (std::out_of_range &e)
+    {
+    }
+
+    uint64_t sum = 0;
+    map.forEach([&sum](uint64_t key, uint64_t value) {
+        assert(key == value);
+        sum += key;
+    });
+    assert(sum == (uint64_t)(KEYS / 2) * (KEYS / 2 - 1));
+
+    // Removed keys leave no tombstones, so reinserting them doesn't grow.
+    size_t size = map.getSize();
+    for (unsigned round = 0; round < 4; ++round)
+    {
+        for (uint64_t i = 1; i < KEYS; i += 2)
+            map.insert(i, i);
+        for (uint64_t i = 1; i < KEYS; i += 2)
+            map.remove(i);
+    }
+    assert(map.getSize() == size);
+
+    std::cout << "Success!" << std::endl;
+}
@@ -0,0 +1,197 @@
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cuckoohashmap.h"
+
+constexpr unsigned KEYS = 40000;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key;
+    }
+};
+
+// Every key collides with every other
+class ConstantHash
+{
+public:
+    unsigned operator()(unsigned)
+    {
+        return 42;
+    }
+};
+
+// Keys fall into 16 groups of equal hash codes
+class WeakHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key % 16;
+    }
+};
+
+CuckooHashMap<unsigned, unsigned, UnsignedHash> map(16, 8);
+
+void writer(unsigned id)
+{
+    for (unsigned i = id; i < KEYS; i += 4)
+        map.insert(i, i * 2);
+}
+
+void reader()
+{
+    for (unsigned i = 0; i < KEYS; ++i)
+    {
+        auto handle = map.find(i);
+        assert(!handle || *handle == i * 2);
+    }
+}
+
+// Keys from KEYS on come and go, the others are always there.
+void churningWriter(unsigned id)
+{
+    for (unsigned i = 0; i < 20000; ++i)
+    {
+        unsigned key = KEYS + (i * 4 + id) % 8000;
+
+        try
+        {
+            if (i % 3 == 2)
+                map.remove(key);
+            else
+                map.insert(key, key * 2);
+        }
+        catch (std::out_of_range &e)
+        {
+        }
+    }
+}
+
+void stableReader()
+{
+    for (unsigned round = 0; round < 4; ++round)
+        for (unsigned i = 0; i < KEYS; i += 7)
+            assert(map.lookup(i) == i * 2);
+}
+
+int main()
+{
+    // Test concurrent inserts (growing the table) and lookups
+
+    std::vector<std::thread> threads;
+    for (unsigned id = 0; id < 4; ++id)
+        threads.emplace_back(writer, id);
+    threads.emplace_back(reader);
+    for (auto &t : threads)
+        t.join();
+
+    assert(map.getCount() == KEYS);
+    assert(map.getSize() >= KEYS);
+    for (unsigned i = 0; i < KEYS; ++i)
+        assert(map.lookup(i) == i * 2 && map[i] == i * 2);
+    assert(!map.exists(KEYS) && !map.find(KEYS));
+
+    // Test moving elements along cuckoo paths while others are read
+
+    threads.clear();
+    for (unsigned id = 0; id < 4; ++id)
+        threads.emplace_back(churningWriter, id);
+    for (unsigned id = 0; id < 2; ++id)
+        threads.emplace_back(stableReader);
+    for (auto &t : threads)
+        t.join();
+
+    for (unsigned i = KEYS; i < KEYS + 8000; ++i)
+        if (map.exists(i))
+            map.remove(i);
+    assert(map.getCount() == KEYS);
+
+    // Test replacing and removing
+
+    map.insert(1, 7);
+    assert(map.lookup(1) == 7 && map.getCount() == KEYS);
+    map.remove(1);
+    assert(!map.exists(1) && map.getCount() == KEYS - 1);
+    try
+    {
+        map.remove(1);
+        assert(false);
+    }
+    catch (std::out_of_range &e)
+    {
+    }
+
+    // Filling 94% of the slots needs cuckoo paths, but not growing
+
+    CuckooHashMap<std::string, unsigned, std::hash<std::string>> smap(7000);
+    size_t size = smap.getSize();
+    for (unsigned i = 0; i < 13500; ++i)
+        smap.insert("key" + std::to_string(i), i);
+    assert(smap.getSize() == size);
+    for (unsigned i = 0; i < 13500; ++i)
+        assert(smap.lookup("key" + std::to_string(i)) == i);
+
+    // Keys with equal hash codes go to the stash once their two buckets are
+    // full, without growing the table
+
+    CuckooHashMap<unsigned, unsigned, ConstantHash> cmap(16);
+    size = cmap.getSize();
+    for (unsigned i = 0; i < 1000; ++i)
+        cmap.insert(i, i);
+    assert(cmap.getSize() == size && cmap.getCount() == 1000);
+    for (unsigned i = 0; i < 1000; ++i)
+        assert(cmap.lookup(i) == i);
+    assert(!cmap.exists(1000) && !cmap.find(1000));
+
+    cmap.insert(999, 1);
+    assert(cmap.lookup(999) == 1 && cmap.getCount() == 1000);
+    for (unsigned i = 0; i < 1000; i += 2)
+        cmap.remove(i);
+    assert(cmap.getCount() == 500);
+    for (unsigned i = 0; i < 999; ++i)
+        assert(cmap.exists(i) == (i % 2 == 1));
+    try
+    {
+        cmap.remove(0);
+        assert(false);
+    }
+    catch (std::out_of_range &e)
+    {
+    }
+
+    // Test a weak functor, with groups of colliding keys, from many threads
+
+    CuckooHashMap<unsigned, unsigned, WeakHash> wmap(16, 4);
+    threads.clear();
+    for (unsigned id = 0; id < 4; ++id)
+    {
+        threads.emplace_back([&wmap, id] {
+            for (unsigned round = 0; round < 3; ++round)
+            {
+                for (unsigned i = id; i < 2000; i += 4)
+                    wmap.insert(i, i);
+                for (unsigned i = id; i < 2000; i += 4)
+                    assert(wmap.lookup(i) == i);
+                for (unsigned i = id; i < 2000; i += 8)
+                    wmap.remove(i);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    assert(wmap.getCount() == 1000);
+    for (unsigned i = 0; i < 2000; ++i)
+        assert(wmap.exists(i) == (i % 8 >= 4));
+
+    std::cout << "Success!" << std::endl;
+}
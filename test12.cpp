@@ -0,0 +1,136 @@
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cowhashmap.h"
+
+constexpr unsigned KEYS = 1000;
+constexpr unsigned ROUNDS = 200;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key;
+    }
+};
+
+typedef CowHashMap<unsigned, std::string, UnsignedHash> Map;
+
+std::thread::id mainThread = std::this_thread::get_id();
+
+// Value which checks that it is only copied by the main thread
+struct Tracked
+{
+    unsigned value;
+
+    Tracked(unsigned v) : value(v) {}
+    Tracked(const Tracked &other) : value(other.value)
+    {
+        assert(std::this_thread::get_id() == mainThread);
+    }
+};
+
+Map map(64, 8);
+std::atomic<bool> done(false);
+
+// Every version holds all keys with values from the same round, so a reader
+// which finds two keys of different rounds in one read has seen a torn version.
+void writer()
+{
+    for (unsigned r = 1; r <= ROUNDS; ++r)
+    {
+        map.update([r](Map::Map &m) {
+            for (unsigned key = 0; key < KEYS; ++key)
+                m.insert(key, std::to_string(r));
+        });
+    }
+}
+
+void reader()
+{
+    Map::Reader reader(map);
+    unsigned key = 0;
+
+    while (!done)
+    {
+        reader.read([&key](Map::Map &m) {
+            const std::string *first = m.findFrozen(key);
+            const std::string *last = m.findFrozen(KEYS - 1 - key);
+            assert(first != nullptr && last != nullptr);
+            assert(*first == *last);
+        });
+        assert(reader.exists(key));
+        assert(reader.getCount() == KEYS);
+        key = (key + 1) % KEYS;
+    }
+}
+
+int main()
+{
+    map.update([](Map::Map &m) {
+        for (unsigned key = 0; key < KEYS; ++key)
+            m.insert(key, "0");
+    });
+
+    // Test readers running against batched updates
+
+    std::vector<std::thread> readers;
+    for (unsigned i = 0; i < 4; ++i)
+        readers.emplace_back(reader);
+    std::thread w(writer);
+
+    w.join();
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    for (unsigned key = 0; key < KEYS; ++key)
+        assert(map.lookup(key) == std::to_string(ROUNDS));
+
+    // Test single changes, and a published version kept by a reader
+
+    Map::Reader reader(map);
+    reader.read([](Map::Map &m) {
+        map.remove(0);
+        map.insert(KEYS, "new");
+        assert(m.findFrozen(0) != nullptr);
+        assert(m.findFrozen(KEYS) == nullptr);
+    });
+    assert(!reader.exists(0));
+    assert(reader.lookup(KEYS) == "new");
+    try
+    {
+        reader.lookup(0);
+        assert(false);
+    }
+    catch (std::out_of_range &e)
+    {
+    }
+
+    // Test replacing the whole map
+
+    Map::Map built(16);
+    built.insert(1, "one");
+    map.replace(std::move(built));
+    assert(map.getCount() == 1);
+    assert(map.lookup(1) == "one");
+    assert(!map.exists(KEYS));
+
+    // Updates of a small map copy it on the calling thread
+
+    CowHashMap<unsigned, Tracked, UnsignedHash> tracked(16);
+    tracked.update([](decltype(tracked)::Map &m) {
+        for (unsigned key = 0; key < 10; ++key)
+            m.insert(key, Tracked(key));
+    });
+    tracked.insert(10, Tracked(10));
+    assert(tracked.getCount() == 11 && tracked.lookup(3).value == 3);
+
+    std::cout << "Success!" << std::endl;
+}
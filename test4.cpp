@@ -0,0 +1,153 @@
+#include <iostream>
+#include <cassert>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "flathashmap.h"
+
+constexpr unsigned MAX_TABLE_SIZE = 100;
+static constexpr unsigned hashConst = 17; // A prime number
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return (key * key + hashConst) % MAX_TABLE_SIZE;
+    }
+};
+
+// Each instance hashes differently, like a seeded functor
+class SaltedHash
+{
+    static inline unsigned nextSalt = 0;
+    unsigned _salt = ++nextSalt * 0x9e3779b9u;
+
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key ^ _salt;
+    }
+};
+
+FlatHashMap<unsigned, std::string, UnsignedHash> umap(MAX_TABLE_SIZE);
+
+void insertRange(FlatHashMap<unsigned, unsigned, UnsignedHash> *map,
+                 unsigned from, unsigned to)
+{
+    for (unsigned i = from; i < to; ++i)
+        map->insert(i, i * 2);
+}
+
+int main()
+{
+    std::string msg;
+
+    umap.insert(25, "hello");
+    umap.insert(34, "world");
+    umap.insert(43, "one");
+    umap.insert(143, "two");
+    umap.insert(754, "three");
+
+    assert(umap.lookup(25) == "hello");
+    assert(umap.lookup(34) == "world");
+    assert(umap.lookup(43) == "one");
+    assert(umap.lookup(143) == "two");
+    assert(umap.lookup(754) == "three");
+
+    umap.remove(25);
+    umap.remove(143);
+
+    assert(umap.exists(25) == false);
+    assert(umap.exists(143) == false);
+    assert(umap.exists(34) == true);
+
+    umap.insert(43, "new value");
+    assert(umap.lookup(43) == "new value");
+
+    try
+    {
+        // Try to lookup non-existing key
+        umap.lookup(30);
+    }
+    catch (std::out_of_range &e)
+    {
+        msg = e.what();
+    }
+
+    assert(msg == "FlatHashMap: key doesn't exists");
+
+    // Test growth past the initial capacity, with tombstones in between
+
+    FlatHashMap<unsigned, unsigned, UnsignedHash> nmap(16, 2);
+
+    for (unsigned i = 0; i < 10000; ++i)
+        nmap.insert(i, i);
+    for (unsigned i = 0; i < 10000; i += 2)
+        nmap.remove(i);
+    for (unsigned i = 0; i < 10000; ++i)
+        assert(nmap.exists(i) == (i % 2 == 1));
+
+    nmap.resize(1 << 16);
+    assert(nmap.getSize() >= 1 << 16);
+    for (unsigned i = 1; i < 10000; i += 2)
+        assert(nmap.lookup(i) == i);
+
+    // Test iterator
+
+    unsigned count = 0;
+    for (auto it = nmap.begin(); it != nmap.end(); ++it)
+    {
+        assert((*it)->key % 2 == 1);
+        ++count;
+    }
+    assert(count == 5000);
+
+    // Test concurrent inserts
+
+    FlatHashMap<unsigned, unsigned, UnsignedHash> tmap(MAX_TABLE_SIZE);
+    std::vector<std::thread> threads;
+
+    for (unsigned t = 0; t < 4; ++t)
+        threads.emplace_back(insertRange, &tmap, t * 5000, (t + 1) * 5000);
+    for (auto &t : threads)
+        t.join();
+    for (unsigned i = 0; i < 20000; ++i)
+        assert(tmap.lookup(i) == i * 2);
+
+    // Test copy and move
+
+    FlatHashMap<unsigned, std::string, UnsignedHash> umap2 = umap;
+    assert(umap2.lookup(754) == umap.lookup(754));
+
+    FlatHashMap<unsigned, std::string, UnsignedHash> umap3;
+    umap3 = std::move(umap2);
+    assert(umap2.getSize() == 0);
+    assert(umap3.lookup(43) == "new value");
+
+    // Moves and copies keep a stateful functor with the keys
+
+    FlatHashMap<unsigned, unsigned, SaltedHash> smap(MAX_TABLE_SIZE);
+    for (unsigned i = 0; i < 100; ++i)
+        smap.insert(i, i);
+
+    FlatHashMap<unsigned, unsigned, SaltedHash> smap2(std::move(smap));
+    FlatHashMap<unsigned, unsigned, SaltedHash> smap3;
+    smap3 = std::move(smap2);
+    FlatHashMap<unsigned, unsigned, SaltedHash> smap4(smap3);
+    FlatHashMap<unsigned, unsigned, SaltedHash> smap5;
+    smap5 = smap4;
+    for (unsigned i = 0; i < 100; ++i)
+        assert(smap3.exists(i) && smap4.exists(i) && smap5.lookup(i) == i);
+
+    // Test the default hash functor
+
+    FlatHashMap<std::string, unsigned> dmap(MAX_TABLE_SIZE);
+    for (unsigned i = 0; i < 100; ++i)
+        dmap.insert(std::to_string(i), i);
+    for (unsigned i = 0; i < 100; ++i)
+        assert(dmap.lookup(std::to_string(i)) == i);
+
+    std::cout << "Success!" << std::endl;
+}
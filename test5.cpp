@@ -0,0 +1,528 @@
+#define HASHMAP_LOCK_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "hashmap.h"
+
+constexpr unsigned MAX_TABLE_SIZE = 64;
+constexpr unsigned KEYS = 256;
+constexpr unsigned ROUNDS = 20000;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key;
+    }
+};
+
+HashMap<unsigned, std::string, UnsignedHash> smap(MAX_TABLE_SIZE, 8);
+std::atomic<bool> done(false);
+std::thread::id mainThread = std::this_thread::get_id();
+
+HashMap<unsigned, unsigned, UnsignedHash> gmap(1, 4);
+std::atomic<unsigned> inserted[2];
+
+// Value which counts its live instances
+struct Counted
+{
+    static inline std::atomic<int> live{0};
+
+    Counted() { ++live; }
+    Counted(const Counted &) { ++live; }
+    ~Counted() { --live; }
+};
+
+// Values always encode their key, so a reader can tell a torn or freed element
+// from a valid one.
+std::string valueFor(unsigned key, unsigned round)
+{
+    return std::to_string(key) + ":" + std::to_string(round) +
+           std::string(32, 'x');
+}
+
+void writer(unsigned id)
+{
+    for (unsigned r = 0; r < ROUNDS; ++r)
+    {
+        unsigned key = (r * 7 + id) % KEYS;
+
+        if (r % 3 == 0)
+        {
+            try
+            {
+                smap.remove(key);
+            }
+            catch (std::out_of_range &e)
+            {
+            }
+        }
+        else
+        {
+            smap.insert(key, valueFor(key, r));
+        }
+    }
+}
+
+void reader()
+{
+    unsigned key = 0;
+
+    while (!done)
+    {
+        try
+        {
+            std::string val = smap.lookup(key);
+            assert(val.compare(0, val.find(':'), std::to_string(key)) == 0);
+        }
+        catch (std::out_of_range &e)
+        {
+        }
+
+        smap.exists(key);
+        key = (key + 1) % KEYS;
+    }
+}
+
+void growingWriter(unsigned id)
+{
+    for (unsigned i = 0; i < 20000; ++i)
+    {
+        gmap.insert(i * 2 + id, i);
+        inserted[id] = i + 1;
+    }
+}
+
+// Every key inserted so far must be found, also while buckets are being moved
+// to a bigger table.
+void growingReader()
+{
+    while (!done)
+    {
+        for (unsigned id = 0; id < 2; ++id)
+        {
+            unsigned n = inserted[id];
+            if (n == 0)
+                continue;
+            unsigned i = (n * 7919) % n;
+            assert(gmap.lookup(i * 2 + id) == i);
+            assert(gmap.exists((n - 1) * 2 + id));
+        }
+    }
+}
+
+constexpr unsigned STABLE_KEYS = 2000;
+HashMap<unsigned, unsigned, UnsignedHash> imap(1, 4);
+
+// Keys from STABLE_KEYS on come and go, and the table grows and shrinks.
+void churningWriter(unsigned id)
+{
+    for (unsigned i = 0; i < 20000; ++i)
+    {
+        unsigned key = STABLE_KEYS + (i * 2 + id) % 6000;
+
+        if (i % 4 == 3)
+        {
+            try
+            {
+                imap.remove(key);
+            }
+            catch (std::out_of_range &e)
+            {
+            }
+        }
+        else
+            imap.insert(key, key * 2);
+
+        if (id == 0 && i % 5000 == 4999)
+            imap.resize(i % 10000 == 4999 ? 16 : 4096);
+    }
+}
+
+// Every stable key must be visited exactly once per iteration.
+void iteratingReader()
+{
+    std::vector<unsigned> seen(STABLE_KEYS);
+
+    while (!done)
+    {
+        std::fill(seen.begin(), seen.end(), 0);
+
+        for (auto it = imap.begin(); it != imap.end(); ++it)
+        {
+            assert((*it)->value == (*it)->key * 2);
+            if ((*it)->key < STABLE_KEYS)
+                ++seen[(*it)->key];
+        }
+
+        for (unsigned n : seen)
+            assert(n == 1);
+    }
+}
+
+int main()
+{
+    // Test optimistic reads running against writers
+
+    std::vector<std::thread> readers;
+    std::vector<std::thread> writers;
+
+    for (unsigned i = 0; i < 4; ++i)
+        readers.emplace_back(reader);
+    for (unsigned i = 0; i < 2; ++i)
+        writers.emplace_back(writer, i);
+
+    for (auto &t : writers)
+        t.join();
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    // Keys present in the map must be found by lookup and exists
+
+    for (unsigned key = 0; key < KEYS; ++key)
+        smap.insert(key, valueFor(key, 0));
+    for (unsigned key = 0; key < KEYS; ++key)
+        assert(smap.lookup(key) == valueFor(key, 0));
+
+    // Test lookups while the map grows by itself
+
+    done = false;
+    readers.clear();
+    writers.clear();
+
+    for (unsigned i = 0; i < 2; ++i)
+        readers.emplace_back(growingReader);
+    for (unsigned i = 0; i < 2; ++i)
+        writers.emplace_back(growingWriter, i);
+
+    for (auto &t : writers)
+        t.join();
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    gmap.completeResize();
+    assert(gmap.getCount() == 40000);
+    assert(gmap.getSize() >= 40000 / gmap.getMaxLoadFactor());
+
+    for (unsigned i = 0; i < 40000; ++i)
+        assert(gmap.lookup(i) == i / 2);
+
+    // Test iteration while other threads insert, remove and resize
+
+    for (unsigned key = 0; key < STABLE_KEYS; ++key)
+        imap.insert(key, key * 2);
+
+    done = false;
+    readers.clear();
+    writers.clear();
+
+    for (unsigned i = 0; i < 2; ++i)
+        readers.emplace_back(iteratingReader);
+    for (unsigned i = 0; i < 2; ++i)
+        writers.emplace_back(churningWriter, i);
+
+    for (auto &t : writers)
+        t.join();
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    // Test concurrent counting
+
+    HashMap<unsigned, unsigned long, UnsignedHash> counters(16);
+
+    readers.clear();
+    writers.clear();
+    for (unsigned id = 0; id < 4; ++id)
+    {
+        writers.emplace_back([&counters] {
+            for (unsigned i = 0; i < 10000; ++i)
+                counters.fetchAdd(i % 10, 1ul);
+        });
+    }
+    for (auto &t : writers)
+        t.join();
+
+    for (unsigned key = 0; key < 10; ++key)
+        assert(counters.lookup(key) == 4000);
+
+    // Test the exact size while every writer keeps at most one key of its own
+
+    HashMap<unsigned, unsigned, UnsignedHash> smap(1000, 8);
+
+    for (unsigned key = 0; key < 1000; ++key)
+        smap.insert(key, key);
+
+    writers.clear();
+    done = false;
+    for (unsigned id = 0; id < 3; ++id)
+    {
+        writers.emplace_back([&smap, id] {
+            for (unsigned i = 0; i < 20000; ++i)
+            {
+                smap.insert(1000 + id * 20000 + i, i);
+                smap.remove(1000 + id * 20000 + i);
+            }
+        });
+    }
+    readers.emplace_back([&smap] {
+        while (!done)
+        {
+            size_t n = smap.size();
+            assert(n >= 1000 && n <= 1003);
+        }
+    });
+    for (auto &t : writers)
+        t.join();
+    done = true;
+    readers.back().join();
+    assert(smap.size() == 1000 && smap.approximateSize() == 1000);
+
+    // Test transfers between keys in transactions, which keep the total
+
+    constexpr unsigned ACCOUNTS = 64;
+    HashMap<unsigned, long, UnsignedHash> accounts(1, 8);
+
+    for (unsigned key = 0; key < ACCOUNTS; ++key)
+        accounts.insert(key, 100);
+
+    writers.clear();
+    for (unsigned id = 0; id < 4; ++id)
+    {
+        writers.emplace_back([&accounts, id] {
+            for (unsigned i = 0; i < 10000; ++i)
+            {
+                unsigned from = (i * 7 + id) % ACCOUNTS;
+                unsigned to = (i * 13 + id * 5 + 1) % ACCOUNTS;
+
+                accounts.transaction({from, to}, [&](auto &tx) {
+                    long amount = tx.lookup(from) % 10;
+                    tx.insert(from, tx.lookup(from) - amount);
+                    tx.insert(to, tx.lookup(to) + amount);
+                });
+            }
+        });
+    }
+    for (unsigned id = 0; id < 2; ++id)
+    {
+        writers.emplace_back([&accounts, id] {
+            for (unsigned i = 0; i < 2000; ++i)
+            {
+                // New keys grow the map while the transfers run
+                unsigned key = ACCOUNTS + id * 2000 + i;
+                unsigned other = i % ACCOUNTS;
+
+                bool moved = accounts.transaction(
+                    {key, other}, [&](auto &tx) {
+                        if (tx.exists(key) || tx.lookup(other) < 1)
+                            return false;
+                        tx.insert(key, 1l);
+                        tx.insert(other, tx.lookup(other) - 1);
+                        return true;
+                    });
+                if (moved)
+                    accounts.transaction({key, other}, [&](auto &tx) {
+                        tx.insert(other, tx.lookup(other) + 1);
+                        tx.remove(key);
+                    });
+            }
+        });
+    }
+    for (auto &t : writers)
+        t.join();
+
+    long total = 0;
+    for (unsigned key = 0; key < ACCOUNTS; ++key)
+        total += accounts.lookup(key);
+    assert(total == 100 * ACCOUNTS);
+    assert(accounts.size() == ACCOUNTS);
+    assert(accounts.getSize() > 1);
+
+    // A throwing transaction changes nothing
+    try
+    {
+        accounts.transaction({0u, 1u, 0u}, [](auto &tx) {
+            tx.remove(0);
+            assert(!tx.exists(0) && tx.find(0) == nullptr);
+            tx.insert(1, 0l);
+            tx.lookup(2);
+        });
+        assert(false);
+    }
+    catch (std::invalid_argument &e)
+    {
+    }
+    assert(accounts.lookup(0) + accounts.lookup(1) ==
+           accounts.transaction({0u, 1u}, [](auto &tx) {
+               return *tx.find(0) + *tx.find(1);
+           }));
+
+    // Test lock statistics
+
+    auto st = gmap.stats();
+    uint64_t acquisitions = 0;
+
+    assert(st.count == 40000);
+    assert(st.lockAcquisitions.size() == gmap.getStripeCount());
+    for (uint64_t a : st.lockAcquisitions)
+        acquisitions += a;
+    assert(acquisitions >= 40000);
+
+    // Test snapshots
+
+    gmap.save("test5.snapshot");
+
+    HashMap<unsigned, unsigned, UnsignedHash> lmap;
+    lmap.load("test5.snapshot");
+    std::remove("test5.snapshot");
+
+    assert(lmap.getCount() == 40000);
+    for (unsigned i = 0; i < 40000; ++i)
+        assert(lmap.lookup(i) == i / 2);
+
+    lmap.insert(40000, 1);
+    assert(lmap.lookup(40000) == 1);
+
+    // Test bulk building, with duplicate keys, and reserve()
+
+    std::vector<std::pair<unsigned, unsigned>> input;
+    for (unsigned i = 0; i < 50000; ++i)
+        input.emplace_back(i % 30000, i);
+
+    HashMap<unsigned, unsigned, UnsignedHash> kmap(input.begin(), input.end(),
+                                                   4, 16);
+    assert(kmap.getStripeCount() == 16);
+    assert(kmap.size() == 30000);
+    for (unsigned i = 0; i < 30000; ++i)
+        assert(kmap.lookup(i) == (i < 20000 ? i + 30000 : i));
+    kmap.insert(30000, 1);
+    kmap.remove(0);
+    assert(kmap.size() == 30000);
+
+    kmap.bulkLoad(input.data(), input.data() + 10, 2);
+    assert(kmap.size() == 10 && kmap.lookup(9) == 9);
+
+    HashMap<unsigned, unsigned, UnsignedHash> rmap;
+    rmap.reserve(1000);
+    assert(rmap.getSize() >= 1000);
+    rmap.insert(1, 1);
+    rmap.reserve(5000);
+    assert(rmap.getSize() >= 5000 && rmap.lookup(1) == 1);
+
+    // Test explicit resize, also to a smaller table, rounded to a power of two
+
+    gmap.resize(100);
+    assert(gmap.getSize() == 128);
+    for (unsigned i = 0; i < 40000; ++i)
+        assert(gmap.lookup(i) == i / 2);
+
+    // Test parallel operations
+
+    std::atomic<unsigned> visited(0);
+    gmap.parallelForEach([&](unsigned key, unsigned value) {
+        assert(value == key / 2);
+        ++visited;
+    }, 4);
+    assert(visited == 40000);
+
+    uint64_t sum = gmap.parallelReduce(
+        uint64_t(0), [](unsigned key, unsigned) { return uint64_t(key); },
+        [](uint64_t a, uint64_t b) { return a + b; }, 4);
+    assert(sum == 40000ull * 39999 / 2);
+
+    // Small maps are handled by the calling thread alone
+    HashMap<unsigned, unsigned, UnsignedHash> tiny(16);
+    for (unsigned i = 0; i < 10; ++i)
+        tiny.insert(i, i);
+    tiny.parallelForEach([](unsigned, unsigned) {
+        assert(std::this_thread::get_id() == mainThread);
+    }, 4);
+
+    // Large ones are split between the threads
+    std::vector<std::pair<unsigned, unsigned>> large;
+    for (unsigned i = 0; i < 300000; ++i)
+        large.emplace_back(i, 1);
+    HashMap<unsigned, unsigned, UnsignedHash> lgmap(large.begin(),
+                                                    large.end(), 4);
+    assert(lgmap.parallelReduce(
+               0u, [](unsigned, unsigned value) { return value; },
+               [](unsigned a, unsigned b) { return a + b; }, 4) == 300000);
+    HashMap<unsigned, unsigned, UnsignedHash> lgcopy(lgmap);
+    assert(lgcopy.size() == 300000);
+    lgmap.clear(4);
+    assert(lgmap.size() == 0 && lgcopy.lookup(299999) == 1);
+
+    HashMap<unsigned, unsigned, UnsignedHash> cmap(gmap);
+    assert(cmap.getCount() == 40000);
+    for (unsigned i = 0; i < 40000; ++i)
+        assert(cmap.lookup(i) == i / 2);
+
+    cmap.clear(4);
+    assert(cmap.getCount() == 0 && !cmap.exists(1));
+    cmap.insert(1, 2);
+    assert(cmap.lookup(1) == 2 && gmap.lookup(1) == 0);
+
+    // Without readers clear() frees the elements right away
+    {
+        HashMap<unsigned, Counted, UnsignedHash> counted(16);
+        for (unsigned i = 0; i < 1000; ++i)
+            counted.insert(i, Counted());
+        assert(Counted::live == 1000);
+        counted.clear();
+        assert(Counted::live == 0 && counted.getCount() == 0);
+    }
+
+    // Test batched operations while the map grows
+
+    HashMap<unsigned, unsigned, UnsignedHash> bmap(1, 4);
+    std::vector<std::pair<unsigned, unsigned>> pairs;
+    std::vector<unsigned> keys;
+
+    for (unsigned i = 0; i < 10000; ++i)
+    {
+        pairs.emplace_back(i, i * 3);
+        keys.push_back(i);
+    }
+    bmap.insertMany(pairs.data(), pairs.size());
+    assert(bmap.getCount() == 10000);
+
+    std::vector<unsigned> values(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    assert(bmap.lookupMany(keys.data(), keys.size(), values.data(),
+                           found.get()) == 10000);
+    for (unsigned i = 0; i < 10000; ++i)
+        assert(found[i] && values[i] == i * 3);
+
+    assert(bmap.removeMany(keys.data(), 5000) == 5000);
+    bmap.existsMany(keys.data(), keys.size(), found.get());
+    for (unsigned i = 0; i < 10000; ++i)
+        assert(found[i] == (i >= 5000));
+
+    // Test the plain new/delete node allocator
+
+    HashMap<unsigned, std::string, UnsignedHash, NewAllocator> nmap(16);
+
+    for (unsigned key = 0; key < KEYS; ++key)
+        nmap.insert(key, valueFor(key, 1));
+    for (unsigned key = 0; key < KEYS; key += 2)
+        nmap.remove(key);
+    for (unsigned key = 1; key < KEYS; key += 2)
+        assert(nmap.lookup(key) == valueFor(key, 1));
+
+    HashMap<unsigned, std::string, UnsignedHash, NewAllocator> nmap2;
+    nmap2 = std::move(nmap);
+    assert(nmap2.getCount() == KEYS / 2);
+
+    std::cout << "Success!" << std::endl;
+}
@@ -0,0 +1,128 @@
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "lockfreehashmap.h"
+
+constexpr unsigned MAX_TABLE_SIZE = 100;
+static constexpr unsigned hashConst = 17; // A prime number
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return (key * key + hashConst) % MAX_TABLE_SIZE;
+    }
+};
+
+LockFreeHashMap<unsigned, std::string, UnsignedHash> umap(MAX_TABLE_SIZE);
+LockFreeHashMap<unsigned, unsigned, UnsignedHash> tmap(2);
+std::atomic<bool> done(false);
+
+void writer(unsigned id)
+{
+    for (unsigned i = 0; i < 20000; ++i)
+    {
+        unsigned key = id * 100000 + i;
+        tmap.insert(key, i);
+        tmap.insert(key, i + 1);
+        if (i % 2 == 0)
+            tmap.remove(key);
+    }
+}
+
+// Keys 0..999 are never removed, so they must always be found.
+void reader()
+{
+    while (!done)
+    {
+        for (unsigned i = 0; i < 1000; ++i)
+            assert(tmap.lookup(i) == i);
+
+        unsigned count = 0;
+        for (auto it = tmap.begin(); it != tmap.end(); ++it)
+            if ((*it)->key < 1000)
+                ++count;
+        assert(count == 1000);
+    }
+}
+
+int main()
+{
+    std::string msg;
+
+    umap.insert(25, "hello");
+    umap.insert(34, "world");
+    umap.insert(43, "one");
+    umap.insert(143, "two");
+    umap.insert(754, "three");
+
+    assert(umap.lookup(25) == "hello");
+    assert(umap.lookup(34) == "world");
+    assert(umap.lookup(143) == "two");
+    assert(umap.lookup(754) == "three");
+
+    umap.remove(25);
+    umap.remove(143);
+
+    assert(umap.exists(25) == false);
+    assert(umap.exists(143) == false);
+    assert(umap.exists(43) == true);
+
+    umap.insert(43, "new value");
+    assert(umap.lookup(43) == "new value");
+    assert(umap.getCount() == 3);
+
+    try
+    {
+        // Try to remove non-existing key
+        umap.remove(60);
+    }
+    catch (std::out_of_range &e)
+    {
+        msg = e.what();
+    }
+
+    assert(msg == "LockFreeHashMap: key doesn't exists");
+
+    // Test copy and move
+
+    LockFreeHashMap<unsigned, std::string, UnsignedHash> umap2 = umap;
+    assert(umap2.lookup(754) == "three");
+
+    LockFreeHashMap<unsigned, std::string, UnsignedHash> umap3;
+    umap3 = std::move(umap2);
+    assert(umap2.getCount() == 0);
+    assert(umap3.lookup(43) == "new value");
+
+    // Test concurrent writers, readers and iterators while buckets split
+
+    for (unsigned i = 0; i < 1000; ++i)
+        tmap.insert(i, i);
+
+    std::vector<std::thread> readers;
+    std::vector<std::thread> writers;
+
+    for (unsigned i = 0; i < 2; ++i)
+        readers.emplace_back(reader);
+    for (unsigned i = 1; i <= 3; ++i)
+        writers.emplace_back(writer, i);
+
+    for (auto &t : writers)
+        t.join();
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    assert(tmap.getCount() == 1000 + 3 * 10000);
+    assert(tmap.getSize() > 2);
+
+    for (unsigned id = 1; id <= 3; ++id)
+        for (unsigned i = 0; i < 20000; ++i)
+            assert(tmap.exists(id * 100000 + i) == (i % 2 == 1));
+
+    std::cout << "Success!" << std::endl;
+}
@@ -0,0 +1,159 @@
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "frozenhashmap.h"
+
+constexpr unsigned MAX_TABLE_SIZE = 100;
+constexpr unsigned KEYS = 100000;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return (key * key + 17) % MAX_TABLE_SIZE;
+    }
+};
+
+class StringHash
+{
+public:
+    unsigned operator()(const std::string &key)
+    {
+        unsigned res = 0;
+        for (char c : key)
+            res = res * 31 + (unsigned char) c;
+        return res;
+    }
+};
+
+struct Point
+{
+    int x, y;
+    float weight;
+
+    bool operator==(const Point &other) const
+    {
+        return x == other.x && y == other.y && weight == other.weight;
+    }
+    bool operator!=(const Point &other) const { return !(*this == other); }
+};
+
+class PointHash
+{
+public:
+    unsigned operator()(const Point &p)
+    {
+        return p.x * 31 + p.y;
+    }
+};
+
+int main()
+{
+    // Test building from HashMap, with a hash functor which clusters keys
+
+    HashMap<unsigned, unsigned, UnsignedHash> umap(MAX_TABLE_SIZE);
+
+    for (unsigned i = 0; i < KEYS; ++i)
+        umap.insert(i * 3, i);
+
+    FrozenHashMap<unsigned, unsigned, UnsignedHash> fmap(umap);
+
+    assert(fmap.getCount() == KEYS);
+    for (unsigned i = 0; i < KEYS; ++i)
+    {
+        assert(fmap.lookup(i * 3) == i);
+        assert(!fmap.exists(i * 3 + 1));
+    }
+
+    std::string msg;
+    try
+    {
+        fmap.lookup(1);
+    }
+    catch (std::out_of_range &e)
+    {
+        msg = e.what();
+    }
+    assert(msg == "FrozenHashMap: key doesn't exists");
+
+    size_t count = 0;
+    for (auto &e : fmap)
+    {
+        assert(e.value * 3 == e.key);
+        ++count;
+    }
+    assert(count == KEYS);
+
+    // Test saving and loading
+
+    fmap.save("test7.frozen");
+
+    FrozenHashMap<unsigned, unsigned, UnsignedHash> lmap;
+    lmap.load("test7.frozen");
+    std::remove("test7.frozen");
+
+    assert(lmap.getCount() == KEYS);
+    for (unsigned i = 0; i < KEYS; ++i)
+        assert(lmap[i * 3] == i && !lmap.exists(i * 3 + 2));
+
+    // Test string keys
+
+    HashMap<std::string, unsigned, StringHash> smap(MAX_TABLE_SIZE);
+
+    for (unsigned i = 0; i < 1000; ++i)
+        smap.insert("key" + std::to_string(i), i);
+
+    FrozenHashMap<std::string, unsigned, StringHash> fsmap(smap);
+
+    for (unsigned i = 0; i < 1000; ++i)
+        assert(fsmap.lookup("key" + std::to_string(i)) == i);
+    assert(fsmap.find("key1000") == nullptr);
+
+    // Test keys hashed by the functor, and an empty map
+
+    std::vector<std::pair<Point, unsigned>> points;
+    for (int i = 0; i < 1000; ++i)
+        points.push_back({{i, -i, 0.5f}, (unsigned)i});
+
+    FrozenHashMap<Point, unsigned, PointHash> fpmap(points);
+
+    for (int i = 0; i < 1000; ++i)
+        assert(fpmap.lookup({i, -i, 0.5f}) == (unsigned)i);
+    assert(!fpmap.exists({1, 1, 0.5f}));
+
+    // Keys with equal hash codes can't be placed, whatever the pilot
+
+    std::vector<std::pair<Point, unsigned>> clash = {{{1, 0, 0.5f}, 1},
+                                                     {{0, 31, 0.5f}, 2}};
+    msg.clear();
+    try
+    {
+        FrozenHashMap<Point, unsigned, PointHash> cmap(clash);
+    }
+    catch (std::invalid_argument &e)
+    {
+        msg = e.what();
+    }
+    assert(msg == "FrozenHashMap: keys with equal hash codes");
+
+    // Test a larger build, where many keys land in the extra slots and are
+    // remapped
+
+    std::vector<std::pair<unsigned, unsigned>> many;
+    for (unsigned i = 0; i < (1u << 20); ++i)
+        many.push_back({i * 5, i});
+
+    FrozenHashMap<unsigned, unsigned, UnsignedHash> bigmap(many);
+
+    for (unsigned i = 0; i < (1u << 20); ++i)
+        assert(bigmap.lookup(i * 5) == i && !bigmap.exists(i * 5 + 1));
+
+    FrozenHashMap<unsigned, unsigned, UnsignedHash> empty;
+    assert(empty.getCount() == 0 && !empty.exists(0));
+
+    std::cout << "Success!" << std::endl;
+}
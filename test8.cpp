@@ -0,0 +1,117 @@
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shardedhashmap.h"
+
+constexpr unsigned KEYS = 40000;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key;
+    }
+};
+
+// Counts its calls, to check that a key is hashed once per operation
+class CountingHash
+{
+public:
+    static inline std::atomic<unsigned> calls{0};
+
+    uint64_t operator()(const std::string &key)
+    {
+        ++calls;
+        return DefaultHash<std::string>()(key);
+    }
+};
+
+ShardedHashMap<unsigned, unsigned, UnsignedHash> map(1000);
+
+void writer(unsigned id)
+{
+    // Work on the shards of our node first, then on the rest.
+    NumaTopology::get().bindToNode(id % NumaTopology::get().getNodeCount());
+
+    for (unsigned i = id; i < KEYS; i += 4)
+        map.insert(i, i * 2);
+}
+
+int main()
+{
+    const NumaTopology &topology = NumaTopology::get();
+
+    assert(topology.getNodeCount() >= 1);
+    assert(!topology.getCpus(0).empty());
+    assert(topology.currentNode() < topology.getNodeCount());
+
+    assert(map.getShardCount() ==
+           topology.getNodeCount() * map.SHARDS_PER_NODE);
+    for (size_t i = 0; i < map.getShardCount(); ++i)
+        assert(map.getNodeOf(i) < topology.getNodeCount());
+    assert(!map.getLocalShards().empty());
+
+    // Test concurrent inserts and lookups
+
+    std::vector<std::thread> writers;
+    for (unsigned id = 0; id < 4; ++id)
+        writers.emplace_back(writer, id);
+    for (auto &t : writers)
+        t.join();
+
+    assert(map.getCount() == KEYS);
+    for (unsigned i = 0; i < KEYS; ++i)
+    {
+        assert(map.lookup(i) == i * 2);
+        assert(map.find(i) && *map.find(i) == i * 2);
+    }
+
+    // Keys are spread over all shards
+
+    for (size_t i = 0; i < map.getShardCount(); ++i)
+        assert(map.getShard(i).getCount() > KEYS / map.getShardCount() / 2);
+
+    map.remove(0);
+    assert(!map.exists(0));
+    assert(map.fetchAdd(0, 5u) == 0 && map[0] == 5);
+
+    std::atomic<unsigned> visited(0);
+    map.parallelForEach([&](unsigned, unsigned) { ++visited; });
+    assert(visited == KEYS);
+
+    // Explicit shard count
+
+    ShardedHashMap<unsigned, unsigned, UnsignedHash> map3(100, 3, 4);
+    assert(map3.getShardCount() == 3);
+    for (unsigned i = 0; i < 1000; ++i)
+        map3.insert(i, i);
+    for (unsigned i = 0; i < 1000; ++i)
+        assert(&map3.getShard(i) == &map3.getShard(map3.getShardIndex(i)) &&
+               map3.getShard(i).lookup(i) == i);
+
+    // Shards hash like the map, so they can be used directly, and every
+    // operation hashes the key once
+
+    ShardedHashMap<std::string, unsigned, SeededHash<std::string>> seeded(100);
+    for (unsigned i = 0; i < 1000; ++i)
+        seeded.insert(std::to_string(i), i);
+    for (unsigned i = 0; i < 1000; ++i)
+        assert(seeded.getShard(std::to_string(i)).lookup(std::to_string(i)) ==
+               i);
+    assert(!seeded.upsert("1", [](unsigned &v) { v += 1; }, 0u));
+    assert(seeded.lookup("1") == 2);
+
+    ShardedHashMap<std::string, unsigned, CountingHash> counted(100);
+    counted.insert("key", 1);
+    counted.lookup("key");
+    counted.upsert("key", [](unsigned &v) { ++v; }, 0u);
+    counted.remove("key");
+    assert(CountingHash::calls == 4);
+
+    std::cout << "Success!" << std::endl;
+}
@@ -0,0 +1,162 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cachehashmap.h"
+
+constexpr unsigned CAPACITY = 1024;
+constexpr unsigned KEYS = 20000;
+
+class UnsignedHash
+{
+public:
+    unsigned operator()(unsigned key)
+    {
+        return key;
+    }
+};
+
+typedef CacheHashMap<unsigned, unsigned, UnsignedHash> Cache;
+
+Cache cache(CAPACITY);
+std::atomic<unsigned> evictions(0);
+
+void writer(unsigned id)
+{
+    for (unsigned i = id; i < KEYS; i += 4)
+    {
+        cache.insert(i, i * 2);
+        try
+        {
+            assert(cache.lookup(i / 2) == i / 2 * 2);
+        }
+        catch (std::out_of_range &e)
+        {
+        }
+    }
+}
+
+int main()
+{
+    cache.setEvictionCallback([](const unsigned &key, const unsigned &value,
+                                 Cache::EvictionReason reason) {
+        assert(value == key * 2);
+        assert(reason == Cache::EvictionReason::Capacity);
+        ++evictions;
+    });
+
+    // Test concurrent inserts and lookups beyond the capacity
+
+    std::vector<std::thread> writers;
+    for (unsigned id = 0; id < 4; ++id)
+        writers.emplace_back(writer, id);
+    for (auto &t : writers)
+        t.join();
+
+    assert(cache.getCount() <= CAPACITY);
+    assert(cache.getWeight() == cache.getCount());
+    assert(cache.getCount() + evictions == KEYS);
+
+    // Test that referenced entries survive a round of the clock
+
+    Cache small(4, Cache::Clock::duration::zero(), 1);
+    for (unsigned i = 0; i < 4; ++i)
+        small.insert(i, i);
+    for (unsigned i = 4; i < 8; ++i)
+    {
+        small.lookup(0);
+        small.insert(i, i);
+    }
+    assert(small.getCount() == 4);
+    assert(small.exists(0));
+    assert(small.exists(7));
+
+    small.insert(7, 70);
+    assert(small.lookup(7) == 70);
+    assert(small.getCount() == 4);
+    small.remove(7);
+    assert(!small.exists(7));
+    try
+    {
+        small.remove(7);
+        assert(false);
+    }
+    catch (std::out_of_range &e)
+    {
+    }
+
+    // Test lazy expiry
+
+    CacheHashMap<unsigned, std::string, UnsignedHash> timed(
+        16, std::chrono::milliseconds(20));
+    unsigned expired = 0;
+
+    timed.setEvictionCallback([&](const unsigned &key,
+                                  const std::string &value,
+                                  decltype(timed)::EvictionReason reason) {
+        assert(key == 1 && value == "one");
+        assert(reason == decltype(timed)::EvictionReason::Expired);
+        ++expired;
+    });
+    timed.insert(1, "one");
+    timed.insert(2, "two", decltype(timed)::Clock::duration::zero());
+    assert(timed.lookup(1) == "one");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    assert(!timed.exists(1));
+    assert(timed.getCount() == 2);
+    try
+    {
+        timed.lookup(1);
+        assert(false);
+    }
+    catch (std::out_of_range &e)
+    {
+    }
+    assert(expired == 1);
+    assert(timed.getCount() == 1);
+    assert(timed.lookup(2) == "two");
+
+    // Test a byte capacity
+
+    CacheHashMap<unsigned, std::string, UnsignedHash> bytes(100, {}, 1);
+    bytes.setWeigher([](const unsigned &, const std::string &value) {
+        return value.size();
+    });
+    for (unsigned i = 0; i < 50; ++i)
+        bytes.insert(i, std::string(i % 20 + 1, 'x'));
+    assert(bytes.getWeight() <= 100);
+    bytes.insert(1000, std::string(100, 'y'));
+    assert(bytes.getCount() == 1);
+    assert(bytes.getWeight() == 100);
+
+    // Entries heavier than a segment are evicted right away, and take the
+    // old value of their key with them
+
+    CacheHashMap<unsigned, std::string, UnsignedHash> big(1 << 20);
+    unsigned rejected = 0;
+
+    big.setWeigher([](const unsigned &, const std::string &value) {
+        return value.size();
+    });
+    big.setEvictionCallback([&](const unsigned &key, const std::string &value,
+                                decltype(big)::EvictionReason reason) {
+        assert(key == 3 && value.size() == 20000);
+        assert(reason == decltype(big)::EvictionReason::Capacity);
+        ++rejected;
+    });
+    assert(big.getSegmentCapacity() == (1 << 20) / 64);
+    for (unsigned i = 0; i < 10; ++i)
+        big.insert(i, std::string(1000, 'x'));
+    big.insert(3, std::string(20000, 'y'));
+    assert(rejected == 1 && !big.exists(3));
+    assert(big.getCount() == 9 && big.getWeight() == 9000);
+    assert(big.getWeight() <= big.getCapacity());
+
+    std::cout << "Success!" << std::endl;
+}